@@ -0,0 +1,92 @@
+/*
+ *  Affine2D.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "Affine2D.h"
+
+// Doubles go two at a time with SSE2 or four at a time with AVX.
+// Multiplies and adds are done in the same order as the one point version,
+//  so the answers are identical.
+void Affine2D::transformPoints(const double *xs,const double *ys,double *outXs,double *outYs,int numPts) const
+{
+	int ii = 0;
+
+#if defined(__AVX__)
+	__m256d a00 = _mm256_set1_pd(m00), a01 = _mm256_set1_pd(m01), a02 = _mm256_set1_pd(m02);
+	__m256d a10 = _mm256_set1_pd(m10), a11 = _mm256_set1_pd(m11), a12 = _mm256_set1_pd(m12);
+	for (; ii + 4 <= numPts; ii += 4)
+	{
+		__m256d x = _mm256_loadu_pd(xs + ii), y = _mm256_loadu_pd(ys + ii);
+		__m256d outX = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a00,x),_mm256_mul_pd(a01,y)),a02);
+		__m256d outY = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a10,x),_mm256_mul_pd(a11,y)),a12);
+		_mm256_storeu_pd(outXs + ii,outX);
+		_mm256_storeu_pd(outYs + ii,outY);
+	}
+#elif defined(__SSE2__)
+	__m128d a00 = _mm_set1_pd(m00), a01 = _mm_set1_pd(m01), a02 = _mm_set1_pd(m02);
+	__m128d a10 = _mm_set1_pd(m10), a11 = _mm_set1_pd(m11), a12 = _mm_set1_pd(m12);
+	for (; ii + 2 <= numPts; ii += 2)
+	{
+		__m128d x = _mm_loadu_pd(xs + ii), y = _mm_loadu_pd(ys + ii);
+		__m128d outX = _mm_add_pd(_mm_add_pd(_mm_mul_pd(a00,x),_mm_mul_pd(a01,y)),a02);
+		__m128d outY = _mm_add_pd(_mm_add_pd(_mm_mul_pd(a10,x),_mm_mul_pd(a11,y)),a12);
+		_mm_storeu_pd(outXs + ii,outX);
+		_mm_storeu_pd(outYs + ii,outY);
+	}
+#endif
+
+	// Whatever's left over, or everything if there's no SIMD
+	for (; ii < numPts; ii++)
+	{
+		double x = xs[ii], y = ys[ii];
+		outXs[ii] = m00*x + m01*y + m02;
+		outYs[ii] = m10*x + m11*y + m12;
+	}
+}
+
+// Floats go four at a time with SSE2 or eight at a time with AVX
+void Affine2D::transformPoints(const float *xs,const float *ys,float *outXs,float *outYs,int numPts) const
+{
+	float f00 = m00, f01 = m01, f02 = m02;
+	float f10 = m10, f11 = m11, f12 = m12;
+	int ii = 0;
+
+#if defined(__AVX__)
+	__m256 a00 = _mm256_set1_ps(f00), a01 = _mm256_set1_ps(f01), a02 = _mm256_set1_ps(f02);
+	__m256 a10 = _mm256_set1_ps(f10), a11 = _mm256_set1_ps(f11), a12 = _mm256_set1_ps(f12);
+	for (; ii + 8 <= numPts; ii += 8)
+	{
+		__m256 x = _mm256_loadu_ps(xs + ii), y = _mm256_loadu_ps(ys + ii);
+		__m256 outX = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a00,x),_mm256_mul_ps(a01,y)),a02);
+		__m256 outY = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a10,x),_mm256_mul_ps(a11,y)),a12);
+		_mm256_storeu_ps(outXs + ii,outX);
+		_mm256_storeu_ps(outYs + ii,outY);
+	}
+#elif defined(__SSE2__)
+	__m128 a00 = _mm_set1_ps(f00), a01 = _mm_set1_ps(f01), a02 = _mm_set1_ps(f02);
+	__m128 a10 = _mm_set1_ps(f10), a11 = _mm_set1_ps(f11), a12 = _mm_set1_ps(f12);
+	for (; ii + 4 <= numPts; ii += 4)
+	{
+		__m128 x = _mm_loadu_ps(xs + ii), y = _mm_loadu_ps(ys + ii);
+		__m128 outX = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a00,x),_mm_mul_ps(a01,y)),a02);
+		__m128 outY = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a10,x),_mm_mul_ps(a11,y)),a12);
+		_mm_storeu_ps(outXs + ii,outX);
+		_mm_storeu_ps(outYs + ii,outY);
+	}
+#endif
+
+	for (; ii < numPts; ii++)
+	{
+		float x = xs[ii], y = ys[ii];
+		outXs[ii] = f00*x + f01*y + f02;
+		outYs[ii] = f10*x + f11*y + f12;
+	}
+}
@@ -0,0 +1,107 @@
+/*
+ *  Affine2D.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  A 2D affine transform: the top two rows of a 3x3 matrix whose
+ *  bottom row is always (0, 0, 1).  Everything we do to get between
+ *  image space and qyoo space is affine, so this is all we need.
+ */
+
+#ifndef AFFINE2D_H
+#define AFFINE2D_H
+
+#import <math.h>
+#import <cml/cml.h>
+
+// Typedef for a 3x3 matrix using row_basis layout for transformations.
+// Affine2D converts to and from this for older code.
+typedef cml::matrix<double, cml::fixed<3, 3>, cml::row_basis> QyooMatrix;
+
+/* Affine 2D
+	Maps (x,y) to (m00*x + m01*y + m02, m10*x + m11*y + m12).
+	Multiplying works like it does for the full matrices,
+	 so (a * b).transform(p) is a.transform(b.transform(p)).
+ */
+class Affine2D
+{
+public:
+	// Identity
+	Affine2D() { m00 = 1.0;  m01 = 0.0;  m02 = 0.0;  m10 = 0.0;  m11 = 1.0;  m12 = 0.0; }
+	Affine2D(double in00,double in01,double in02,double in10,double in11,double in12)
+	{
+		m00 = in00;  m01 = in01;  m02 = in02;
+		m10 = in10;  m11 = in11;  m12 = in12;
+	}
+	// Take the top two rows of a full matrix
+	Affine2D(const QyooMatrix &mat)
+	{
+		m00 = mat(0,0);  m01 = mat(0,1);  m02 = mat(0,2);
+		m10 = mat(1,0);  m11 = mat(1,1);  m12 = mat(1,2);
+	}
+
+	// The basic transforms
+	static Affine2D translate(double tx,double ty) { return Affine2D(1.0,0.0,tx, 0.0,1.0,ty); }
+	static Affine2D scale(double sx,double sy) { return Affine2D(sx,0.0,0.0, 0.0,sy,0.0); }
+	static Affine2D rotate(double angle)  // Radians, counterclockwise
+	{
+		double c = cos(angle), s = sin(angle);
+		return Affine2D(c,-s,0.0, s,c,0.0);
+	}
+	static Affine2D sheerX(double sheer) { return Affine2D(1.0,sheer,0.0, 0.0,1.0,0.0); }
+
+	// Back out to a full matrix
+	QyooMatrix toQyooMatrix() const
+	{
+		return QyooMatrix(m00, m01, m02,
+						  m10, m11, m12,
+						  0.0, 0.0, 1.0);
+	}
+
+	Affine2D operator * (const Affine2D &that) const
+	{
+		return Affine2D(m00*that.m00 + m01*that.m10, m00*that.m01 + m01*that.m11, m00*that.m02 + m01*that.m12 + m02,
+						m10*that.m00 + m11*that.m10, m10*that.m01 + m11*that.m11, m10*that.m02 + m11*that.m12 + m12);
+	}
+
+	inline double determinant() const { return m00*m11 - m01*m10; }
+
+	// Closed form inverse.  Returns false (and leaves inv alone) if it's singular.
+	bool inverse(Affine2D &inv) const
+	{
+		double det = determinant();
+		if (det == 0.0)
+			return false;
+		double invDet = 1.0 / det;
+		inv.m00 =  m11 * invDet;  inv.m01 = -m01 * invDet;
+		inv.m10 = -m10 * invDet;  inv.m11 =  m00 * invDet;
+		inv.m02 = -(inv.m00 * m02 + inv.m01 * m12);
+		inv.m12 = -(inv.m10 * m02 + inv.m11 * m12);
+		return true;
+	}
+
+	// Single points
+	inline void transform(double x,double y,double &outX,double &outY) const
+	{
+		outX = m00*x + m01*y + m02;
+		outY = m10*x + m11*y + m12;
+	}
+	inline void transform(float x,float y,float &outX,float &outY) const
+	{
+		outX = m00*x + m01*y + m02;
+		outY = m10*x + m11*y + m12;
+	}
+
+	// Batches of points, with the X and Y values in separate arrays.
+	// The outputs can be the same arrays as the inputs.
+	// The float versions do the math in float, so they're a bit looser
+	//  than transforming one point at a time.
+	void transformPoints(const double *xs,const double *ys,double *outXs,double *outYs,int numPts) const;
+	void transformPoints(const float *xs,const float *ys,float *outXs,float *outYs,int numPts) const;
+
+	double m00, m01, m02;
+	double m10, m11, m12;
+};
+
+#endif // AFFINE2D_H
@@ -0,0 +1,416 @@
+/*
+ *  BatchPipeline.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "BatchPipeline.h"
+#include "Logger.h"
+
+BatchItem::~BatchItem()
+{
+    if (image)
+        gdImageDestroy(image);
+    for (auto &ann : annotations)
+        delete ann.dotImg;
+}
+
+BatchPipeline::BatchPipeline()
+{
+    firstMatch = false;
+    annotate = true;
+    cache = NULL;
+    numReadThreads = numDecodeThreads = numDetectThreads = numWriteThreads = 0;
+    queueSize = 0;
+    sampleMs = 10;
+    reportMs = 1000;
+    stop = NULL;
+    numImages = numWithQyoo = numNotFound = numFailed = 0;
+    totalMs = 0.0;
+    numSamples = 0;
+    nextOutput = 0;
+    abandoned.store(false);
+}
+
+void BatchPipeline::setThreads(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = std::thread::hardware_concurrency();
+    if (numThreads <= 0)
+        numThreads = 1;
+
+    // Reading and writing mostly wait on the disk, so they don't come out of the count.
+    // Decoding a PNG is a small fraction of detecting in it.
+    if (numReadThreads <= 0)
+        numReadThreads = 1;
+    if (numWriteThreads <= 0)
+        numWriteThreads = 1;
+    if (numDecodeThreads <= 0)
+        numDecodeThreads = std::max(numThreads / 4, 1);
+    if (numDetectThreads <= 0)
+        numDetectThreads = std::max(numThreads - numDecodeThreads, 1);
+}
+
+bool BatchPipeline::nextItem(BoundedQueue<BatchItem *> &queue, Stage stage, BatchItem *&item)
+{
+    int numIdle = 0;
+    for (;;)
+    {
+        // Everything the stage before us pushed is visible once it says it's done
+        bool done = threadsLeft[stage - 1].load(std::memory_order_acquire) == 0;
+        if (queue.tryPop(item))
+            return true;
+        if (done)
+            return false;
+        BoundedQueueWait(numIdle);
+    }
+}
+
+void BatchPipeline::passItem(BoundedQueue<BatchItem *> &queue, BatchItem *item)
+{
+    int numIdle = 0;
+    while (!queue.tryPush(item))
+        BoundedQueueWait(numIdle);
+}
+
+void BatchPipeline::addStats(Stage stage, double busyMs, int numItems)
+{
+    std::lock_guard<std::mutex> lock(statsLock);
+    stats[stage].busyMs += busyMs;
+    stats[stage].numItems += numItems;
+}
+
+static double msSince(std::chrono::steady_clock::time_point startTime)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void BatchPipeline::readLoop(const std::vector<std::string> &fileNames, BoundedQueue<BatchItem *> &outQueue)
+{
+    double busyMs = 0.0;
+    int numItems = 0;
+    int index;
+    // Check before taking a file, so every file taken goes all the way through
+    while (!(stop && *stop) && !abandoned.load() && (index = nextFile.fetch_add(1)) < (int)fileNames.size())
+    {
+        auto startTime = std::chrono::steady_clock::now();
+        BatchItem *item = new BatchItem();
+        item->index = index;
+        item->fileName = fileNames[index];
+
+        std::ifstream file(item->fileName, std::ios::binary);
+        if (file)
+        {
+            std::ostringstream strm;
+            strm << file.rdbuf();
+            item->data = strm.str();
+        } else
+            item->error = "Unable to open image file";
+
+        busyMs += msSince(startTime);
+        numItems++;
+        passItem(outQueue, item);
+    }
+
+    addStats(StageRead, busyMs, numItems);
+    threadsLeft[StageRead].fetch_sub(1, std::memory_order_release);
+}
+
+void BatchPipeline::decodeLoop(BoundedQueue<BatchItem *> &inQueue, BoundedQueue<BatchItem *> &outQueue)
+{
+    double busyMs = 0.0;
+    int numItems = 0;
+    BatchItem *item;
+    while (nextItem(inQueue, StageDecode, item))
+    {
+        auto startTime = std::chrono::steady_clock::now();
+        if (item->error.empty() && cache)
+        {
+            ResultCacheEntry entry;
+            item->cacheKey = cache->makeKey(item->data.data(), item->data.size());
+            if ((item->cached = cache->lookup(item->cacheKey, entry)))
+            {
+                item->numFound = entry.numFound;
+                item->resultText = entry.text;
+            }
+        }
+        if (item->error.empty() && !item->cached)
+        {
+            gdImagePtr image = item->data.empty() ? NULL : gdImageCreateFromPngPtr(item->data.size(), &item->data[0]);
+            item->image = image ? gdMakeTrueColor(image) : NULL;
+            if (!item->image)
+                item->error = "Unable to load image";
+        }
+        std::string().swap(item->data);
+
+        busyMs += msSince(startTime);
+        numItems++;
+        passItem(outQueue, item);
+    }
+
+    addStats(StageDecode, busyMs, numItems);
+    threadsLeft[StageDecode].fetch_sub(1, std::memory_order_release);
+}
+
+void BatchPipeline::detectLoop(BoundedQueue<BatchItem *> &inQueue, BoundedQueue<BatchItem *> &outQueue)
+{
+    double busyMs = 0.0;
+    int numItems = 0;
+    FeatureProcessor *proc = NULL;
+    BatchItem *item;
+    while (nextItem(inQueue, StageDetect, item))
+    {
+        auto startTime = std::chrono::steady_clock::now();
+        if (item->error.empty() && !item->cached)
+        {
+            item->numFound = DetectImage(item->image, proc, params, firstMatch, item->resultText, item->budgetExceeded);
+            if (cache && !item->budgetExceeded)
+            {
+                ResultCacheEntry entry;
+                entry.numFound = item->numFound;
+                entry.text = item->resultText;
+                cache->store(item->cacheKey, entry);
+            }
+
+            // The dot images go to the writer, and the processor is free for the next image
+            if (annotate)
+                for (auto *featDots : proc->featureDots)
+                    if (!featDots->feat->dotDecStr.empty())
+                    {
+                        BatchAnnotation ann;
+                        ann.dotImg = featDots->grayImg;
+                        ann.dotBits = featDots->feat->dotBits;
+                        ann.value = featDots->feat->dotDecStr;
+                        featDots->grayImg = NULL;
+                        item->annotations.push_back(ann);
+                    }
+
+            gdImageDestroy(item->image);
+            item->image = NULL;
+        }
+
+        busyMs += msSince(startTime);
+        numItems++;
+        passItem(outQueue, item);
+    }
+    delete proc;
+
+    addStats(StageDetect, busyMs, numItems);
+    threadsLeft[StageDetect].fetch_sub(1, std::memory_order_release);
+}
+
+void BatchPipeline::writeLoop(BoundedQueue<BatchItem *> &inQueue)
+{
+    double busyMs = 0.0;
+    int numItems = 0;
+    BatchItem *item;
+    while (nextItem(inQueue, StageWrite, item))
+    {
+        auto startTime = std::chrono::steady_clock::now();
+        for (auto &ann : item->annotations)
+        {
+            FeatureDotsProcessor::saveDots(ann.dotImg, ann.dotBits, "output/" + ann.value + ".png");
+            delete ann.dotImg;
+            ann.dotImg = NULL;
+        }
+        finishItem(item);
+
+        busyMs += msSince(startTime);
+        numItems++;
+    }
+
+    addStats(StageWrite, busyMs, numItems);
+    threadsLeft[StageWrite].fetch_sub(1, std::memory_order_release);
+}
+
+void BatchPipeline::finishItem(BatchItem *inItem)
+{
+    std::lock_guard<std::mutex> lock(outputLock);
+    pending[inItem->index] = inItem;
+
+    while (!pending.empty() && pending.begin()->first == nextOutput)
+    {
+        BatchItem *item = pending.begin()->second;
+        pending.erase(pending.begin());
+        nextOutput++;
+
+        if (!item->error.empty())
+            numFailed++;
+        else if (item->numFound == 0)
+            numNotFound++;
+        else
+            numWithQyoo++;
+        reportItem(item);
+
+        delete item;
+    }
+}
+
+void BatchPipeline::reportItem(BatchItem *item)
+{
+    if (!item->error.empty())
+    {
+        std::cerr << "Error: " << item->error << ": " << item->fileName << std::endl;
+        std::cout << item->fileName << ": failed" << std::endl;
+    } else if (item->numFound == 0)
+        std::cout << item->fileName << ": not found" << std::endl;
+    else
+    {
+        std::istringstream lines(item->resultText);
+        std::string line;
+        while (std::getline(lines, line))
+            std::cout << item->fileName << ": " << line << std::endl;
+    }
+    if (item->budgetExceeded)
+        std::cerr << "Warning: Detection budget exceeded, results may be incomplete: " << item->fileName << std::endl;
+}
+
+bool BatchPipeline::run(const std::vector<std::string> &fileNames)
+{
+    if (numDetectThreads <= 0 || numDecodeThreads <= 0 || numReadThreads <= 0 || numWriteThreads <= 0)
+        setThreads(0);
+    int capacity = queueSize > 0 ? queueSize : std::max(2 * numDetectThreads, 4);
+
+    numImages = fileNames.size();
+    numWithQyoo = numNotFound = numFailed = 0;
+    numSamples = 0;
+    nextOutput = 0;
+    nextFile.store(0);
+    abandoned.store(false);
+
+    // Queue in front of each stage but the first
+    BoundedQueue<BatchItem *> decodeQueue(capacity), detectQueue(capacity), writeQueue(capacity);
+    BoundedQueue<BatchItem *> *queues[NumStages] = {NULL, &decodeQueue, &detectQueue, &writeQueue};
+
+    int numThreads[NumStages] = {numReadThreads, numDecodeThreads, numDetectThreads, numWriteThreads};
+    for (int ii = 0; ii < NumStages; ii++)
+    {
+        stats[ii] = BatchStageStats();
+        stats[ii].numThreads = numThreads[ii];
+        // What the queue rounded it up to
+        stats[ii].queueCapacity = queues[ii] ? queues[ii]->getCapacity() : 0;
+        threadsLeft[ii].store(numThreads[ii]);
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < numReadThreads; ii++)
+        threads.push_back(std::thread(&BatchPipeline::readLoop, this, std::cref(fileNames), std::ref(decodeQueue)));
+    for (int ii = 0; ii < numDecodeThreads; ii++)
+        threads.push_back(std::thread(&BatchPipeline::decodeLoop, this, std::ref(decodeQueue), std::ref(detectQueue)));
+    for (int ii = 0; ii < numDetectThreads; ii++)
+        threads.push_back(std::thread(&BatchPipeline::detectLoop, this, std::ref(detectQueue), std::ref(writeQueue)));
+    for (int ii = 0; ii < numWriteThreads; ii++)
+        threads.push_back(std::thread(&BatchPipeline::writeLoop, this, std::ref(writeQueue)));
+
+    // Keep an eye on the queues until the writers are done
+    double lastReport = 0.0;
+    while (threadsLeft[StageWrite].load(std::memory_order_acquire) > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::max(sampleMs, 1)));
+        numSamples++;
+        for (int ii = StageDecode; ii < NumStages; ii++)
+        {
+            int depth = queues[ii]->size();
+            stats[ii].depthSum += depth;
+            stats[ii].maxDepth = std::max(stats[ii].maxDepth, depth);
+        }
+
+        double elapsedMs = msSince(startTime);
+        if (verbose && elapsedMs - lastReport >= reportMs)
+        {
+            lastReport = elapsedMs;
+            int numDone;
+            {
+                std::lock_guard<std::mutex> lock(outputLock);
+                numDone = nextOutput;
+            }
+            logVerbose("Batch: " + std::to_string(numDone) + " of " + std::to_string(numImages) + " done, queue depths " +
+                       std::to_string(decodeQueue.size()) + "/" + std::to_string(detectQueue.size()) + "/" +
+                       std::to_string(writeQueue.size()));
+        }
+    }
+    for (auto &thread : threads)
+        thread.join();
+    totalMs = msSince(startTime);
+    numImages = nextOutput;     // Fewer than we were given if we were stopped
+
+    return numFailed == 0;
+}
+
+void BatchPipeline::printStats()
+{
+    static const char *stageNames[NumStages] = {"read", "decode", "detect", "write"};
+
+    std::cerr << "Batch of " << numImages << " images in " << totalMs << " ms, "
+              << (totalMs > 0.0 ? numImages * 1000.0 / totalMs : 0.0) << " images/s: " << numWithQyoo << " with a qyoo, "
+              << numNotFound << " not found, " << numFailed << " failed" << std::endl;
+    std::cerr << "  stage    threads  busy ms   busy %  queue  avg depth  max depth" << std::endl;
+    for (int ii = 0; ii < NumStages; ii++)
+    {
+        const BatchStageStats &stat = stats[ii];
+        double busyFrac = stat.numThreads > 0 && totalMs > 0.0 ? stat.busyMs / (stat.numThreads * totalMs) : 0.0;
+        std::cerr << "  " << std::left << std::setw(9) << stageNames[ii] << std::right << std::setw(7) << stat.numThreads
+                  << std::fixed << std::setprecision(1) << std::setw(9) << stat.busyMs << std::setw(9) << 100.0 * busyFrac;
+        if (ii == StageRead)
+            std::cerr << std::setw(7) << "-" << std::setw(11) << "-" << std::setw(11) << "-";
+        else
+            std::cerr << std::setw(7) << stat.queueCapacity << std::setw(11)
+                      << (numSamples > 0 ? (double)stat.depthSum / numSamples : 0.0) << std::setw(11) << stat.maxDepth;
+        std::cerr << std::defaultfloat << std::endl;
+    }
+    if (cache)
+        std::cerr << "  cache: " << cache->numHits << " hits, " << cache->numMisses << " misses, " << cache->numStored
+                  << " stored, " << cache->numEvicted << " evicted" << std::endl;
+}
+
+static bool isImageFile(const std::string &name)
+{
+    if (name.size() < 4 || name[0] == '.')
+        return false;
+    std::string ext = name.substr(name.size() - 4);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".png";
+}
+
+void BatchListFiles(const std::vector<std::string> &paths, std::vector<std::string> &fileNames)
+{
+    for (auto &path : paths)
+    {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+        {
+            fileNames.push_back(path);
+            continue;
+        }
+
+        DIR *dir = opendir(path.c_str());
+        if (!dir)
+        {
+            std::cerr << "Error: Unable to read directory: " << path << std::endl;
+            continue;
+        }
+        std::vector<std::string> names;
+        while (dirent *entry = readdir(dir))
+            if (isImageFile(entry->d_name))
+                names.push_back(entry->d_name);
+        closedir(dir);
+
+        std::sort(names.begin(), names.end());
+        std::string prefix = path.back() == '/' ? path : path + "/";
+        for (auto &name : names)
+            fileNames.push_back(prefix + name);
+    }
+}
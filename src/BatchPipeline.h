@@ -0,0 +1,153 @@
+/*
+ *  BatchPipeline.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Detection over a lot of image files at once.  Reading, decoding,
+ *  detection and writing out the results each get their own threads,
+ *  with a bounded queue between one stage and the next, so the detectors
+ *  aren't left waiting on the disk or on PNG compression.
+ */
+
+#ifndef BATCHPIPELINE_H
+#define BATCHPIPELINE_H
+
+#import <string>
+#import <vector>
+#import <map>
+#import <mutex>
+#import <atomic>
+#import <csignal>
+#import "BoundedQueue.h"
+#import "DetectServer.h"
+
+// Marked up dots for one qyoo, on its way to output/
+class BatchAnnotation
+{
+public:
+    RawImageGray8 *dotImg;              // Taken from the FeatureDotsProcessor
+    std::vector<unsigned char> dotBits;
+    std::string value;
+};
+
+// One file as it goes through the stages
+class BatchItem
+{
+public:
+    BatchItem() { index = 0;  image = NULL;  numFound = 0;  budgetExceeded = false;  cacheKey = 0;  cached = false; }
+    ~BatchItem();
+
+    int index;                  // Position in the file list, for putting the results back in order
+    std::string fileName;
+    std::string data;           // Encoded bytes, until they're decoded
+    gdImagePtr image;           // Until it's been through detection
+    std::string error;          // Set if something went wrong, and the rest of the stages pass it along
+    unsigned long long cacheKey;    // Of the encoded bytes, if there's a cache
+    bool cached;                // The results came from the cache, so it skips decoding and detection
+
+    int numFound;
+    bool budgetExceeded;
+    std::string resultText;     // Lines as from DetectImage()
+    std::vector<BatchAnnotation> annotations;
+};
+
+// Numbers for one stage and the queue that feeds it
+class BatchStageStats
+{
+public:
+    BatchStageStats() { numThreads = 0;  busyMs = 0.0;  numItems = 0;  queueCapacity = 0;  depthSum = 0;  maxDepth = 0; }
+
+    int numThreads;
+    double busyMs;              // Summed over the stage's threads
+    int numItems;
+    int queueCapacity;          // Of the queue in front of the stage (none for the reader)
+    long long depthSum;         // Queue depth summed over the samples
+    int maxDepth;
+};
+
+/* Batch Pipeline
+	Four stages:
+	 read: pulls the files into memory, ahead of the decoders
+	 decode: PNG to a true color image
+	 detect: each thread has its own FeatureProcessor, reused from one image to the next
+	 write: saves the marked up dots, then prints the results in file order
+	With a cache, the decoders look each file up before decoding it, and a
+	 hit goes straight through to the writer.  Hits have no marked up dots.
+	A stage that finds its output queue full waits, which holds up the
+	 stages behind it, so no more than a few queues' worth of images are ever
+	 in memory.
+	The main thread samples the queue depths while it waits for the rest.
+	 A queue that's always full is in front of the slow stage.
+ */
+class BatchPipeline
+{
+public:
+    BatchPipeline();
+    virtual ~BatchPipeline() { }
+
+    // Split numThreads between the stages, for whichever are left at 0.
+    // Detection gets most of them.
+    void setThreads(int numThreads);
+
+    // Run every file through.  Returns false if any of them failed.
+    bool run(const std::vector<std::string> &fileNames);
+
+    // Summary and per stage numbers to stderr
+    void printStats();
+
+    DetectionParams params;
+    bool firstMatch;
+    bool annotate;              // Save the marked up dots to output/, like the single image path
+    ResultCache *cache;         // Results by file content, if set.  Not owned.
+
+    int numReadThreads, numDecodeThreads, numDetectThreads, numWriteThreads;
+    int queueSize;              // Capacity of each queue, 0 for a couple per detector
+    int sampleMs;               // How often the queue depths are sampled
+    int reportMs;               // How often they're logged in verbose mode
+    volatile sig_atomic_t *stop;    // If set, no new files are started once it's nonzero
+
+    // Results
+    int numImages, numWithQyoo, numNotFound, numFailed;
+    double totalMs;
+
+    typedef enum {StageRead=0,StageDecode,StageDetect,StageWrite,NumStages} Stage;
+    BatchStageStats stats[NumStages];
+
+protected:
+    void readLoop(const std::vector<std::string> &fileNames, BoundedQueue<BatchItem *> &outQueue);
+    void decodeLoop(BoundedQueue<BatchItem *> &inQueue, BoundedQueue<BatchItem *> &outQueue);
+    void detectLoop(BoundedQueue<BatchItem *> &inQueue, BoundedQueue<BatchItem *> &outQueue);
+    void writeLoop(BoundedQueue<BatchItem *> &inQueue);
+
+    // Pop from a stage's input.  False once the stages feeding it are done and it's empty.
+    bool nextItem(BoundedQueue<BatchItem *> &queue, Stage stage, BatchItem *&item);
+    // For a stage that can't go on.  The files already started go through, but no more are.
+    void abandon() { abandoned.store(true); }
+    // Push to a stage's output, waiting for room
+    void passItem(BoundedQueue<BatchItem *> &queue, BatchItem *item);
+    // A thread's totals, when it's done
+    void addStats(Stage stage, double busyMs, int numItems);
+    // Report whatever's next in order, then free it
+    void finishItem(BatchItem *item);
+    // Called in file order, one at a time.  This prints the results to stdout.
+    virtual void reportItem(BatchItem *item);
+
+    std::atomic<int> nextFile;
+    std::atomic<bool> abandoned;
+    std::atomic<int> threadsLeft[NumStages];    // Still running, by stage
+
+    int numSamples;                             // Of the queue depths
+
+    std::mutex statsLock;
+    std::mutex outputLock;
+    std::map<int, BatchItem *> pending;         // Done, but waiting on an earlier file
+    int nextOutput;
+};
+
+/* Expand directories into the image files in them (not recursively),
+	sorted by name.  Other paths are taken as they are.
+ */
+void BatchListFiles(const std::vector<std::string> &paths, std::vector<std::string> &fileNames);
+
+#endif // BATCHPIPELINE_H
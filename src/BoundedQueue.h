@@ -0,0 +1,132 @@
+/*
+ *  BoundedQueue.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Fixed size queue for handing work between threads without a lock.
+ *  Any number of threads can push and pop.  Each slot carries a sequence
+ *  number that says whether it's ready to be written or read on the
+ *  current lap, so the two ends only ever contend on their own counter.
+ */
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#import <atomic>
+#import <vector>
+#import <thread>
+#import <chrono>
+
+/* Bounded Queue
+	The capacity is rounded up to a power of two, and is at least two.  Nothing blocks: a push
+	 to a full queue or a pop from an empty one just returns false, and it's
+	 up to the caller to wait (see BoundedQueueWait) or do something else.
+	T should be cheap to copy, like a pointer.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(int minCapacity) : capacity(roundUp(minCapacity)), mask(capacity - 1), cells(capacity)
+    {
+        for (int ii = 0; ii < capacity; ii++)
+            cells[ii].seq.store(ii, std::memory_order_relaxed);
+        pushPos.store(0, std::memory_order_relaxed);
+        popPos.store(0, std::memory_order_relaxed);
+    }
+
+    bool tryPush(const T &val)
+    {
+        size_t pos = pushPos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            long long diff = (long long)seq - (long long)pos;
+            if (diff == 0)
+            {
+                // Free on this lap.  Claim it, unless someone beat us to it.
+                if (pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.val = val;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0)
+                return false;       // Still holding last lap's value, so we're full
+            else
+                pos = pushPos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool tryPop(T &val)
+    {
+        size_t pos = popPos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            long long diff = (long long)seq - (long long)(pos + 1);
+            if (diff == 0)
+            {
+                if (popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    val = cell.val;
+                    // Ready to be written on the next lap
+                    cell.seq.store(pos + capacity, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0)
+                return false;       // Nothing written here yet, so we're empty
+            else
+                pos = popPos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Only a snapshot, since the other threads keep going
+    int size() const
+    {
+        long long num = (long long)pushPos.load(std::memory_order_relaxed) - (long long)popPos.load(std::memory_order_relaxed);
+        return num < 0 ? 0 : (num > capacity ? capacity : (int)num);
+    }
+    int getCapacity() const { return capacity; }
+
+protected:
+    // A single cell would be free to write again as soon as it's written, so there are at least two
+    static int roundUp(int minCapacity)
+    {
+        int num = 2;
+        while (num < minCapacity)
+            num *= 2;
+        return num;
+    }
+
+    class Cell
+    {
+    public:
+        std::atomic<size_t> seq;
+        T val;
+    };
+
+    int capacity;
+    size_t mask;
+    std::vector<Cell> cells;
+    // The two ends on their own cache lines
+    alignas(64) std::atomic<size_t> pushPos;
+    alignas(64) std::atomic<size_t> popPos;
+};
+
+// Back off a little more each time there's nothing to do, up to a millisecond
+inline void BoundedQueueWait(int &numIdle)
+{
+    numIdle++;
+    if (numIdle < 64)
+        return;
+    if (numIdle < 128)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(numIdle < 1024 ? 50 : 1000));
+}
+
+#endif // BOUNDEDQUEUE_H
@@ -10,9 +10,20 @@
 #include "CannyDetector.h"
 #include "Logger.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Grid directions, clockwise from +X (Y is down).  Same as calcNextGridDir.
+static const int GridDX[8] = {+1, +1,  0, -1, -1, -1,  0, +1};
+static const int GridDY[8] = { 0, +1, +1, +1,  0, -1, -1, -1};
+
 // Calculate the gradient magnitude and direction at each pixel
-void CannyGradientAndTheta(RawImageGray8 *gaussImg,RawImageGray32 *gradImg,RawImageGray8 *thetaImg)
+void CannyGradientAndTheta(RawImageGray8 *gaussImg,RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int *gradHist)
 {
+	if (gradHist)
+		memset(gradHist, 0, CannyGradHistBins*sizeof(int));
+
 	// Set these up temporarily for the sobel operators
 	ConvolutionFilterInt *sobelX = MakeSobelFilterX();
 	ConvolutionFilterInt *sobelY = MakeSobelFilterY();
@@ -30,6 +41,8 @@ void CannyGradientAndTheta(RawImageGray8 *gaussImg,RawImageGray32 *gradImg,RawIm
 			// Approximation of magnitude
 			int g = (gx > 0 ? gx : -gx) + (gy > 0 ? gy : -gy);
 			gradImg->getPixel(ix,iy) = g;
+			if (gradHist)
+				gradHist[g < CannyGradHistBins ? g : CannyGradHistBins-1]++;
 			
 			if (thetaImg != NULL)
 			{
@@ -72,17 +85,84 @@ void CannyGradientAndTheta(RawImageGray8 *gaussImg,RawImageGray32 *gradImg,RawIm
 	delete sobelY;
 }
 
+// Walk up the histogram until we've seen enough edge pixels
+int CannyGradPercentile(const int *gradHist,float frac)
+{
+	long long total = 0;
+	for (int ii=1;ii<CannyGradHistBins;ii++)
+		total += gradHist[ii];
+	if (total == 0)
+		return 0;
+
+	long long want = (long long)(frac * total);
+	long long sum = 0;
+	for (int ii=1;ii<CannyGradHistBins;ii++)
+	{
+		sum += gradHist[ii];
+		if (sum >= want)
+			return ii;
+	}
+	
+	return CannyGradHistBins-1;
+}
+
 // Run the non-maximal supression
-void CannyNonMaxSupress(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int gradThresh)
+void CannyNonMaxSupress(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int gradThresh,std::vector<int> *seeds)
 {
-	int numZero = 0,numNonZero=0;
+	int sizeX = gradImg->getSizeX(), sizeY = gradImg->getSizeY();
+
+	if (seeds)
+		seeds->clear();
 
 	// Work at least one pixel in
-	for (unsigned int iy=1;iy<gradImg->getSizeY()-1;iy++)
-		for (unsigned int ix=1;ix<gradImg->getSizeX()-1;ix++)
+	for (int iy=1;iy<sizeY-1;iy++)
+	{
+		int *gradRow = gradImg->getImgData() + iy*sizeX;
+		int *above = gradRow - sizeX, *below = gradRow + sizeX;
+		unsigned char *thetaRow = thetaImg->getImgData() + iy*sizeX;
+		int ix = 1;
+
+#ifdef __SSE2__
+		// Four pixels at a time.  Work out the test for every direction from
+		//  shifted loads of the three rows, then pick with the angle masks.
+		__m128i threshV = _mm_set1_epi32(gradThresh), thinV = _mm_set1_epi32(CannyThinFlag), zero = _mm_setzero_si128();
+		for (;ix+4<=sizeX-1;ix+=4)
 		{
-			int &g = gradImg->getPixel(ix, iy);
-			unsigned char &theta = thetaImg->getPixel(ix, iy);
+			__m128i g = _mm_loadu_si128((__m128i *)(gradRow+ix));
+			__m128i test0 = _mm_and_si128(_mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(gradRow+ix+1))),
+										  _mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(gradRow+ix-1))));
+			__m128i test45 = _mm_and_si128(_mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(below+ix+1))),
+										   _mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(above+ix-1))));
+			__m128i test90 = _mm_and_si128(_mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(below+ix))),
+										   _mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(above+ix))));
+			__m128i test135 = _mm_and_si128(_mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(below+ix-1))),
+											_mm_cmpgt_epi32(g,_mm_loadu_si128((__m128i *)(above+ix+1))));
+
+			int thetaBytes;
+			memcpy(&thetaBytes,thetaRow+ix,4);
+			__m128i theta = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(thetaBytes),zero),zero);
+			__m128i thin = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(theta,_mm_set1_epi32(Theta0)),test0),
+													 _mm_and_si128(_mm_cmpeq_epi32(theta,_mm_set1_epi32(Theta45)),test45)),
+										_mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(theta,_mm_set1_epi32(Theta90)),test90),
+													 _mm_and_si128(_mm_cmpeq_epi32(theta,_mm_set1_epi32(Theta135)),test135)));
+			theta = _mm_andnot_si128(_mm_cmplt_epi32(g,threshV),_mm_or_si128(theta,_mm_and_si128(thin,thinV)));
+			thetaBytes = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(theta,zero),zero));
+			memcpy(thetaRow+ix,&thetaBytes,4);
+
+			if (seeds)
+			{
+				int thinMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(theta,thinV),thinV)));
+				for (int ii=0;thinMask;ii++,thinMask>>=1)
+					if (thinMask & 1)
+						seeds->push_back(iy*sizeX + ix+ii);
+			}
+		}
+#endif
+
+		for (;ix<sizeX-1;ix++)
+		{
+			int g = gradRow[ix];
+			unsigned char &theta = thetaRow[ix];
 			
 			if (g < gradThresh)
 				theta = ThetaEmpty;
@@ -90,30 +170,27 @@ void CannyNonMaxSupress(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int grad
 				switch (theta)
 				{
 					case Theta0:
-						if (g > gradImg->getPixel(ix+1, iy) && g > gradImg->getPixel(ix-1, iy))
+						if (g > gradRow[ix+1] && g > gradRow[ix-1])
 							theta |= CannyThinFlag;
 						break;
 					case Theta45:
-						if (g > gradImg->getPixel(ix+1, iy+1) && g > gradImg->getPixel(ix-1, iy-1))
+						if (g > below[ix+1] && g > above[ix-1])
 							theta |= CannyThinFlag;
 						break;
 					case Theta90:
-						if (g > gradImg->getPixel(ix, iy+1) && g > gradImg->getPixel(ix, iy-1))
+						if (g > below[ix] && g > above[ix])
 							theta |= CannyThinFlag;
 						break;
 					case Theta135:
-						if (g > gradImg->getPixel(ix-1, iy+1) && g > gradImg->getPixel(ix+1, iy-1))
+						if (g > below[ix-1] && g > above[ix+1])
 							theta |= CannyThinFlag;
 						break;
 				}
+				if (seeds && (theta & CannyThinFlag))
+					seeds->push_back(iy*sizeX + ix);
 			}
-			
-			if (theta && (~CannyThinFlag) == ThetaEmpty)
-				numZero++;
-			else
-				numNonZero++;
 		}
-	
+	}
 }
 
 // Calculate the next direction based on the direction we went last time
@@ -227,11 +304,11 @@ void calcNextThetaDir(ThetaAngles dir,int offset,int cx,int cy,int &nx,int &ny,i
 
 // Check if the candidate pixel is acceptable to move to
 // If thinOrNot is on, we'll just take thin edges
-static bool checkPixel(int nx, int ny,RawImageGray32 *gradImg,RawImageGray32 *featImg,int featId,RawImageGray8 *thetaImg,int minThresh,int thinOrNot)
+static bool checkPixel(int nx, int ny,RawImageGray32 *gradImg,RawImageLabel32 *featImg,int featId,RawImageGray8 *thetaImg,int minThresh,int thinOrNot)
 {
 	// If the pixel's already been hit by us, it's fine.
 	// If it's been hit, but not by this feature, can't go there
-	int pixFeat = featImg->getPixel(nx, ny);
+	int pixFeat = featImg->getLabel(nx, ny);
 	if (pixFeat && pixFeat != featId)
 		return false;
 	
@@ -247,7 +324,8 @@ static bool checkPixel(int nx, int ny,RawImageGray32 *gradImg,RawImageGray32 *fe
 
 // Look for the next pixel given this one and a direction
 // Return true if we found one, false otherwise
-static bool findNext(RawImageGray32 *gradImg,RawImageGray32 *featImg,int featId,RawImageGray8 *thetaImg,int minThresh,int &cx,int &cy,int &gridDir,int &strayCount)
+// This is the original, one probe at a time.  The tracer uses CannyStepper.
+bool CannyFindNextReference(RawImageGray32 *gradImg,RawImageLabel32 *featImg,int featId,RawImageGray8 *thetaImg,int minThresh,int &cx,int &cy,int &gridDir,int &strayCount)
 {
 	bool isThin = false;
 	int dir = thetaImg->getPixel(cx, cy);
@@ -373,35 +451,178 @@ static bool findNext(RawImageGray32 *gradImg,RawImageGray32 *featImg,int featId,
 	return false;
 }
 
+// The order findNext tries the neighbours in, as offsets from the way we're headed.
+// The first five and the last three are thin edges only, the middle three can be thick.
+#define NumStepProbes 11
+#define FirstThickProbe 5
+#define LastThickProbe 7
+#define StartOnlyProbe 10
+constexpr int StepProbeOffsets[NumStepProbes] = {0, 1, -1, 2, -2,  0, 1, -1,  3, -3,  4};
+
+// Grid direction along a theta angle, for when we haven't moved yet
+constexpr int thetaGridDir(int theta)
+{
+	return theta == Theta0 ? 2 : theta == Theta45 ? 3 : theta == Theta90 ? 0 : theta == Theta135 ? 1 : 0;
+}
+
+// Direction of a probe from the way we're headed (-1 if we haven't moved) and the theta we're on.
+// Without a direction, thin probes go off theta (calcNextThetaDir) and thick ones
+//  wrap around from -1 (calcNextGridDir).
+constexpr int stepProbeDir(int gridDir,int theta,int probe)
+{
+	return ((gridDir != -1 ? gridDir : (probe >= FirstThickProbe && probe <= LastThickProbe) ? -1 : thetaGridDir(theta))
+			+ StepProbeOffsets[probe] + 8) % 8;
+}
+
+// Every probe for every (gridDir+1, theta), worked out by the compiler
+#define STEP_PROBES(g,t) { stepProbeDir(g,t,0), stepProbeDir(g,t,1), stepProbeDir(g,t,2), stepProbeDir(g,t,3), \
+						   stepProbeDir(g,t,4), stepProbeDir(g,t,5), stepProbeDir(g,t,6), stepProbeDir(g,t,7), \
+						   stepProbeDir(g,t,8), stepProbeDir(g,t,9), stepProbeDir(g,t,10) }
+#define STEP_PROBES_THETAS(g) { STEP_PROBES(g,ThetaEmpty), STEP_PROBES(g,Theta0), STEP_PROBES(g,Theta45), \
+								STEP_PROBES(g,Theta90), STEP_PROBES(g,Theta135) }
+static constexpr unsigned char StepProbeDirs[9][Theta135+1][NumStepProbes] =
+{
+	STEP_PROBES_THETAS(-1), STEP_PROBES_THETAS(0), STEP_PROBES_THETAS(1), STEP_PROBES_THETAS(2), STEP_PROBES_THETAS(3),
+	STEP_PROBES_THETAS(4), STEP_PROBES_THETAS(5), STEP_PROBES_THETAS(6), STEP_PROBES_THETAS(7)
+};
+static_assert(StepProbeDirs[0][Theta0][0] == 2 && StepProbeDirs[0][Theta0][LastThickProbe] == 6 && StepProbeDirs[8][Theta45][3] == 1,
+			  "Step probe table doesn't match calcNextThetaDir/calcNextGridDir");
+
+CannyEdges::CannyEdges(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int inMinThresh,int inMaxThresh)
+{
+	sizeX = gradImg->getSizeX();
+	grad = gradImg->getImgData();
+	theta = thetaImg->getImgData();
+	minThresh = inMinThresh;
+	maxThresh = inMaxThresh;
+}
+
+CannyStepper::CannyStepper(RawImageGray8 *thetaImg,const CannyEdges &inEdges,RawImageLabel32 *inFeatImg)
+	: edges(inEdges)
+{
+	sizeX = thetaImg->getSizeX();
+	theta = thetaImg->getImgData();
+	featImg = inFeatImg;
+	for (int ii = 0; ii < 8; ii++)
+		nbrOffsets[ii] = GridDY[ii] * sizeX + GridDX[ii];
+}
+
+// Same test as checkPixel, with the angle and threshold checked by CannyEdges
+inline bool CannyStepper::checkPixel(int idx,int featId,bool thinOnly)
+{
+	int pixFeat = featImg->getLabelAt(idx);
+	if (pixFeat && pixFeat != featId)
+		return false;
+
+	if (thinOnly && !(theta[idx] & CannyThinFlag))
+		return false;
+
+	return edges.isEdge(idx);
+}
+
+// Try the probes in [first,last) and take the first one that passes
+inline bool CannyStepper::tryProbes(const unsigned char *probes,int first,int last,bool thinOnly,int idx,int featId,int &cx,int &cy,int &gridDir)
+{
+	for (int probe = first;probe < last;probe++)
+	{
+		int dir = probes[probe];
+		if (checkPixel(idx + nbrOffsets[dir], featId, thinOnly))
+		{
+			cx += GridDX[dir];  cy += GridDY[dir];
+			gridDir = dir;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool CannyStepper::findNext(int featId,int &cx,int &cy,int &gridDir,int &strayCount)
+{
+	int idx = cy * sizeX + cx;
+	unsigned char here = theta[idx];
+	bool isThin = here & CannyThinFlag;
+	int hereTheta = here & ~CannyThinFlag;
+	if (hereTheta > Theta135)
+		hereTheta = ThetaEmpty;
+	const unsigned char *probes = StepProbeDirs[gridDir+1][hereTheta];
+
+	// Thin edges ahead of us and off to the sides
+	if (tryProbes(probes, 0, FirstThickProbe, true, idx, featId, cx, cy, gridDir))
+		return true;
+
+	// Thick edges ahead, as long as we haven't strayed too far from a thin one
+	if (isThin || strayCount)
+	{
+		if (isThin)
+			strayCount = 1;
+		else
+			strayCount--;
+		if (tryProbes(probes, FirstThickProbe, LastThickProbe+1, false, idx, featId, cx, cy, gridDir))
+			return true;
+	}
+
+	// Thin edges behind us, and straight back if we're just starting
+	return tryProbes(probes, LastThickProbe+1, (gridDir == -1) ? NumStepProbes : StartOnlyProbe, true, idx, featId, cx, cy, gridDir);
+}
+
+bool CannyStepper::closedFeature(int featId,int cx,int cy,int gridDir)
+{
+	// Can't close a feature if we've just started
+	if (gridDir == -1)
+		return false;
+
+	// Look for a feature pixel ahead or to either side of it
+	int idx = cy * sizeX + cx;
+	return featImg->getLabelAt(idx + nbrOffsets[gridDir]) == featId ||
+		   featImg->getLabelAt(idx + nbrOffsets[(gridDir+1)%8]) == featId ||
+		   featImg->getLabelAt(idx + nbrOffsets[(gridDir+7)%8]) == featId;
+}
+
+// Same interface as CannyStepper, but with the original probe by probe code
+class ReferenceStepper
+{
+public:
+	ReferenceStepper(RawImageGray32 *inGradImg,RawImageGray8 *inThetaImg,RawImageLabel32 *inFeatImg,int inMinThresh)
+		: gradImg(inGradImg), thetaImg(inThetaImg), featImg(inFeatImg), minThresh(inMinThresh) { }
+
+	bool findNext(int featId,int &cx,int &cy,int &gridDir,int &strayCount)
+		{ return CannyFindNextReference(gradImg,featImg,featId,thetaImg,minThresh,cx,cy,gridDir,strayCount); }
+	bool closedFeature(int featId,int cx,int cy,int gridDir)
+		{ return ::closedFeature(featImg,featId,cx,cy,gridDir); }
+
+protected:
+	RawImageGray32 *gradImg;
+	RawImageGray8 *thetaImg;
+	RawImageLabel32 *featImg;
+	int minThresh;
+};
+
 // Decide if a pixel is too crowded to start
 // It's too crowded if there's already two features nearby
-bool pixelCrowded(RawImageGray32 *featImg,int cx,int cy)
+bool pixelCrowded(RawImageLabel32 *featImg,int cx,int cy)
 {
 	int nearCount = 0;
 	
 	for (unsigned int iy=cy+1;iy>=cy-1;iy--)
 		for (unsigned int ix=cx-1;ix<=cx+1;ix++)
-			if (featImg->getPixel(ix, iy))
+			if (featImg->getLabel(ix, iy))
 				nearCount++;
 
 	return nearCount >= 2;
 }
 
 // Erase the given feature from our image
-// Note: Keep an MBR to make this faster
-void ScrubFeature(RawImageGray8 *featImg,int featId)
+// Only its own points can have its label, so that's all we look at
+void ScrubFeature(RawImageLabel32 *featImg,const Feature &feat,int featId)
 {
-	for (unsigned int iy=0;iy<featImg->getSizeY();iy++)
-		for (unsigned int ix=0;ix<featImg->getSizeX();ix++)
-		{
-			unsigned char &val = featImg->getPixel(ix, iy);
-			if (val == featId)
-				val = 0;
-		}
+	for (auto &pt : feat.points)
+		if (featImg->getLabel(pt.x, pt.y) == featId)
+			featImg->setLabel(pt.x, pt.y, 0);
 }
 
 // Detected when we've closed a feature
-bool closedFeature(RawImageGray32 *featImg,int featId,int cx,int cy,int gridDir)
+bool closedFeature(RawImageLabel32 *featImg,int featId,int cx,int cy,int gridDir)
 {
 	// Can't close a feature if we've just started
 	if (gridDir == -1)
@@ -411,122 +632,239 @@ bool closedFeature(RawImageGray32 *featImg,int featId,int cx,int cy,int gridDir)
 	int tmpGridDir=gridDir,nx,ny;
 	calcNextGridDir(0,cx,cy,nx,ny,tmpGridDir);
 	tmpGridDir=gridDir;
-	if (featImg->getPixel(nx, ny) == featId)
+	if (featImg->getLabel(nx, ny) == featId)
 		return true;
 	//tmpGridDir=gridDir;
 	calcNextGridDir(1,cx,cy,nx,ny,tmpGridDir);
-	if (featImg->getPixel(nx, ny) == featId)
+	if (featImg->getLabel(nx, ny) == featId)
 		return true;
 	tmpGridDir=gridDir;
 	calcNextGridDir(-1,cx,cy,nx,ny,tmpGridDir);
-	if (featImg->getPixel(nx, ny) == featId)
+	if (featImg->getLabel(nx, ny) == featId)
 		return true;
 	
 	return false;
 }
 
-// Don't bother with the pixels around the edge
-const int FeatureOffset = 5,InnerOffset=4;
-
 // Feature needs to have more than this number of pixels to matter
 const int FeatureThreshhold = 10;
 
+// Told to stop or out of budget
+bool TraceLimits::shouldStop()
+{
+	if (stopped)
+		return true;
+
+	if (cancel && cancel->load(std::memory_order_relaxed))
+		stopped = true;
+	else if ((maxPixels > 0 && numPixels >= maxPixels) ||
+			 (maxFeatures > 0 && numFeatures >= maxFeatures) ||
+			 (hasDeadline && std::chrono::steady_clock::now() >= deadline))
+	{
+		stopped = true;
+		budgetExceeded = true;
+	}
+
+	return stopped;
+}
+
+// Check if the pixel qualifies as the start of a new feature:
+// - It's a thin edge with the gradient value higher than the max threshold (strong)
+// - The pixel hasn't been visited
+// - There aren't too many neighboring features
+bool CannyCanStartFeature(const CannyEdges &edges, RawImageLabel32 *featImg, int ix, int iy)
+{
+    return edges.isStrong(ix, iy) && !featImg->getLabel(ix, iy) && !pixelCrowded(featImg, ix, iy);
+}
+
+// The whole image, less the margin
+TraceRegion CannyFullTraceRegion(RawImageGray32 *gradImg)
+{
+    return TraceRegion(InnerOffset, InnerOffset, gradImg->getSizeX() - InnerOffset, gradImg->getSizeY() - InnerOffset);
+}
+
+// Follow a feature from (cx,cy) until it ends or leaves the region, adding points to
+//  the front or back of the feature.  Returns the number of points added.
+// If startDir is passed in, it gets the first direction we moved in.
+template<class Stepper>
+static int followFeature(const CannyEdges &edges, Stepper &stepper, RawImageLabel32 *featImg, int featId, const TraceRegion &region,
+                         Feature &feat, bool atFront, int &cx, int &cy, int &gridDir, int &strayCount, int *startDir)
+{
+    int featCount = 0;
+
+    // Follow the feature until it's no longer valid
+    while (!featImg->getLabel(cx, cy) && edges.isEdge(cx, cy) &&
+           region.inside(cx, cy) && !stepper.closedFeature(featId, cx, cy, gridDir))
+    {
+        // Mark the pixel as part of this feature
+        featImg->setLabel(cx, cy, featId);
+
+        // Try to find the next pixel in the feature
+        if (stepper.findNext(featId, cx, cy, gridDir, strayCount))
+        {
+            if (atFront)
+                feat.addPointBegin(cx, cy);
+            else
+                feat.addPointEnd(cx, cy);
+            featCount++;
+        }
+        else
+        {
+            break;
+        }
+
+        // Set startDir the first time we find the gridDir
+        if (startDir && *startDir == -1)
+            *startDir = gridDir;
+    }
+
+    return featCount;
+}
+
+// Note where the trace stopped.  If it walked out of the region onto a pixel it
+//  would otherwise have taken, it's open.
+static void recordEnd(const CannyEdges &edges, RawImageLabel32 *featImg, const TraceRegion &region,
+                      int cx, int cy, int gridDir, int strayCount, TraceEnd &end)
+{
+    end.open = !region.inside(cx, cy) && !featImg->getLabel(cx, cy) && edges.isEdge(cx, cy);
+    end.x = cx;  end.y = cy;
+    end.gridDir = gridDir;
+    end.strayCount = strayCount;
+}
+
+// Trace a feature with the given stepper
+template<class Stepper>
+static bool traceFeature(Stepper &stepper, const CannyEdges &edges, RawImageLabel32 *featImg, int featId,
+                         const TraceRegion &region, int ix, int iy, Feature &feat, int &numPixels, TraceEnd *ends)
+{
+    if (!CannyCanStartFeature(edges, featImg, ix, iy))
+        return false;
+
+    int featCount = 0; // Count of pixels in this feature
+    int cx = ix, cy = iy; // Starting point of the feature
+    feat.addPointEnd(cx, cy); // Add the starting point to the feature
+
+    // Follow the feature in one direction (forward)
+    int gridDir = -1, startDir = -1;
+    int strayCount = 1; // Allowable number of steps outside the edge
+    int numForward = followFeature(edges, stepper, featImg, featId, region, feat, false, cx, cy, gridDir, strayCount, &startDir);
+    featCount += numForward;
+    if (ends)
+    {
+        recordEnd(edges, featImg, region, cx, cy, gridDir, strayCount, ends[1]);
+        ends[1].numPoints = numForward;
+    }
+
+    // Now follow the feature in the other direction (backward)
+    cx = ix;
+    cy = iy;
+    gridDir = (startDir + 4) % 8; // Reverse direction
+    strayCount = 1; // Reset stray count
+    int numBackward = 0;
+
+    if (stepper.findNext(featId, cx, cy, gridDir, strayCount))
+    {
+        feat.addPointBegin(cx, cy); // Add the starting point in reverse direction
+        int numFollowed = followFeature(edges, stepper, featImg, featId, region, feat, true, cx, cy, gridDir, strayCount, NULL);
+        featCount += numFollowed;
+        numBackward = 1 + numFollowed;
+    }
+    if (ends)
+    {
+        if (numBackward > 0)
+            recordEnd(edges, featImg, region, cx, cy, gridDir, strayCount, ends[0]);
+        else
+            ends[0].open = false;
+        ends[0].numPoints = numBackward;
+    }
+
+    numPixels = featCount + 1;
+    return true;
+}
+
+bool CannyTraceFeature(RawImageGray8 *thetaImg, const CannyEdges &edges, RawImageLabel32 *featImg, int featId,
+                       const TraceRegion &region, int ix, int iy, Feature &feat, int &numPixels, TraceEnd *ends)
+{
+    CannyStepper stepper(thetaImg, edges, featImg);
+    return traceFeature(stepper, edges, featImg, featId, region, ix, iy, feat, numPixels, ends);
+}
+
+int CannyContinueTrace(RawImageGray8 *thetaImg, const CannyEdges &edges, RawImageLabel32 *featImg, int featId,
+                       const TraceRegion &region, Feature &feat, bool atFront, TraceEnd &end)
+{
+    int cx = end.x, cy = end.y;
+    CannyStepper stepper(thetaImg, edges, featImg);
+    int numAdded = followFeature(edges, stepper, featImg, featId, region, feat, atFront, cx, cy, end.gridDir, end.strayCount, NULL);
+    recordEnd(edges, featImg, region, cx, cy, end.gridDir, end.strayCount, end);
+
+    return numAdded;
+}
+
+// Start a feature at the given pixel, if there's one to start.
+// Returns false if the limits say we should stop.
+static bool traceFromPixel(RawImageGray32 *gradImg, RawImageGray8 *thetaImg, const CannyEdges &edges, int minThresh, FeaturePool &feats, RawImageLabel32 *featImg,
+                           TraceLimits *limits, const TraceRegion &region, int ix, int iy, int &featId, bool referenceSteps)
+{
+    if (!CannyCanStartFeature(edges, featImg, ix, iy))
+        return true;
+
+    // Caller may want us to give up
+    if (limits && limits->shouldStop())
+    {
+        logVerbose("Feature tracing stopped early after " + std::to_string(featId - 1) + " features" +
+                   (limits->budgetExceeded ? " (budget exceeded)" : ""));
+        return false;
+    }
+
+    int numPixels = 0;
+    Feature &feat = feats.add(); // Add a new feature to the pool
+    if (referenceSteps)
+    {
+        ReferenceStepper stepper(gradImg, thetaImg, featImg, minThresh);
+        traceFeature(stepper, edges, featImg, featId, region, ix, iy, feat, numPixels, NULL);
+    } else
+        CannyTraceFeature(thetaImg, edges, featImg, featId, region, ix, iy, feat, numPixels, NULL);
+
+    if (limits)
+    {
+        limits->numPixels += numPixels;
+        limits->numFeatures++;
+    }
+
+    // Increment feature ID for the next feature
+    featId++;
+    return true;
+}
+
 // Look for features using a min and max threshold.
 // This function identifies features in an image by following gradients and edges.
-void CannyFindFeatures(RawImageGray32 *gradImg, RawImageGray8 *thetaImg, int minThresh, int maxThresh, std::vector<Feature> &feats, RawImageGray32 *featImg)
+void CannyFindFeatures(RawImageGray32 *gradImg, RawImageGray8 *thetaImg, int minThresh, int maxThresh, FeaturePool &feats, RawImageLabel32 *featImg, TraceLimits *limits, const std::vector<int> *seeds,
+                       bool referenceSteps)
 {
     int featId = 1; // The ID of the feature being processed
+    int sizeX = gradImg->getSizeX(), sizeY = gradImg->getSizeY();
+    TraceRegion region = CannyFullTraceRegion(gradImg);
+
+    // Only follow edges that hysteresis would say connect to a strong one
+    CannyEdges edges(gradImg, thetaImg, minThresh, maxThresh);
 
-    // Loop through the image pixels to search for features
-    for (unsigned int iy = FeatureOffset; iy < gradImg->getSizeY() - FeatureOffset; iy++)
+    if (seeds)
     {
-        for (unsigned int ix = FeatureOffset; ix < gradImg->getSizeX() - FeatureOffset; ix++)
+        // Non-max suppression already found the thin pixels, in the same order we'd scan them
+        for (unsigned int ii = 0; ii < seeds->size(); ii++)
         {
-            // Check if the pixel qualifies as part of a new feature:
-            // - The gradient value is higher than the max threshold
-            // - The pixel hasn't been visited
-            // - There aren't too many neighboring features
-            if ((thetaImg->getPixel(ix, iy) & CannyThinFlag) && !featImg->getPixel(ix, iy) && gradImg->getPixel(ix, iy) > maxThresh && !pixelCrowded(featImg, ix, iy))
-            {
-                int featCount = 0; // Count of pixels in this feature
-                feats.resize(feats.size() + 1); // Add a new feature to the vector
-                Feature &feat = feats[feats.size() - 1]; // Get reference to the new feature
-                int cx = ix, cy = iy; // Starting point of the feature
-                feat.addPointEnd(cx, cy); // Add the starting point to the feature
-
-                // Debugging output
-                //logVerbose("Starting new feature at (" + std::to_string(ix) + ", " + std::to_string(iy) + "), feature ID: " + std::to_string(featId));
-
-                // Follow the feature in one direction (forward)
-                int gridDir = -1, startDir = -1;
-                int startCx = cx, startCy = cy; // Store starting coordinates
-                int strayCount = 1; // Allowable number of steps outside the edge
-
-                // Follow the feature until it's no longer valid
-                while (!featImg->getPixel(cx, cy) && gradImg->getPixel(cx, cy) > minThresh &&
-                       cx > InnerOffset && cy > InnerOffset && cx < gradImg->getSizeX() - InnerOffset && cy < gradImg->getSizeY() - InnerOffset &&
-                       !closedFeature(featImg, featId, cx, cy, gridDir))
-                {
-                    // Mark the pixel as part of this feature
-                    featImg->getPixel(cx, cy) = featId;
-
-                    // Try to find the next pixel in the feature
-                    if (findNext(gradImg, featImg, featId, thetaImg, minThresh, cx, cy, gridDir, strayCount))
-                    {
-                        feat.addPointEnd(cx, cy); // Add the new point to the feature
-                        featCount++;
-                    }
-                    else
-                    {
-                        break;
-                    }
-
-                    // Set startDir the first time we find the gridDir
-                    if (startDir == -1)
-                    {
-                        startDir = gridDir;
-                    }
-                }
-
-                // Debugging output
-                //logVerbose("First pass completed for feature ID: " + std::to_string(featId) + " with points: " + std::to_string(featCount));
-
-                // Now follow the feature in the other direction (backward)
-                cx = startCx;
-                cy = startCy;
-                gridDir = (startDir + 4) % 8; // Reverse direction
-                strayCount = 1; // Reset stray count
-
-                if (findNext(gradImg, featImg, featId, thetaImg, minThresh, cx, cy, gridDir, strayCount))
-                {
-                    feat.addPointBegin(cx, cy); // Add the starting point in reverse direction
-
-                    while (!featImg->getPixel(cx, cy) && gradImg->getPixel(cx, cy) > minThresh &&
-                           cx > InnerOffset && cy > InnerOffset && cx < gradImg->getSizeX() - InnerOffset && cy < gradImg->getSizeY() - InnerOffset &&
-                           !closedFeature(featImg, featId, cx, cy, gridDir))
-                    {
-                        featImg->getPixel(cx, cy) = featId; // Mark the pixel as part of the feature
-
-                        // Find the next pixel in reverse direction
-                        if (findNext(gradImg, featImg, featId, thetaImg, minThresh, cx, cy, gridDir, strayCount))
-                        {
-                            feat.addPointBegin(cx, cy); // Add the point to the start of the feature
-                            featCount++;
-                        }
-                        else
-                        {
-                            break;
-                        }
-                    }
-                }
-
-                // Debugging output
-                //logVerbose("Second pass completed for feature ID: " + std::to_string(featId) + " with total points: " + std::to_string(featCount));
-
-                // Increment feature ID for the next feature
-                featId++;
-            }
+            int ix = (*seeds)[ii] % sizeX, iy = (*seeds)[ii] / sizeX;
+            if (ix < FeatureOffset || iy < FeatureOffset || ix >= sizeX - FeatureOffset || iy >= sizeY - FeatureOffset)
+                continue;
+            if (!traceFromPixel(gradImg, thetaImg, edges, minThresh, feats, featImg, limits, region, ix, iy, featId, referenceSteps))
+                return;
         }
+    } else {
+        // Loop through the image pixels to search for features
+        for (int iy = FeatureOffset; iy < sizeY - FeatureOffset; iy++)
+            for (int ix = FeatureOffset; ix < sizeX - FeatureOffset; ix++)
+                if (!traceFromPixel(gradImg, thetaImg, edges, minThresh, feats, featImg, limits, region, ix, iy, featId, referenceSteps))
+                    return;
     }
 
     // Debugging output for the number of features detected
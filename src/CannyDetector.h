@@ -7,25 +7,188 @@
  *
  */
 
+#import <atomic>
+#import <chrono>
 #import "RawImage.h"
 #import "Convolution.h"
 #import "Feature.h"
 
 typedef enum {ThetaEmpty=0,Theta0,Theta45,Theta90,Theta135} ThetaAngles;
+
+// Sobel magnitudes (|gx|+|gy|) on 8 bit input top out at 2040, so this
+//  is one bin per gradient value.  Anything bigger lands in the last one.
+#define CannyGradHistBins 2048
+
 // Calculate the gradient magnitude and direction at each pixel
-void CannyGradientAndTheta(RawImageGray8 *gaussImg,RawImageGray32 *gradImg,RawImageGray8 *thetaImg);
+// If gradHist is passed in, it's filled in with a histogram of the magnitudes
+void CannyGradientAndTheta(RawImageGray8 *gaussImg,RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int *gradHist=NULL);
+
+// Smallest gradient value with at least the given fraction of the edge
+//  (non-zero) pixels at or below it.  Returns 0 if there are no edges.
+int CannyGradPercentile(const int *gradHist,float frac);
 
 #define CannyThinFlag (1<<7)
 // Run non-maximal supression
 // Anything below the threshhold is nuked
 // Edges that are at the "top" of their gradient will be marked as Thin
-void CannyNonMaxSupress(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int gradThresh);
+// If seeds is passed in, it's filled with the thin pixels (as y*sizeX+x) in raster order
+void CannyNonMaxSupress(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int gradThresh,std::vector<int> *seeds=NULL);
+
+/* Canny Edges
+	What the tracer checks before it starts a feature on a pixel or steps onto one.
+	This is hysteresis without a separate pass.  The tracer only starts on strong
+	 pixels and only steps next to pixels it's already taken, so any pixel over
+	 minThresh it looks at is connected to a strong one.  Testing the gradient
+	 as we get to each pixel gives the same edges as a hysteresis map, without
+	 paying for the whole image when only the traced edges are ever looked at.
+ */
+class CannyEdges
+{
+public:
+	CannyEdges(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int minThresh,int maxThresh);
+
+	// A pixel the tracer can follow: it has an angle and is above minThresh
+	inline bool isEdge(int idx) const { return theta[idx] != ThetaEmpty && grad[idx] > minThresh; }
+	inline bool isEdge(int ix,int iy) const { return isEdge(iy*sizeX + ix); }
+	// A pixel a feature can start on: thin and above maxThresh
+	inline bool isStrong(int idx) const { return (theta[idx] & CannyThinFlag) && grad[idx] > maxThresh; }
+	inline bool isStrong(int ix,int iy) const { return isStrong(iy*sizeX + ix); }
+
+protected:
+	int sizeX;
+	const int *grad;
+	const unsigned char *theta;
+	int minThresh,maxThresh;
+};
+
+/* Trace Limits
+	Lets the caller cut feature tracing short.
+	If cancel is set and becomes true, tracing stops before the next feature.
+	Tracing also stops before the next feature once it's used up its budget:
+	 maxPixels traced pixels, maxFeatures features or the deadline (0 for no limit).
+	stopped and budgetExceeded are filled in on the way out.
+ */
+class TraceLimits
+{
+public:
+	TraceLimits() { cancel = NULL;  maxPixels = 0;  maxFeatures = 0;  hasDeadline = false;
+					numPixels = 0;  numFeatures = 0;  stopped = false;  budgetExceeded = false; }
+
+	// Stop at the given time
+	inline void setDeadline(std::chrono::steady_clock::time_point when) { deadline = when;  hasDeadline = true; }
+
+	// Check if we should stop.  Remembers if we did.
+	bool shouldStop();
+
+	const std::atomic<bool> *cancel;
+	int maxPixels;
+	int maxFeatures;
+	bool hasDeadline;
+	std::chrono::steady_clock::time_point deadline;
+
+	int numPixels;        // Pixels traced so far
+	int numFeatures;      // Features started so far
+	bool stopped;         // We stopped early, for whatever reason
+	bool budgetExceeded;  // We stopped because we ran out of budget
+};
+
+// Features don't start within FeatureOffset pixels of the edge
+//  and aren't traced within InnerOffset
+const int FeatureOffset = 5,InnerOffset = 4;
+
+/* Trace Region
+	Where the tracer is allowed to go.  Like the image margin, the
+	 bounds themselves are outside.
+ */
+class TraceRegion
+{
+public:
+	TraceRegion() { minX = minY = maxX = maxY = 0; }
+	TraceRegion(int inMinX,int inMinY,int inMaxX,int inMaxY) { minX = inMinX;  minY = inMinY;  maxX = inMaxX;  maxY = inMaxY; }
+
+	inline bool inside(int x,int y) const { return x > minX && y > minY && x < maxX && y < maxY; }
+
+	int minX,minY,maxX,maxY;
+};
+
+// The whole image, less the margin
+TraceRegion CannyFullTraceRegion(RawImageGray32 *gradImg);
+
+/* Trace End
+	Where a trace stopped at one end of a feature.  If the tracer walked out
+	 of its region onto a pixel it would otherwise have kept going from, the
+	 end is open.  x,y is that pixel (it's in the feature, but not marked in
+	 featImg) and gridDir and strayCount are where the tracer left off.
+ */
+class TraceEnd
+{
+public:
+	TraceEnd() { open = false;  x = y = 0;  gridDir = -1;  strayCount = 0;  numPoints = 0; }
+
+	bool open;
+	int x,y;
+	int gridDir,strayCount;
+	int numPoints;          // Points the trace added going this way
+};
+
+/* Canny Stepper
+	Takes the single steps along a feature for the tracer.  Neighbours are
+	 found with per-direction offsets into the images and the order they're
+	 tried in comes from a table the compiler builds for each (gridDir, theta).
+	Takes exactly the same steps as CannyFindNextReference, but checks
+	 the pixels through CannyEdges.
+ */
+class CannyStepper
+{
+public:
+	CannyStepper(RawImageGray8 *thetaImg,const CannyEdges &edges,RawImageLabel32 *featImg);
+
+	// Find the next pixel in the feature from (cx,cy), heading in gridDir (-1 if we're just starting).
+	// Returns false if there isn't one.
+	bool findNext(int featId,int &cx,int &cy,int &gridDir,int &strayCount);
+
+	// Check if we're about to run back into our own feature
+	bool closedFeature(int featId,int cx,int cy,int gridDir);
+
+protected:
+	bool checkPixel(int idx,int featId,bool thinOnly);
+	bool tryProbes(const unsigned char *probes,int first,int last,bool thinOnly,int idx,int featId,int &cx,int &cy,int &gridDir);
+
+	int sizeX;
+	unsigned char *theta;
+	const CannyEdges &edges;
+	RawImageLabel32 *featImg;
+	int nbrOffsets[8];    // Index offset to the neighbour in each grid direction
+};
+
+// The original findNext, which works out each probe as it goes.  Kept to check CannyStepper against.
+bool CannyFindNextReference(RawImageGray32 *gradImg,RawImageLabel32 *featImg,int featId,RawImageGray8 *thetaImg,int minThresh,int &cx,int &cy,int &gridDir,int &strayCount);
+
+// Check if a feature can start at (ix,iy): a strong, unvisited pixel without two features next to it
+bool CannyCanStartFeature(const CannyEdges &edges,RawImageLabel32 *featImg,int ix,int iy);
+
+// Trace a single feature starting at (ix,iy), staying inside region and marking featImg with featId.
+// Returns false if there's no feature to start there.  numPixels is the number traced.
+// If ends is passed in, ends[0] is filled in for the front of the feature and ends[1] for the back.
+bool CannyTraceFeature(RawImageGray8 *thetaImg,const CannyEdges &edges,RawImageLabel32 *featImg,int featId,
+					   const TraceRegion &region,int ix,int iy,Feature &feat,int &numPixels,TraceEnd *ends);
+
+// Pick up tracing a feature from an open end, with a new region.
+// Returns the number of points added and updates the end.
+int CannyContinueTrace(RawImageGray8 *thetaImg,const CannyEdges &edges,RawImageLabel32 *featImg,int featId,
+					   const TraceRegion &region,Feature &feat,bool atFront,TraceEnd &end);
 
 // Find features (in a really simple way)
-void CannyFindFeatures(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int minThresh,int maxThresh,std::vector<Feature> &feats,RawImageGray32 *featImg);
+// New features are added on to the end of feats.  limits may be NULL.
+// Only edges hysteresis would confirm get traced (see CannyEdges).
+// seeds are the thin pixels from CannyNonMaxSupress.  If we have them, we only look
+//  at those rather than scanning the whole image.  The results are the same either way.
+// referenceSteps traces with CannyFindNextReference rather than CannyStepper, to check one against the other.
+void CannyFindFeatures(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int minThresh,int maxThresh,FeaturePool &feats,RawImageLabel32 *featImg,TraceLimits *limits=NULL,const std::vector<int> *seeds=NULL,
+					   bool referenceSteps=false);
 
 void calcNextGridDir(int offset,int cx,int cy,int &nx,int &ny,int &gridDir);
-bool pixelCrowded(RawImageGray32 *featImg,int cx,int cy);
-void ScrubFeature(RawImageGray8 *featImg,int featId);
-bool closedFeature(RawImageGray32 *featImg,int featId,int cx,int cy,int gridDir);
+bool pixelCrowded(RawImageLabel32 *featImg,int cx,int cy);
+void ScrubFeature(RawImageLabel32 *featImg,const Feature &feat,int featId);
+bool closedFeature(RawImageLabel32 *featImg,int featId,int cx,int cy,int gridDir);
 void calcNextThetaDir(ThetaAngles dir,int offset,int cx,int cy,int &nx,int &ny,int &gridDir);
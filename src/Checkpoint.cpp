@@ -0,0 +1,196 @@
+/*
+ *  Checkpoint.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Checkpoint.h"
+#include "Logger.h"
+
+// Planes start on this boundary
+const unsigned long long CheckpointAlign = 64;
+
+static unsigned long long alignUp(unsigned long long offset)
+{
+    return (offset + CheckpointAlign - 1) & ~(CheckpointAlign - 1);
+}
+
+// Write some zeros to get to the given offset
+static bool padTo(FILE *fp, unsigned long long offset)
+{
+    static const char zeros[CheckpointAlign] = {0};
+    long pos = ftell(fp);
+    if (pos < 0 || (unsigned long long)pos > offset)
+        return false;
+    size_t num = offset - pos;
+    return fwrite(zeros, 1, num, fp) == num;
+}
+
+// Write out the gradient and theta planes plus the source image
+bool SaveCheckpoint(const char *fileName, FeatureProcessor *proc, gdImagePtr srcImage)
+{
+    if (!proc->gradImg || !proc->thetaImg)
+    {
+        std::cerr << "Error: Nothing to checkpoint, the image hasn't been processed." << std::endl;
+        return false;
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CheckpointMagic, sizeof(header.magic));
+    header.version = CheckpointVersion;
+    header.headerSize = sizeof(header);
+    header.sizeX = proc->sizeX;
+    header.sizeY = proc->sizeY;
+    header.srcSizeX = gdImageSX(srcImage);
+    header.srcSizeY = gdImageSY(srcImage);
+    header.gradThresh = proc->params.gradThresh;
+
+    unsigned long long numPix = (unsigned long long)header.sizeX * header.sizeY;
+    header.gradOffset = alignUp(sizeof(header));
+    header.thetaOffset = alignUp(header.gradOffset + numPix * sizeof(int));
+    header.srcOffset = alignUp(header.thetaOffset + numPix);
+    header.fileSize = header.srcOffset + (unsigned long long)header.srcSizeX * header.srcSizeY;
+
+    FILE *fp = fopen(fileName, "wb");
+    if (!fp)
+    {
+        std::cerr << "Error: Unable to open checkpoint file for writing: " << fileName << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && padTo(fp, header.gradOffset) &&
+        fwrite(proc->gradImg->getImgData(), sizeof(int), numPix, fp) == numPix;
+    ok = ok && padTo(fp, header.thetaOffset) &&
+        fwrite(proc->thetaImg->getImgData(), 1, numPix, fp) == numPix;
+    ok = ok && padTo(fp, header.srcOffset);
+
+    // The dot reader only looks at the red channel, so that's all we keep
+    std::vector<unsigned char> row(header.srcSizeX);
+    for (int iy = 0; ok && iy < header.srcSizeY; iy++)
+    {
+        for (int ix = 0; ix < header.srcSizeX; ix++)
+            row[ix] = gdImageRed(srcImage, gdImageGetPixel(srcImage, ix, iy));
+        ok = fwrite(&row[0], 1, row.size(), fp) == row.size();
+    }
+
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok)
+        std::cerr << "Error: Failed writing checkpoint file: " << fileName << std::endl;
+    else
+        logVerbose("Wrote checkpoint: " + std::string(fileName));
+
+    return ok;
+}
+
+FeatureCheckpoint::FeatureCheckpoint()
+{
+    fd = -1;
+    data = NULL;
+    dataSize = 0;
+    header = NULL;
+}
+
+FeatureCheckpoint::~FeatureCheckpoint()
+{
+    close();
+}
+
+// Map the file and check that it's sane
+bool FeatureCheckpoint::open(const char *fileName)
+{
+    close();
+
+    fd = ::open(fileName, O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Error: Unable to open checkpoint file: " << fileName << std::endl;
+        return false;
+    }
+
+    struct stat statBuf;
+    if (fstat(fd, &statBuf) != 0 || (size_t)statBuf.st_size < sizeof(CheckpointHeader))
+    {
+        std::cerr << "Error: Checkpoint file is too small: " << fileName << std::endl;
+        close();
+        return false;
+    }
+    dataSize = statBuf.st_size;
+
+    // Private, writable mapping.  Nothing downstream should write to these
+    //  planes, but if it does it won't touch the file.
+    data = mmap(NULL, dataSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        data = NULL;
+        std::cerr << "Error: Unable to map checkpoint file: " << fileName << std::endl;
+        close();
+        return false;
+    }
+
+    header = (CheckpointHeader *)data;
+    unsigned long long numPix = (unsigned long long)header->sizeX * header->sizeY;
+    if (memcmp(header->magic, CheckpointMagic, sizeof(header->magic)) != 0 ||
+        header->version != CheckpointVersion ||
+        header->headerSize != sizeof(CheckpointHeader) ||
+        header->sizeX <= 0 || header->sizeY <= 0 || header->srcSizeX <= 0 || header->srcSizeY <= 0 ||
+        header->fileSize != dataSize ||
+        header->gradOffset % CheckpointAlign != 0 ||
+        header->gradOffset + numPix * sizeof(int) > header->thetaOffset ||
+        header->thetaOffset + numPix > header->srcOffset ||
+        header->srcOffset + (unsigned long long)header->srcSizeX * header->srcSizeY > dataSize)
+    {
+        std::cerr << "Error: Not a valid checkpoint file: " << fileName << std::endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void FeatureCheckpoint::close()
+{
+    if (data)
+        munmap(data, dataSize);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    data = NULL;
+    dataSize = 0;
+    header = NULL;
+}
+
+// Wrap the mapped planes in a processor
+FeatureProcessor *FeatureCheckpoint::makeProcessor()
+{
+    if (!header)
+        return NULL;
+
+    char *base = (char *)data;
+    FeatureProcessor *proc = new FeatureProcessor(header->sizeX, header->sizeY);
+    proc->params.gradThresh = header->gradThresh;
+    proc->gradImg = new RawImageGray32((int *)(base + header->gradOffset), header->sizeX, header->sizeY, false);
+    proc->thetaImg = new RawImageGray8(base + header->thetaOffset, header->sizeX, header->sizeY, false);
+
+    return proc;
+}
+
+// Wrap the source plane
+RawImageGray8 *FeatureCheckpoint::makeSourceImage()
+{
+    if (!header)
+        return NULL;
+
+    char *base = (char *)data;
+    return new RawImageGray8(base + header->srcOffset, header->srcSizeX, header->srcSizeY, false);
+}
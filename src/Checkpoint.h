@@ -0,0 +1,79 @@
+/*
+ *  Checkpoint.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Saves the output of the front end (gradient and theta planes, after
+ *  non-max suppression) so the back end can be rerun with different
+ *  thresholds and tolerances without redoing the image processing.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#import "FeatureDetector.h"
+
+/* Checkpoint file layout.  Everything is in native byte order and each
+    plane starts on a 64 byte boundary so the file can be mapped and
+    used in place.
+     header
+     gradient plane (int32, sizeX*sizeY)
+     theta plane (uint8, sizeX*sizeY)
+     source plane (uint8, srcSizeX*srcSizeY)
+   The source plane is the red channel of the input image, which is what
+    the dot reader samples from.
+ */
+#define CheckpointMagic "QYOOCKPT"
+#define CheckpointVersion 1
+
+class CheckpointHeader
+{
+public:
+    char magic[8];
+    unsigned int version;
+    unsigned int headerSize;
+    int sizeX, sizeY;           // Size the image was processed at
+    int srcSizeX, srcSizeY;     // Size of the input image
+    int gradThresh;             // Non-max suppression threshold the planes were made with
+    int pad;
+    unsigned long long gradOffset, thetaOffset, srcOffset;
+    unsigned long long fileSize;
+};
+
+// Write out the front end results for the given processor.
+// srcImage is the image the processor was built from.
+bool SaveCheckpoint(const char *fileName, FeatureProcessor *proc, gdImagePtr srcImage);
+
+/* Feature Checkpoint
+	A checkpoint file mapped into memory.  The images it hands out
+	point straight into the mapping and are only good while it's open.
+ */
+class FeatureCheckpoint
+{
+public:
+    FeatureCheckpoint();
+    ~FeatureCheckpoint();
+
+    // Map the given file.  Returns false if it's not a valid checkpoint.
+    bool open(const char *fileName);
+
+    // Unmap the file
+    void close();
+
+    inline const CheckpointHeader *getHeader() { return header; }
+
+    // Build a processor around the mapped planes, ready for findQyoo()
+    FeatureProcessor *makeProcessor();
+
+    // The input image's red channel, for the dot reader.  Caller deletes.
+    RawImageGray8 *makeSourceImage();
+
+protected:
+    int fd;
+    void *data;
+    size_t dataSize;
+    CheckpointHeader *header;
+};
+
+#endif // CHECKPOINT_H
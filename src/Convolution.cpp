@@ -67,6 +67,28 @@ void ConvolutionFilterInt::processImage(RawImageGray8 *inImg,RawImageGray32 *out
 		}
 }
 
+// Process one row from a set of input rows
+void ConvolutionFilterInt::processRow(unsigned char **rows,int sizeX,unsigned char *outRow)
+{
+	int halfSize = size/2;
+	for (int ix=halfSize;ix<sizeX-halfSize;ix++)
+	{
+		int sum = 0;
+		for (int f_iy=0;f_iy<size;f_iy++)
+		{
+			unsigned char *row = rows[f_iy] + ix - halfSize;
+			int *el = &filter[f_iy*size];
+			for (int f_ix=0;f_ix<size;f_ix++)
+				sum += row[f_ix] * el[f_ix];
+		}
+		if (factor != 1)
+			sum /= factor;
+		if (sum > 255)
+			sum = 255;
+		outRow[ix] = sum;
+	}
+}
+
 // Process a single pixel and return the results in an array
 void ConvolutionFilterInt::processPixel(RawImageGray8 *inImg,int px,int py,int *results)
 {
@@ -134,53 +156,40 @@ ConvolutionFilterInt *MakeGaussianFilter(int size,float sigma)
 }
 
 // Make a hardwired gaussian filter
-int preGausFilter[] = {2,4,5,4,2, 4,9,12,9,4, 5,12,15,12,5, 4,9,12,9,4, 2,4,5,4,2};
 ConvolutionFilterInt *MakeGaussianFilter_1_4()
 {
-	ConvolutionFilterInt *filter = new ConvolutionFilterInt(5);
-	filter->getFact() = 115;
-	for (unsigned int ii=0;ii<5*5;ii++)
-		filter->getFilter()[ii] = preGausFilter[ii];
-	
-	return filter;
+	return new FixedConvolutionFilter<GaussianKernel_1_4>();
 }
 
 // Sobel filter in X
-int preSobelX[] = {-1,0,1, -2,0,2, -1,0,1};
 ConvolutionFilterInt *MakeSobelFilterX()
 {
-	ConvolutionFilterInt *filter = new ConvolutionFilterInt(3);
-	filter->getFact() = 1;
-	for (unsigned int ii=0;ii<3*3;ii++)
-		filter->getFilter()[ii] = preSobelX[ii];
-		
-	return filter;
+	return new FixedConvolutionFilter<SobelKernelX>();
 }
 
 // Sobel filter in Y
-int preSobelY[] = {-1,-2,-1, 0,0,0, 1,2,1};
 ConvolutionFilterInt *MakeSobelFilterY()
 {
-	ConvolutionFilterInt *filter = new ConvolutionFilterInt(3);
-	filter->getFact() = 1;
-	for (unsigned int ii=0;ii<3*3;ii++)
-		filter->getFilter()[ii] = preSobelY[ii];
-	
-	return filter;
+	return new FixedConvolutionFilter<SobelKernelY>();
 }
 
+// The qyoo dots are 11 pixels across with a radius of 5
+const int DotFilterSize = 11;
+const int DotFilterRadius = 5;
+
 // Make a sizeXsize filter that contains ones within radius
 ConvolutionFilterInt *MakeRadiusFilter(int size, int radius)
 {
+	if (size == DotFilterSize && radius == DotFilterRadius)
+		return new FixedConvolutionFilter<RadiusKernel<DotFilterSize,DotFilterRadius> >();
+
 	ConvolutionFilterInt *filter = new ConvolutionFilterInt(size);
 	
 	filter->getFact() = 0;
-	int cx = size/2, cy = size/2;
 	for (unsigned int ix=0;ix<size;ix++)
 		for (unsigned int iy=0;iy<size;iy++)
 		{
-			int dx = ix-cx, dy = iy-cy;
-			int elVal = (dx*dx + dy*dy < radius*radius);
+			int elVal = RadiusTap(size,radius,ix,iy);
 			filter->getEl(ix,iy) = elVal;
 			filter->getFact() += elVal;
 		}
@@ -189,13 +198,7 @@ ConvolutionFilterInt *MakeRadiusFilter(int size, int radius)
 }
 
 // Make a 3x3 filter that doesn't do anything
-int preIdentFilter[] = {0, 0, 0, 0, 1, 0, 0, 0, 0};
 ConvolutionFilterInt *MakeIdentityFilter()
 {
-	ConvolutionFilterInt *filter = new ConvolutionFilterInt(3);
-	filter->getFact() = 1;
-	for (unsigned int ii=0;ii<3*3;ii++)
-		filter->getFilter()[ii] = preIdentFilter[ii];
-	
-	return filter;	
+	return new FixedConvolutionFilter<IdentityKernel>();
 }
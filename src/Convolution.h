@@ -20,7 +20,7 @@ public:
 	// Initialize a convolution filter of the given size
 	// Size needs to be odd
 	ConvolutionFilterInt(int size);
-	~ConvolutionFilterInt();
+	virtual ~ConvolutionFilterInt();
 	
 	// Reference to an element of the filter
 	inline int &getEl(int x,int y) { return filter[y*size + x]; }
@@ -30,9 +30,14 @@ public:
 	
 	// Run the convolution filter on the input image
 	// Store the results in the output image
-	// Note: Yeah, this could be more efficient
-	void processImage(RawImageGray8 *inImg,RawImageGray8 *outImg);
-	void processImage(RawImageGray8 *inImg,RawImageGray32 *outImg);
+	// Note: Yeah, this could be more efficient.  FixedConvolutionFilter is.
+	virtual void processImage(RawImageGray8 *inImg,RawImageGray8 *outImg);
+	virtual void processImage(RawImageGray8 *inImg,RawImageGray32 *outImg);
+
+	// Run the filter over a single row, for when the input comes a row at a time.
+	// rows holds the size input rows centered on the output row.
+	// Like processImage(), the halfSize pixels at each end of outRow are left alone.
+	virtual void processRow(unsigned char **rows,int sizeX,unsigned char *outRow);
 	
 	// Calculate the results around the given pixel and return them
 	// Results needs enough space to do that
@@ -47,12 +52,141 @@ protected:
 	int *filter;
 };
 
+/* Fixed Kernels
+	Taps known at compile time.  Each kernel has a Size, a Factor to divide
+	 by at the end and a constexpr el(x,y) for the taps.
+ */
+constexpr int GaussianTaps_1_4[5*5] = {2,4,5,4,2, 4,9,12,9,4, 5,12,15,12,5, 4,9,12,9,4, 2,4,5,4,2};
+
+// Hardwired Gaussian, sigma = 1.4
+struct GaussianKernel_1_4
+{
+	static constexpr int Size = 5;
+	static constexpr int Factor = 115;
+	static constexpr int el(int x,int y) { return GaussianTaps_1_4[y*Size + x]; }
+};
+
+// Sobel operator in X
+struct SobelKernelX
+{
+	static constexpr int Size = 3;
+	static constexpr int Factor = 1;
+	static constexpr int el(int x,int y) { return (x-1) * (y == 1 ? 2 : 1); }
+};
+
+// Sobel operator in Y
+struct SobelKernelY
+{
+	static constexpr int Size = 3;
+	static constexpr int Factor = 1;
+	static constexpr int el(int x,int y) { return (y-1) * (x == 1 ? 2 : 1); }
+};
+
+// Does nothing
+struct IdentityKernel
+{
+	static constexpr int Size = 3;
+	static constexpr int Factor = 1;
+	static constexpr int el(int x,int y) { return (x == 1 && y == 1) ? 1 : 0; }
+};
+
+// Ones within radius of the middle
+constexpr int RadiusTap(int size,int radius,int x,int y)
+	{ return ((x-size/2)*(x-size/2) + (y-size/2)*(y-size/2) < radius*radius) ? 1 : 0; }
+constexpr int RadiusTapCount(int size,int radius,int tap = 0)
+	{ return tap >= size*size ? 0 : RadiusTap(size,radius,tap % size,tap / size) + RadiusTapCount(size,radius,tap+1); }
+
+template<int KernelSize,int Radius>
+struct RadiusKernel
+{
+	static constexpr int Size = KernelSize;
+	static constexpr int Factor = RadiusTapCount(KernelSize,Radius);
+	static constexpr int el(int x,int y) { return RadiusTap(KernelSize,Radius,x,y); }
+};
+
+// Sum of the kernel's taps up to and including Tap, unrolled at compile time.
+// rows are the kernel's input rows, starting at the left edge of the kernel.
+// Zero taps don't generate any code.
+template<class Kernel,int Tap,int Weight = (Tap < 0 ? 0 : Kernel::el(Tap % Kernel::Size,Tap / Kernel::Size))>
+struct KernelTapSum
+{
+	static inline int sum(unsigned char **rows,int ix)
+		{ return KernelTapSum<Kernel,Tap-1>::sum(rows,ix) + Weight * rows[Tap / Kernel::Size][ix + Tap % Kernel::Size]; }
+};
+
+template<class Kernel,int Tap>
+struct KernelTapSum<Kernel,Tap,0>
+{
+	static inline int sum(unsigned char **rows,int ix) { return KernelTapSum<Kernel,Tap-1>::sum(rows,ix); }
+};
+
+template<class Kernel>
+struct KernelTapSum<Kernel,-1,0>
+{
+	static inline int sum(unsigned char **,int) { return 0; }
+};
+
+/* Fixed Convolution Filter
+	Convolution filter for one of the fixed kernels above.
+	The taps are still filled in, so getEl(), print() and processPixel() work,
+	 but the processing is specialized for the kernel and fully unrolled.
+	Results are exactly the same as the runtime version.
+ */
+template<class Kernel>
+class FixedConvolutionFilter : public ConvolutionFilterInt
+{
+public:
+	FixedConvolutionFilter() : ConvolutionFilterInt(Kernel::Size)
+	{
+		factor = Kernel::Factor;
+		for (int iy=0;iy<Kernel::Size;iy++)
+			for (int ix=0;ix<Kernel::Size;ix++)
+				getEl(ix,iy) = Kernel::el(ix,iy);
+	}
+
+	void processImage(RawImageGray8 *inImg,RawImageGray8 *outImg) { processImageRows<true>(inImg,outImg->getImgData()); }
+	void processImage(RawImageGray8 *inImg,RawImageGray32 *outImg) { processImageRows<false>(inImg,outImg->getImgData()); }
+	void processRow(unsigned char **rows,int sizeX,unsigned char *outRow) { filterRow<true>(rows,sizeX,outRow); }
+
+protected:
+	static constexpr int HalfSize = Kernel::Size/2;
+
+	// Clip for 8 bit output
+	template<bool Clip,typename OutType>
+	static void filterRow(unsigned char **rows,int sizeX,OutType *outRow)
+	{
+		for (int ix=HalfSize;ix<sizeX-HalfSize;ix++)
+		{
+			int sum = KernelTapSum<Kernel,Kernel::Size*Kernel::Size-1>::sum(rows,ix-HalfSize);
+			if (Kernel::Factor != 1)
+				sum /= Kernel::Factor;
+			if (Clip && sum > 255)
+				sum = 255;
+			outRow[ix] = sum;
+		}
+	}
+
+	template<bool Clip,typename OutType>
+	static void processImageRows(RawImageGray8 *inImg,OutType *outData)
+	{
+		int sizeX = inImg->getSizeX(), sizeY = inImg->getSizeY();
+		unsigned char *rows[Kernel::Size];
+		for (int iy=HalfSize;iy<sizeY-HalfSize;iy++)
+		{
+			for (int ir=0;ir<Kernel::Size;ir++)
+				rows[ir] = inImg->getImgData() + (iy-HalfSize+ir)*sizeX;
+			filterRow<Clip>(rows,sizeX,outData + iy*sizeX);
+		}
+	}
+};
+
 // Make a hardwired Gaussian filter, sigma = 1.4
 // This has been tuned to work well, even though it ups the data values a little
 ConvolutionFilterInt *MakeGaussianFilter_1_4();
 
 // Build up a gaussian convolution filter of the given size
 // Size should be odd, sigma is the parameter
+// This one is built at runtime, since sigma can be anything
 ConvolutionFilterInt *MakeGaussianFilter(int size,float sigma);
 
 // Sobel operator in X
@@ -62,6 +196,7 @@ ConvolutionFilterInt *MakeSobelFilterX();
 ConvolutionFilterInt *MakeSobelFilterY();
 
 // A filter that contains ones within the given radius
+// The dot sized one is fixed, anything else is built at runtime.
 ConvolutionFilterInt *MakeRadiusFilter(int size,int radius);
 
 // A filter that does nothing
@@ -0,0 +1,209 @@
+/*
+ *  DetectClient.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "DetectClient.h"
+
+bool DetectClientRequest(const std::string &socketPath, const DetectRequestHeader &request, const unsigned char *data,
+                         DetectResponseHeader &response, std::string &text)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // A busy server answers without reading, so the write can fail and still leave a reply for us
+    if (DetectWriteFully(fd, &request, sizeof(request)))
+        DetectWriteFully(fd, data, request.dataSize);
+
+    bool ok = DetectReadFully(fd, &response, sizeof(response)) &&
+              memcmp(response.magic, DetectResponseMagic, sizeof(response.magic)) == 0;
+    if (ok)
+    {
+        text.resize(response.textSize);
+        ok = response.textSize == 0 || DetectReadFully(fd, &text[0], response.textSize);
+    }
+    close(fd);
+
+    return ok;
+}
+
+static bool readFile(const std::string &fileName, std::string &data)
+{
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Error: Unable to open image file: " << fileName << std::endl;
+        return false;
+    }
+    std::ostringstream strm;
+    strm << file.rdbuf();
+    data = strm.str();
+
+    return true;
+}
+
+static void makePNGRequest(DetectRequestHeader &request, const std::string &data)
+{
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, DetectRequestMagic, sizeof(request.magic));
+    request.format = DetectFormatPNG;
+    request.dataSize = data.size();
+}
+
+int RunDetectClient(const std::string &socketPath, const std::string &fileName)
+{
+    std::string data;
+    if (!readFile(fileName, data))
+        return 1;
+
+    DetectRequestHeader request;
+    makePNGRequest(request, data);
+    DetectResponseHeader response;
+    std::string text;
+    if (!DetectClientRequest(socketPath, request, (const unsigned char *)data.data(), response, text))
+    {
+        std::cerr << "Error: No reply from server at " << socketPath << std::endl;
+        return 1;
+    }
+
+    switch (response.status)
+    {
+        case DetectFound:
+        {
+            std::istringstream lines(text);
+            std::string value, bits;
+            while (lines >> value >> bits)
+            {
+                std::cout << "Binary = " << bits << std::endl;
+                std::cout << "Qyoo value = " << value << std::endl;
+                lines.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+        }
+            break;
+        case DetectNotFound:
+            std::cerr << "No Qyoo found in the image." << std::endl;
+            break;
+        default:
+            std::cerr << "Server replied: " << DetectReplyName(response.status) << std::endl;
+            return response.status == DetectBusy ? 2 : 1;
+    }
+    if (response.budgetExceeded)
+        std::cerr << "Warning: Detection budget exceeded, results may be incomplete." << std::endl;
+
+    return 0;
+}
+
+int RunDetectLoadTest(const std::string &socketPath, const std::string &fileName, int numClients, int numRequests)
+{
+    std::string data;
+    if (!readFile(fileName, data))
+        return 1;
+    numClients = std::max(numClients, 1);
+    numRequests = std::max(numRequests, 1);
+
+    DetectRequestHeader request;
+    makePNGRequest(request, data);
+
+    // Each client keeps its own numbers, so there's nothing to lock
+    class ClientStats
+    {
+    public:
+        ClientStats() { numFailed = 0;  memset(numReplies, 0, sizeof(numReplies)); }
+        std::vector<double> latencyMs;
+        std::vector<double> processMs;
+        int numFailed;
+        int numReplies[DetectShuttingDown+1];
+    };
+    std::vector<ClientStats> stats(numClients);
+
+    auto client = [&](ClientStats &stat)
+    {
+        for (int ii = 0; ii < numRequests; ii++)
+        {
+            DetectResponseHeader response;
+            std::string text;
+            auto startTime = std::chrono::steady_clock::now();
+            bool ok = DetectClientRequest(socketPath, request, (const unsigned char *)data.data(), response, text);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+            if (!ok || response.status > DetectShuttingDown)
+            {
+                stat.numFailed++;
+                continue;
+            }
+            stat.numReplies[response.status]++;
+            if (response.status == DetectFound || response.status == DetectNotFound)
+            {
+                stat.latencyMs.push_back(ms);
+                stat.processMs.push_back(response.processMs);
+            }
+        }
+    };
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int ii = 0; ii < numClients; ii++)
+        threads.push_back(std::thread(client, std::ref(stats[ii])));
+    for (auto &thread : threads)
+        thread.join();
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+    // Pull it all together
+    ClientStats all;
+    for (auto &stat : stats)
+    {
+        all.latencyMs.insert(all.latencyMs.end(), stat.latencyMs.begin(), stat.latencyMs.end());
+        all.processMs.insert(all.processMs.end(), stat.processMs.begin(), stat.processMs.end());
+        all.numFailed += stat.numFailed;
+        for (int ii = 0; ii <= DetectShuttingDown; ii++)
+            all.numReplies[ii] += stat.numReplies[ii];
+    }
+    std::sort(all.latencyMs.begin(), all.latencyMs.end());
+    std::sort(all.processMs.begin(), all.processMs.end());
+    auto percentile = [](const std::vector<double> &vals, double frac)
+    {
+        return vals.empty() ? 0.0 : vals[std::min((size_t)(frac * vals.size()), vals.size() - 1)];
+    };
+
+    int numTotal = numClients * numRequests;
+    std::cout << numClients << " clients x " << numRequests << " requests in " << totalMs << " ms, "
+              << all.latencyMs.size() * 1000.0 / totalMs << " served/s" << std::endl;
+    for (int ii = 0; ii <= DetectShuttingDown; ii++)
+        if (all.numReplies[ii] > 0)
+            std::cout << "  " << DetectReplyName(ii) << ": " << all.numReplies[ii] << std::endl;
+    if (all.numFailed > 0)
+        std::cout << "  no reply: " << all.numFailed << std::endl;
+    std::cout << "latency ms: p50 " << percentile(all.latencyMs, 0.5) << ", p90 " << percentile(all.latencyMs, 0.9)
+              << ", p99 " << percentile(all.latencyMs, 0.99) << ", max " << percentile(all.latencyMs, 1.0) << std::endl;
+    std::cout << "server ms:  p50 " << percentile(all.processMs, 0.5) << ", p90 " << percentile(all.processMs, 0.9)
+              << ", p99 " << percentile(all.processMs, 0.99) << ", max " << percentile(all.processMs, 1.0) << std::endl;
+
+    return all.numFailed == numTotal ? 1 : 0;
+}
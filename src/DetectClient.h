@@ -0,0 +1,32 @@
+/*
+ *  DetectClient.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  The other end of DetectServer: send an image and print what came
+ *  back, or hammer the server from several threads to see how it holds up.
+ */
+
+#ifndef DETECTCLIENT_H
+#define DETECTCLIENT_H
+
+#import <string>
+#import "DetectServer.h"
+
+// Send one request and wait for the reply.
+// Returns false if we couldn't talk to the server.
+bool DetectClientRequest(const std::string &socketPath, const DetectRequestHeader &request, const unsigned char *data,
+                         DetectResponseHeader &response, std::string &text);
+
+// Send a PNG file and print the codes like the command line does.
+// Returns the exit code: 0 if the server answered, 1 if it didn't, 2 if it was busy.
+int RunDetectClient(const std::string &socketPath, const std::string &fileName);
+
+/* Load test
+	numClients threads each send the PNG file numRequests times, back to back.
+	Prints the throughput, the latency spread and how many of each reply came back.
+ */
+int RunDetectLoadTest(const std::string &socketPath, const std::string &fileName, int numClients, int numRequests);
+
+#endif // DETECTCLIENT_H
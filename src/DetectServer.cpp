@@ -0,0 +1,413 @@
+/*
+ *  DetectServer.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "DetectServer.h"
+#include "Logger.h"
+
+// Not everyone has this.  SIGPIPE is ignored by the callers there (see main).
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+bool DetectReadFully(int fd, void *buf, size_t size)
+{
+    char *ptr = (char *)buf;
+    while (size > 0)
+    {
+        ssize_t num = read(fd, ptr, size);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num <= 0)
+            return false;
+        ptr += num;
+        size -= num;
+    }
+
+    return true;
+}
+
+// MSG_NOSIGNAL, so a caller that hung up doesn't take us down with SIGPIPE
+bool DetectWriteFully(int fd, const void *buf, size_t size)
+{
+    const char *ptr = (const char *)buf;
+    while (size > 0)
+    {
+        ssize_t num = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num <= 0)
+            return false;
+        ptr += num;
+        size -= num;
+    }
+
+    return true;
+}
+
+const char *DetectReplyName(unsigned int status)
+{
+    switch (status)
+    {
+        case DetectFound: return "found";
+        case DetectNotFound: return "not found";
+        case DetectBusy: return "busy";
+        case DetectBadRequest: return "bad request";
+        case DetectShuttingDown: return "shutting down";
+    }
+
+    return "unknown";
+}
+
+static bool imageSizeOK(long long sizeX, long long sizeY)
+{
+    return sizeX > 0 && sizeY > 0 && sizeX <= DetectMaxImageSide && sizeY <= DetectMaxImageSide && sizeX * sizeY <= DetectMaxImagePixels;
+}
+
+// Big endian, as in the PNG header
+static long long readBE32(const unsigned char *ptr)
+{
+    return (long long)ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
+}
+
+gdImagePtr DetectDecodeImage(const DetectRequestHeader &header, const unsigned char *data)
+{
+    if (header.format == DetectFormatPNG)
+    {
+        // The signature, then the IHDR chunk with the width and height.  Check them before gd allocates anything.
+        static const unsigned char pngSig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        if (header.dataSize < 24 || memcmp(data, pngSig, sizeof(pngSig)) != 0 || memcmp(data + 12, "IHDR", 4) != 0 ||
+            !imageSizeOK(readBE32(data + 16), readBE32(data + 20)))
+            return NULL;
+        gdImagePtr image = gdImageCreateFromPngPtr(header.dataSize, (void *)data);
+        return image ? gdMakeTrueColor(image) : NULL;
+    }
+
+    if (header.format == DetectFormatGray8)
+    {
+        if (!imageSizeOK(header.sizeX, header.sizeY) ||
+            (unsigned long long)header.sizeX * header.sizeY != header.dataSize)
+            return NULL;
+        gdImagePtr image = gdImageCreateTrueColor(header.sizeX, header.sizeY);
+        if (!image)
+            return NULL;
+        for (int iy = 0; iy < header.sizeY; iy++)
+        {
+            const unsigned char *row = data + iy * header.sizeX;
+            for (int ix = 0; ix < header.sizeX; ix++)
+                image->tpixels[iy][ix] = gdTrueColor(row[ix], row[ix], row[ix]);
+        }
+        return image;
+    }
+
+    return NULL;
+}
+
+// A line per qyoo read.  Returns how many there were.
+static int collectCodes(FeatureProcessor *proc, std::string &resultText)
+{
+    std::ostringstream text;
+    int numRead = 0;
+    for (auto *featDots : proc->featureDots)
+    {
+        Feature *feat = featDots->feat;
+        if (feat->dotDecStr.empty())
+            continue;
+        float px, py, scale, rot;
+        feat->getPlacement(px, py, scale, rot);
+        text << feat->dotDecStr << " " << feat->dotBinStr << " " << px << " " << py << " " << scale << " " << rot << "\n";
+        numRead++;
+    }
+    resultText = text.str();
+
+    return numRead;
+}
+
+static FeatureProcessor *makeProcessor(int sizeX, int sizeY)
+{
+    FeatureProcessor *proc = new FeatureProcessor(sizeX, sizeY);
+    proc->writeAnnotations = false;
+    return proc;
+}
+
+// Same steps as the command line, minus the extras
+int DetectImage(gdImagePtr image, FeatureProcessor *&proc, const DetectionParams &params, bool firstMatch,
+                std::string &resultText, bool &budgetExceeded)
+{
+    int sizeX = gdImageSX(image), sizeY = gdImageSY(image);
+    if (!proc)
+        proc = makeProcessor(sizeX, sizeY);
+    proc->params = params;
+    proc->loadImage(image, sizeX, sizeY);
+    proc->processImage();
+
+    int numFound = firstMatch ? proc->findFirstQyoo(image) : proc->findQyoo();
+    budgetExceeded = proc->status == DetectBudgetExceeded;
+    if (numFound > 0 && proc->featureDots.empty())
+        proc->findDots(image);
+
+    return collectCodes(proc, resultText);
+}
+
+int DetectImage(RawImageGray8 *image, FeatureProcessor *&proc, const DetectionParams &params, bool firstMatch,
+                std::string &resultText, bool &budgetExceeded)
+{
+    if (!proc)
+        proc = makeProcessor(image->getSizeX(), image->getSizeY());
+    proc->params = params;
+    proc->loadImage(image);
+    proc->processImage();
+
+    int numFound = firstMatch ? proc->findFirstQyoo(image) : proc->findQyoo();
+    budgetExceeded = proc->status == DetectBudgetExceeded;
+    if (numFound > 0 && proc->featureDots.empty())
+        proc->findDots(image);
+
+    return collectCodes(proc, resultText);
+}
+
+DetectServer::DetectServer()
+{
+    firstMatch = false;
+    numWorkers = 0;
+    maxQueue = 16;
+    cache = NULL;
+    numServed = 0;
+    numBusy = 0;
+    numBad = 0;
+    listenFd = -1;
+    stopping = false;
+    draining = false;
+}
+
+DetectServer::~DetectServer()
+{
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+}
+
+bool DetectServer::start(const std::string &inSocketPath)
+{
+    socketPath = inSocketPath;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Error: Socket path is too long: " << socketPath << std::endl;
+        return false;
+    }
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        std::cerr << "Error: Unable to create socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    // Whoever had the socket before us is gone, or bind() would be the least of our problems
+    unlink(socketPath.c_str());
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0)
+    {
+        std::cerr << "Error: Unable to listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    int threads = numWorkers;
+    if (threads <= 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads <= 0)
+        threads = 1;
+    for (int ii = 0; ii < threads; ii++)
+        workers.push_back(std::thread(&DetectServer::worker, this));
+
+    logVerbose("Listening on " + socketPath + " with " + std::to_string(threads) + " workers");
+
+    return true;
+}
+
+void DetectServer::run()
+{
+    DetectResponseHeader busy;
+    memset(&busy, 0, sizeof(busy));
+    memcpy(busy.magic, DetectResponseMagic, sizeof(busy.magic));
+    busy.status = DetectBusy;
+
+    // Wake up now and then to see if we've been told to stop
+    while (!stopping)
+    {
+        pollfd pfd;
+        pfd.fd = listenFd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if ((int)queue.size() < maxQueue)
+            {
+                queue.push_back(fd);
+                queued = true;
+            }
+        }
+        if (queued)
+        {
+            queueCond.notify_one();
+            continue;
+        }
+
+        // No room.  Say so without reading the request, so we don't get held up.
+        numBusy++;
+        DetectWriteFully(fd, &busy, sizeof(busy));
+        close(fd);
+    }
+
+    // Anyone still in the listen backlog is told we're going away
+    DetectResponseHeader shuttingDown = busy;
+    shuttingDown.status = DetectShuttingDown;
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    int fd;
+    while ((fd = accept(listenFd, NULL, NULL)) >= 0)
+    {
+        DetectWriteFully(fd, &shuttingDown, sizeof(shuttingDown));
+        close(fd);
+    }
+
+    // Nothing new gets in, but everything that made the queue gets done
+    close(listenFd);
+    listenFd = -1;
+    unlink(socketPath.c_str());
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        draining = true;
+        logVerbose("Draining " + std::to_string(queue.size()) + " queued connections");
+    }
+    queueCond.notify_all();
+    for (auto &thread : workers)
+        thread.join();
+    workers.clear();
+}
+
+void DetectServer::worker()
+{
+    FeatureProcessor *proc = NULL;
+
+    while (true)
+    {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCond.wait(lock, [this]() { return draining || !queue.empty(); });
+            if (queue.empty())
+                break;
+            fd = queue.front();
+            queue.pop_front();
+        }
+
+        handleConnection(fd, proc);
+        close(fd);
+    }
+
+    delete proc;
+}
+
+// Read one request, run it and reply
+void DetectServer::handleConnection(int fd, FeatureProcessor *&proc)
+{
+    timeval timeout;
+    timeout.tv_sec = DetectReadTimeoutSec;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    DetectResponseHeader response;
+    memset(&response, 0, sizeof(response));
+    memcpy(response.magic, DetectResponseMagic, sizeof(response.magic));
+    std::string text;
+
+    DetectRequestHeader request;
+    if (!DetectReadFully(fd, &request, sizeof(request)))
+    {
+        numBad++;
+        return;
+    }
+    if (memcmp(request.magic, DetectRequestMagic, sizeof(request.magic)) != 0 || request.dataSize > DetectMaxRequestSize)
+    {
+        numBad++;
+        response.status = DetectBadRequest;
+        DetectWriteFully(fd, &response, sizeof(response));
+        return;
+    }
+
+    std::vector<unsigned char> data(request.dataSize);
+    if (!DetectReadFully(fd, data.data(), data.size()))
+    {
+        numBad++;
+        return;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    // An image we've seen before doesn't need decoding.  Raw gray rows are only the same image at the same size.
+    // PNGs get the same keys as in a batch, so the two can share a cache.
+    unsigned long long cacheKey = 0;
+    ResultCacheEntry cached;
+    if (cache)
+        cacheKey = cache->makeKey(data.data(), data.size(), request.format == DetectFormatGray8 ?
+                                  (unsigned long long)request.sizeX << 32 | (unsigned int)request.sizeY : 0);
+    gdImagePtr image = NULL;
+    if (cache && cache->lookup(cacheKey, cached))
+    {
+        text = cached.text;
+        response.numFound = cached.numFound;
+        response.status = response.numFound > 0 ? DetectFound : DetectNotFound;
+        response.textSize = text.size();
+        numServed++;
+    } else if ((image = DetectDecodeImage(request, data.data())))
+    {
+        bool budgetExceeded = false;
+        response.numFound = DetectImage(image, proc, params, firstMatch, text, budgetExceeded);
+        response.status = response.numFound > 0 ? DetectFound : DetectNotFound;
+        response.budgetExceeded = budgetExceeded;
+        response.textSize = text.size();
+        gdImageDestroy(image);
+        numServed++;
+        if (cache && !budgetExceeded)
+        {
+            cached.numFound = response.numFound;
+            cached.text = text;
+            cache->store(cacheKey, cached);
+        }
+    } else {
+        response.status = DetectBadRequest;
+        numBad++;
+    }
+    response.processMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+    if (DetectWriteFully(fd, &response, sizeof(response)))
+        DetectWriteFully(fd, text.data(), text.size());
+}
@@ -0,0 +1,143 @@
+/*
+ *  DetectServer.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  A long running detector that takes images over a Unix domain socket.
+ *  Each worker keeps its own FeatureProcessor between requests, so a
+ *  stream of images doesn't pay for setting up the buffers every time.
+ *  A bounded queue in front of the workers turns callers away with a
+ *  busy status instead of letting them wait longer and longer.
+ */
+
+#ifndef DETECTSERVER_H
+#define DETECTSERVER_H
+
+#import <string>
+#import <vector>
+#import <deque>
+#import <mutex>
+#import <condition_variable>
+#import <thread>
+#import <atomic>
+#import "FeatureDetector.h"
+#import "ResultCache.h"
+
+/* Protocol
+	One request and one response per connection, in native byte order.
+	 request:  DetectRequestHeader, then dataSize bytes of image
+	 response: DetectResponseHeader, then textSize bytes of result text
+	The image is either an encoded PNG or raw 8 bit gray rows.
+	The result text has a line per qyoo read:
+	 <decimal value> <binary> <corner x> <corner y> <scale> <rotation>
+	The placement is in processed image pixels and radians.
+ */
+#define DetectRequestMagic "QYRQ"
+#define DetectResponseMagic "QYRS"
+// Anything bigger than this is turned away without reading it
+#define DetectMaxRequestSize (64*1024*1024)
+// Images bigger than this on a side or in total are turned away before anything's allocated for them,
+//  since a small PNG can claim to be huge
+#define DetectMaxImageSide 8192
+#define DetectMaxImagePixels (16*1024*1024)
+// Connections that don't send their request in this long are dropped
+#define DetectReadTimeoutSec 5
+
+// What the request data is
+typedef enum {DetectFormatPNG=0,DetectFormatGray8} DetectFormat;
+
+class DetectRequestHeader
+{
+public:
+    char magic[4];
+    unsigned int format;    // DetectFormat
+    int sizeX, sizeY;       // Only used for DetectFormatGray8
+    unsigned int dataSize;
+};
+
+// How the request went
+typedef enum {DetectFound=0,DetectNotFound,DetectBusy,DetectBadRequest,DetectShuttingDown} DetectReply;
+
+class DetectResponseHeader
+{
+public:
+    char magic[4];
+    unsigned int status;          // DetectReply
+    int numFound;                 // Qyoos read
+    unsigned int budgetExceeded;  // Detection ran out of budget, there may be more
+    float processMs;              // Time the worker spent on it, not counting the wait
+    unsigned int textSize;
+};
+
+// Read or write all of it, riding out interruptions.  False on an error or end of file.
+bool DetectReadFully(int fd, void *buf, size_t size);
+bool DetectWriteFully(int fd, const void *buf, size_t size);
+
+// Human readable name for a reply status
+const char *DetectReplyName(unsigned int status);
+
+// Turn request data into an image detection can use.
+// Returns NULL if it doesn't make sense or it's too big.
+gdImagePtr DetectDecodeImage(const DetectRequestHeader &header, const unsigned char *data);
+
+/* Run detection on an image and collect the codes read, one line per qyoo
+	(see the protocol above).  The processor is made on first use and reused
+	after that.  Returns the number of qyoos read.
+ */
+int DetectImage(gdImagePtr image, FeatureProcessor *&proc, const DetectionParams &params, bool firstMatch,
+                std::string &resultText, bool &budgetExceeded);
+// Same, from an 8 bit gray image processed at its own size.  The image is only read.
+int DetectImage(RawImageGray8 *image, FeatureProcessor *&proc, const DetectionParams &params, bool firstMatch,
+                std::string &resultText, bool &budgetExceeded);
+
+/* Detect Server
+	Listens on a Unix domain socket and hands connections to a pool of
+	workers through a queue of at most maxQueue connections.  When the
+	queue is full the connection gets a DetectBusy reply right away.
+	stop() closes the socket, and run() returns once the workers have
+	finished everything that was already queued.
+ */
+class DetectServer
+{
+public:
+    DetectServer();
+    ~DetectServer();
+
+    // Set these before start()
+    DetectionParams params;     // Used for every request
+    bool firstMatch;            // Stop at the first qyoo read
+    int numWorkers;             // 0 for one per core
+    int maxQueue;               // Connections waiting for a worker before we're busy
+    ResultCache *cache;         // Results by image content, if set.  Not owned.
+
+    // Set up the socket and start the workers.  Returns false if the socket can't be set up.
+    bool start(const std::string &socketPath);
+
+    // Accept connections until stop(), then drain the queue and stop the workers
+    void run();
+
+    // Stop accepting connections.  Safe to call from a signal handler.
+    void stop() { stopping = true; }
+
+    // Totals, for the summary at the end
+    std::atomic<int> numServed;     // Requests that got a detection result
+    std::atomic<int> numBusy;       // Turned away because the queue was full
+    std::atomic<int> numBad;        // Requests we couldn't make sense of
+
+protected:
+    void worker();
+    void handleConnection(int fd, FeatureProcessor *&proc);
+
+    std::string socketPath;
+    int listenFd;
+    std::atomic<bool> stopping;
+
+    std::mutex queueMutex;
+    std::condition_variable queueCond;
+    std::deque<int> queue;          // Accepted connections waiting for a worker
+    bool draining;                  // No more connections are coming
+    std::vector<std::thread> workers;
+};
+
+#endif // DETECTSERVER_H
@@ -0,0 +1,210 @@
+/*
+ *  DotClassifier.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <algorithm>
+#include "DotClassifier.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A pixel has to be this far from the background to count
+const int RadianceDistMatch = 60;
+// And this fraction of the disc has to count
+const float PassRatio = .40;  // 40% coverage
+
+// Precalculate the spans for the disc
+DotClassifier::DotClassifier(int pixelsPerDot, int radius)
+{
+    this->pixelsPerDot = pixelsPerDot;
+    img = NULL;
+    tableX = tableY = 0;
+    tableAlloc = 0;
+    sumTable = NULL;
+    matchTable = NULL;
+    matchImg = NULL;
+
+    // Same taps as MakeRadiusFilter()
+    spans = new Span[pixelsPerDot];
+    numSpans = 0;
+    discPixels = 0;
+    int half = pixelsPerDot / 2;
+    for (int iy = 0; iy < pixelsPerDot; iy++)
+    {
+        int dy = iy - half;
+        int x0 = pixelsPerDot, x1 = -1;
+        for (int ix = 0; ix < pixelsPerDot; ix++)
+        {
+            int dx = ix - half;
+            if (dx * dx + dy * dy < radius * radius)
+            {
+                if (ix < x0) x0 = ix;
+                if (ix > x1) x1 = ix;
+            }
+        }
+        if (x1 >= x0)
+        {
+            Span &span = spans[numSpans++];
+            span.dy = dy;
+            span.x0 = x0 - half;
+            span.x1 = x1 - half + 1;
+            discPixels += x1 - x0 + 1;
+        }
+    }
+    zeroTaps = pixelsPerDot * pixelsPerDot - discPixels;
+}
+
+DotClassifier::~DotClassifier()
+{
+    delete [] spans;
+    delete [] sumTable;
+    delete [] matchTable;
+    delete [] matchImg;
+}
+
+// Grow the tables if we need to.  Dot images are all the same size,
+//  so this only does something the first time through.
+void DotClassifier::reserve(int sizeX, int sizeY)
+{
+    tableX = sizeX + 1;
+    tableY = sizeY + 1;
+    if (tableX * tableY <= tableAlloc)
+        return;
+
+    delete [] sumTable;
+    delete [] matchTable;
+    delete [] matchImg;
+    tableAlloc = tableX * tableY;
+    sumTable = new int[tableAlloc];
+    matchTable = new int[tableAlloc];
+    matchImg = new unsigned char[sizeX * sizeY];
+}
+
+// Build a summed area table with an empty row and column up front
+static void buildTable(const unsigned char *src, int sizeX, int sizeY, int *table)
+{
+    int tableX = sizeX + 1;
+    memset(table, 0, tableX * sizeof(int));
+    for (int iy = 0; iy < sizeY; iy++)
+    {
+        const unsigned char *row = &src[iy * sizeX];
+        int *above = &table[iy * tableX];
+        int *cur = above + tableX;
+        int rowSum = 0;
+        cur[0] = 0;
+        for (int ix = 0; ix < sizeX; ix++)
+        {
+            rowSum += row[ix];
+            cur[ix + 1] = above[ix + 1] + rowSum;
+        }
+    }
+}
+
+// Load the image and sum up the pixel values
+void DotClassifier::setImage(RawImageGray8 *inImg)
+{
+    img = inImg;
+    reserve(img->getSizeX(), img->getSizeY());
+    buildTable(img->getImgData(), img->getSizeX(), img->getSizeY(), sumTable);
+}
+
+// Add up the spans of the disc
+int DotClassifier::discSum(const int *table, int px, int py)
+{
+    int sum = 0;
+    for (int ii = 0; ii < numSpans; ii++)
+    {
+        const Span &span = spans[ii];
+        const int *row0 = &table[(py + span.dy) * tableX + px];
+        const int *row1 = row0 + tableX;
+        sum += row1[span.x1] - row1[span.x0] - row0[span.x1] + row0[span.x0];
+    }
+
+    return sum;
+}
+
+// The radius filter used to return -1 for every tap that was off
+//  and those got averaged in too.  We keep that so the background
+//  color comes out the same.
+int DotClassifier::avgPixel(int px, int py)
+{
+    float val = (float)(discSum(sumTable, px, py) - zeroTaps);
+
+    return val / discPixels;
+}
+
+// Mark the pixels below (or above) a cutoff in one pass
+static void thresholdImage(const unsigned char *src, int num, int cut, bool below, unsigned char *dest)
+{
+    int ii = 0;
+    // Nothing can pass
+    if ((below && cut <= 0) || (!below && cut >= 255))
+    {
+        memset(dest, 0, num);
+        return;
+    }
+
+#ifdef __SSE2__
+    // Unsigned compares by way of min/max
+    const __m128i one = _mm_set1_epi8(1);
+    if (below)
+    {
+        const __m128i edge = _mm_set1_epi8((char)(cut - 1));
+        for (; ii + 16 <= num; ii += 16)
+        {
+            __m128i pix = _mm_loadu_si128((const __m128i *)&src[ii]);
+            __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(pix, edge), pix);
+            _mm_storeu_si128((__m128i *)&dest[ii], _mm_and_si128(hit, one));
+        }
+    } else {
+        const __m128i edge = _mm_set1_epi8((char)(cut + 1));
+        for (; ii + 16 <= num; ii += 16)
+        {
+            __m128i pix = _mm_loadu_si128((const __m128i *)&src[ii]);
+            __m128i hit = _mm_cmpeq_epi8(_mm_max_epu8(pix, edge), pix);
+            _mm_storeu_si128((__m128i *)&dest[ii], _mm_and_si128(hit, one));
+        }
+    }
+#endif
+
+    for (; ii < num; ii++)
+        dest[ii] = below ? (src[ii] < cut) : (src[ii] > cut);
+}
+
+/* Look for all the dots at once.
+   A pixel matches if it's far enough from the background color and
+    on the opposite side of 128 (with a little slop).  For a given
+    background that boils down to a single cutoff:
+     whitish background: pix < min(back-RadianceDistMatch, 128+32)
+     blackish background: pix > max(back+RadianceDistMatch, 128-32)
+ */
+void DotClassifier::classifyGrid(int backColor, int numRow, int numPos, unsigned char *isDot)
+{
+    bool isWhite = (backColor >= 128);
+    int cut;
+    if (isWhite)
+        cut = std::min(backColor - RadianceDistMatch, 128 + 32);
+    else
+        cut = std::max(backColor + RadianceDistMatch, 128 - 32);
+
+    int sizeX = img->getSizeX(), sizeY = img->getSizeY();
+    thresholdImage(img->getImgData(), sizeX * sizeY, cut, isWhite, matchImg);
+    buildTable(matchImg, sizeX, sizeY, matchTable);
+
+    for (int row = 0; row < numRow; row++)
+    {
+        int rowPix = pixelsPerDot * (row + 1) + pixelsPerDot / 2;
+        for (int pos = 0; pos < numPos; pos++)
+        {
+            int posPix = pixelsPerDot * (pos + 1) + pixelsPerDot / 2;
+            int numMatch = discSum(matchTable, posPix, rowPix);
+            float ratio = (float)numMatch / (float)discPixels;
+            isDot[row * numPos + pos] = (ratio >= PassRatio);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ *  DotClassifier.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Decides which dots are set in a qyoo that has been rendered into
+ *  dot space.  This replaces running a radius convolution filter around
+ *  every dot center.
+ */
+
+#ifndef DOTCLASSIFIER_H
+#define DOTCLASSIFIER_H
+
+#import "RawImage.h"
+
+/* Dot Classifier
+	The disc around a dot center is precomputed once as a list of row spans.
+	A dot image is loaded into two summed area tables, one of the pixel values
+	and one of the pixels that "match" the background test.  After that the
+	average and the match count for any disc are a few lookups per span.
+
+	All the buffers are sized on the first image and reused after that,
+	so classifying a feature doesn't allocate anything.
+ */
+class DotClassifier
+{
+public:
+    // pixelsPerDot is the size of a single dot cell
+    // Pixels closer than radius to the cell center are part of the dot
+    DotClassifier(int pixelsPerDot, int radius);
+    ~DotClassifier();
+
+    // Load a rendered dot image and build the intensity table
+    void setImage(RawImageGray8 *img);
+
+    // Average pixel value of the disc centered at (px,py).
+    // Matches the old radius filter, zero taps and all.
+    int avgPixel(int px, int py);
+
+    // Classify all the dots in a numRow x numPos grid against the background color.
+    // Dot (row,pos) is centered in the cell one over from the border.
+    // Results go in isDot[row*numPos + pos]
+    void classifyGrid(int backColor, int numRow, int numPos, unsigned char *isDot);
+
+    // Number of pixels in the disc
+    inline int discSize() { return discPixels; }
+
+protected:
+    // Make sure the tables are big enough for the given image
+    void reserve(int sizeX, int sizeY);
+
+    // Sum up the disc at (px,py) using the given summed area table
+    int discSum(const int *table, int px, int py);
+
+    // One row of the disc, relative to the center
+    class Span
+    {
+    public:
+        int dy, x0, x1;  // x1 is one past the end
+    };
+
+    int pixelsPerDot;
+    int numSpans;
+    Span *spans;
+    int discPixels;      // Taps that are on in the disc
+    int zeroTaps;        // Taps that are off in the cell
+
+    RawImageGray8 *img;  // Image we're currently looking at
+    int tableX, tableY;  // Size of the summed area tables (one more than the image)
+    int tableAlloc;
+    int *sumTable;       // Summed pixel values
+    int *matchTable;     // Summed matching pixel counts
+    unsigned char *matchImg;  // Match mask, one byte per pixel
+};
+
+#endif // DOTCLASSIFIER_H
@@ -8,9 +8,11 @@
  */
 
 #import <algorithm>
+#import <type_traits>
 
 #import "Feature.h"
 #import "CannyDetector.h"
+#import "QyooModel.h"
 #include "Logger.h"
 
 // Tack a point on the end
@@ -127,7 +129,8 @@ void Feature::findCorner()
 			maxDist2 = dist;
 		}
 	}
-	logVerbose("Corner found at (" + std::to_string(cornX) + ", " + std::to_string(cornY) + "), distance: " + std::to_string(maxDist2));
+	if (verbose)
+		logVerbose("Corner found at (" + std::to_string(cornX) + ", " + std::to_string(cornY) + "), distance: " + std::to_string(maxDist2));
 }
 
 // We don't want things too long and skinny
@@ -169,6 +172,45 @@ void Feature::checkSizeAndPosition(int imgSizeX,int imgSizeY)
 		valid = false;
 }
 
+// Same MBR, aspect and area tests as above, on the undecimated points
+float Feature::candidateScore(int imgSizeX,int imgSizeY,int closedDist2) const
+{
+	if (points.empty())
+		return 0.0;
+
+	int minX = imgSizeX,minY = imgSizeY;
+	int maxX = -1,maxY = -1;
+	for (std::list<Point>::const_iterator pt = points.begin();pt != points.end(); ++pt)
+	{
+		if (pt->x < minX)  minX = pt->x;
+		if (pt->y < minY)  minY = pt->y;
+		if (pt->x > maxX)  maxX = pt->x;
+		if (pt->y > maxY)  maxY = pt->y;
+	}
+	int sizeX = maxX - minX, sizeY = maxY - minY;
+
+	bool sizeOk = (sizeX > 0 && sizeY > 0);
+	if (sizeOk && sizeX > sizeY && (float)sizeX / (float)sizeY < MinAspectRatio)  sizeOk = false;
+	if (sizeOk && sizeY > sizeX && (float)sizeY / (float)sizeX < MinAspectRatio)  sizeOk = false;
+	if (sizeOk)
+	{
+		float areaFrac = (float)(sizeX*sizeY) / (float)(imgSizeX*imgSizeY);
+		if (areaFrac < MinAreaFraction || areaFrac > MaxAreaFraction)
+			sizeOk = false;
+	}
+
+	const Point &p0 = points.front(),&p1 = points.back();
+	int dx = p0.x - p1.x, dy = p0.y - p1.y;
+	bool isClosed = (dx*dx + dy*dy) <= closedDist2;
+
+	// Point count can't get anywhere near these
+	float score = points.size();
+	if (isClosed)  score += 1e7;
+	if (sizeOk)  score += 1e8;
+
+	return score;
+}
+
 // Simple class for edges we're comparing below
 class LongEdge
 {
@@ -199,26 +241,40 @@ static bool compFunction (const LongEdge &a,const LongEdge &b)
 	return a.len2() > b.len2();
 }
 
-// Look for the point farthest from the given line
-bool Feature::findFarPoint(float p0x,float p0y,float p1x,float p1y,Point &far,float &farDist2)
+// Find the farthest point from each of the two lines p0-e0 and p0-e1.
+// These are the costliest scans in validation, so we walk origPoints once
+//  and only compare cross products inside the loop.
+bool Feature::findFarPoints(float p0x,float p0y,float e0x,float e0y,float e1x,float e1y,
+							Point &far0,float &farDist0,Point &far1,float &farDist1)
 {
-	float maxDist2 = -1.0;
+	float d0x = e0x - p0x, d0y = e0y - p0y;
+	float d1x = e1x - p0x, d1y = e1y - p0y;
+	float len0 = d0x*d0x + d0y*d0y, len1 = d1x*d1x + d1y*d1y;
+	if (len0 <= 0.0 || len1 <= 0.0)
+		return false;
 
-	// We just care about the points here
+	// Distance from a line is |cross| / length, so the biggest |cross| wins
+	float max0 = -1.0, max1 = -1.0;
 	for (std::list<Point>::iterator pt = origPoints.begin(); pt != origPoints.end(); ++pt)
 	{
-		SimpleLineSegment seg(SimplePoint2D(p0x,p0y),SimplePoint2D(p1x,p1y));
-		float dist2 = seg.dist2ToPtAsLine(SimplePoint2D(pt->x,pt->y));
-		if (dist2 > maxDist2)
+		float px = pt->x - p0x, py = pt->y - p0y;
+		float cross0 = fabsf(d0x * py - d0y * px);
+		float cross1 = fabsf(d1x * py - d1y * px);
+		if (cross0 > max0)
 		{
-			maxDist2 = dist2;
-			far.x = pt->x;
-			far.y = pt->y;
+			max0 = cross0;
+			far0 = *pt;
+		}
+		if (cross1 > max1)
+		{
+			max1 = cross1;
+			far1 = *pt;
 		}
 	}
 
-	farDist2 = maxDist2;
-	return maxDist2 > 0.0;
+	farDist0 = max0 * max0 / len0;
+	farDist1 = max1 * max1 / len1;
+	return farDist0 > 0.0 && farDist1 > 0.0;
 }
 
 /* Pick up the longest two edges near the corner.
@@ -279,7 +335,8 @@ void Feature::refineCornerAndFindAngles(int searchDist2)
 			e0.x = edge0.ex;  e0.y = edge0.ey;
 			e1.x = edge1.ex;  e1.y = edge1.ey;
 
-			logVerbose("Angles found: ang0 = " + std::to_string(ang0) + ", ang1 = " + std::to_string(ang1) + ", difference = " + std::to_string(angDiff));
+			if (verbose)
+				logVerbose("Angles found: ang0 = " + std::to_string(ang0) + ", ang1 = " + std::to_string(ang1) + ", difference = " + std::to_string(angDiff));
 
 			// And calculate a shiny new corner point
 			// Note: Reassigning variable names because I'm lazy
@@ -291,7 +348,8 @@ void Feature::refineCornerAndFindAngles(int searchDist2)
 			cornX = ((x1*y2 - y1*x2)*(x3-x4) - (x1-x2)*(x3*y4 - y3*x4))/denom;
 			cornY = ((x1*y2 - y1*x2)*(y3-y4) - (y1-y2)*(x3*y4 - y3*x4))/denom;
 
-			logVerbose("New corner position: (" + std::to_string(cornX) + ", " + std::to_string(cornY) + ")");
+			if (verbose)
+				logVerbose("New corner position: (" + std::to_string(cornX) + ", " + std::to_string(cornY) + ")");
 
 			// Calculate the Z portion of a cross product and switch the edges
 			//  if it's not pointing up
@@ -318,8 +376,7 @@ void Feature::refineCornerAndFindAngles(int searchDist2)
 				sheer *= -1;
 
 			// Now look for the outer extents of shape
-			if (findFarPoint(cornX,cornY,e0.x,e0.y,far0,dist0) &&
-				findFarPoint(cornX,cornY,e1.x,e1.y,far1,dist1))
+			if (findFarPoints(cornX,cornY,e0.x,e0.y,e1.x,e1.y,far0,dist0,far1,dist1))
 				farEdgesValid = true;
 
 			// Build up a matrix if we found everything we want
@@ -327,24 +384,9 @@ void Feature::refineCornerAndFindAngles(int searchDist2)
 			{
 				float scaleX = sqrtf(dist1), scaleY = sqrtf(dist0);
 
-				QyooMatrix sheerMat(1.0, sheer, 0.0,
-						    0.0, 1.0, 0.0,
-						    0.0, 0.0, 1.0);
-				QyooMatrix transMat(1.0, 0.0, cornX,
-						    0.0, 1.0, cornY,
-						    0.0, 0.0, 1.0);
 				double angle = ang0 * M_PI / 180.0;
-				QyooMatrix rotMat(cos(angle), -sin(angle), 0.0,
-						  sin(angle), cos(angle), 0.0,
-						  0.0, 0.0, 1.0);
-				QyooMatrix scaleMat(scaleX, 0.0, 0.0,
-						    0.0, scaleY, 0.0,
-						    0.0, 0.0, 1.0);
-
-				mat = transMat;
-				mat = mat * rotMat;
-				mat = mat * scaleMat;
-                mat = mat * sheerMat;
+				mat = Affine2D::translate(cornX,cornY) * Affine2D::rotate(angle) *
+					Affine2D::scale(scaleX,scaleY) * Affine2D::sheerX(sheer);
 
 			}
 		}
@@ -358,10 +400,10 @@ void Feature::refineCornerAndFindAngles(int searchDist2)
 }
 
 // Check a single point against the ideal model
-bool Feature::pointModelCheck(QyooMatrix *invTrans,float imgX,float imgY,float nearDist2)
+bool Feature::pointModelCheck(const Affine2D &invTrans,float imgX,float imgY,float nearDist2)
 {
-        cml::vector3d pt = (*invTrans) * cml::vector3d(imgX,imgY,1.0);
-  	SimplePoint2D pt2d(pt[0],pt[1]);
+	SimplePoint2D pt2d;
+	invTrans.transform(imgX,imgY,pt2d.x,pt2d.y);
 
 	// Is it close to the bottom line
 	SimpleLineSegment bline(SimplePoint2D(0.0,0.0),SimplePoint2D(0.5,0.0));
@@ -394,29 +436,112 @@ bool Feature::pointModelCheck(QyooMatrix *invTrans,float imgX,float imgY,float n
     There's a distance each point should be within and a fraction we expect
      to be within that distance.
  */
-bool Feature::modelCheck(float nearDist2,float nearFrac)
+bool Feature::modelCheck(float nearDist2,float nearFrac,bool needRatio)
 {
 	if (!valid)
 		return false;
 
-	QyooMatrix invMat = mat;
-	invMat.inverse();
+	Affine2D invMat;
+	if (!mat.inverse(invMat))
+	{
+		valid = false;
+		modelChecked = false;
+		return false;
+	}
+
+	QyooModel *model = QyooModel::getQyooModel();
+	float nearDist = sqrtf(nearDist2);
 
 	// Work through the original points
 	int numClose = 0;
-	int total = 0;
+	int total = origPoints.size();
+	int numChecked = 0;
+	bool stoppedEarly = false;
 	for (std::list<Point>::iterator pt = origPoints.begin();pt != origPoints.end();++pt)
 	{
-		if (pointModelCheck(&invMat,pt->x,pt->y,nearDist2))
+		float mx,my;
+		invMat.transform((float)pt->x,(float)pt->y,mx,my);
+		int near = model->outlineNear(mx,my,nearDist);
+		if (near < 0)
+			near = pointModelCheck(invMat,pt->x,pt->y,nearDist2);
+		numChecked++;
+
+		if (near)
+		{
 			numClose++;
-		total++;
+			// Can't fail from here on.  Only stop if nobody wants the ratio.
+			if (!needRatio && (float)numClose / (float) total > nearFrac)
+			{
+				stoppedEarly = true;
+				break;
+			}
+		} else {
+			// Even if the rest are close, it's not enough
+			if (!((float)(numClose + total - numChecked) / (float) total > nearFrac))
+			{
+				stoppedEarly = true;
+				break;
+			}
+		}
 	}
 
-	modelChecked = ((float)numClose/ (float) total > nearFrac);
+	// If we stopped early, the ratio is only an upper bound
+	modelRatio = (float)(numClose + total - numChecked) / (float) total;
+	modelChecked = ((float)numClose / (float) total > nearFrac);
 
-	logVerbose("Model check: " + std::to_string(numClose) + " out of " + std::to_string(total) + " points close enough.");
+	// Don't bother building the strings unless they're going somewhere
+	if (verbose)
+	{
+		if (stoppedEarly)
+			logVerbose("Model check: stopped after " + std::to_string(numChecked) + " of " + std::to_string(total) + " points, " + std::to_string(numClose) + " close enough.");
+		else
+			logVerbose("Model check: " + std::to_string(numClose) + " out of " + std::to_string(total) + " points close enough.");
+	}
 
 	if (!modelChecked)
 		valid = false;
 	return modelChecked;
 }
+
+// The matrix is translate * rotate * scale * sheer, so the first column
+//  has the rotation and X scale and the last has the corner
+void Feature::getPlacement(float &px,float &py,float &scale,float &rot) const
+{
+	px = mat.m02;
+	py = mat.m12;
+	scale = sqrtf(mat.m00*mat.m00 + mat.m10*mat.m10);
+	rot = atan2f(mat.m10,mat.m00);
+}
+
+// Vectors of features (and the pool's reset) rely on this being cheap
+static_assert(std::is_nothrow_move_constructible<Feature>::value, "Feature should be cheap to move");
+
+FeaturePool::~FeaturePool()
+{
+	release();
+}
+
+Feature &FeaturePool::add()
+{
+	unsigned int chunk = numFeats / FeaturePoolChunkSize;
+	if (chunk >= chunks.size())
+		chunks.push_back(new Feature[FeaturePoolChunkSize]);
+
+	return chunks[chunk][numFeats++ % FeaturePoolChunkSize];
+}
+
+// Blank out the ones we used so their points go away
+void FeaturePool::reset()
+{
+	for (unsigned int ii = 0; ii < numFeats; ii++)
+		(*this)[ii] = Feature();
+	numFeats = 0;
+}
+
+void FeaturePool::release()
+{
+	for (unsigned int ii = 0; ii < chunks.size(); ii++)
+		delete [] chunks[ii];
+	chunks.clear();
+	numFeats = 0;
+}
@@ -10,6 +10,7 @@
 #import <vector>
 #import <list>
 #import <string>
+#import <algorithm>
 #import "Geometry.h"
 #import "RawImage.h"
 
@@ -20,9 +21,19 @@
 class Feature
 {
 public:
-	Feature() { valid = true; cornerValid = false;  edgesValid = false;  farEdgesValid = false; closed = false;};
-	Feature(const Feature &that) { *this = that; }
-	~Feature() { };
+	Feature()
+	{
+		valid = true;  imgSizeX = 0;  imgSizeY = 0;  closed = false;
+		cornerValid = false;  cornX = 0.0;  cornY = 0.0;
+		edgesValid = false;  e0 = e1 = Point(0,0);  ang0 = 0.0;  ang1 = 0.0;
+		farEdgesValid = false;  far0 = far1 = Point(0,0);  dist0 = 0.0;  dist1 = 0.0;  sheer = 0.0;
+		modelChecked = false;  modelRatio = 0.0;
+	};
+	// Copies are deep, moves just take over the point lists
+	Feature(const Feature &that) = default;
+	Feature(Feature &&that) = default;
+	Feature &operator = (const Feature &that) = default;
+	Feature &operator = (Feature &&that) = default;
     
 	// Tack a point on the end
 	void addPointEnd(int cx,int cy);
@@ -39,6 +50,11 @@ public:
 	// Reject this feature if it's too small
 	void checkSizeAndPosition(int imgSizeX,int imgSizeY);
 	
+	// Cheap guess at how likely this is to be a qyoo, before any of the real checks.
+	// Features that would pass the size check come first, then closed ones,
+	//  then the longer ones.  Higher is better.
+	float candidateScore(int imgSizeX,int imgSizeY,int closedDist2) const;
+
 	// Try to find the corner
 	void findCorner();
 	
@@ -49,7 +65,12 @@ public:
 	void refineCornerAndFindAngles(int searchDist2);
 	
 	// Check the actual points against where we think they ought to be
-	bool modelCheck(float nearDist2,float nearFrac);
+	// This stops as soon as the feature can't pass.  If needRatio is false,
+	//  it also stops as soon as it's sure to pass and modelRatio is left rough.
+	bool modelCheck(float nearDist2,float nearFrac,bool needRatio=true);
+
+	// Corner, scale and rotation out of the model matrix
+	void getPlacement(float &px,float &py,float &scale,float &rot) const;
 				
 	// Single point structure.  Yeah, should be elsewhere.
 	class Point
@@ -78,9 +99,10 @@ public:
 	float sheer;            // A shear value to move the model to e1
 	
 	bool modelChecked;      // Passed model check
+	float modelRatio;       // Fraction of the points that were close to the model
 
 	// Transformation from Qyoo model space to image space
-	QyooMatrix mat;
+	Affine2D mat;
 	
 	// The raw bits for the dots, if they've been read
 	std::vector<unsigned char> dotBits;
@@ -93,11 +115,71 @@ public:
 	std::list<Point> points;
 	
 protected:
-	// Internal utility routine for finding the farthest point from a line
-	bool findFarPoint(float p0x,float p0y,float p1x,float p1y,Point &far,float &retDist);
+	// Internal utility routine for finding the farthest points from two lines through p0.
+	// Does both in one pass over origPoints.
+	bool findFarPoints(float p0x,float p0y,float e0x,float e0y,float e1x,float e1y,
+					   Point &far0,float &retDist0,Point &far1,float &retDist1);
 	
 	// See if just this point is close to the model version
-	bool pointModelCheck(QyooMatrix *invTrans,float x,float y,float nearDist2);
+	bool pointModelCheck(const Affine2D &invTrans,float x,float y,float nearDist2);
     
 };
 
+// Features per chunk in a FeaturePool
+#define FeaturePoolChunkSize 256
+
+/* Feature Pool
+	Where the tracer puts its features.  They're allocated in chunks,
+	 so adding one never moves the others and anything pointing at a
+	 feature (like the dot processors) stays good until reset().
+	reset() keeps the chunks around for the next pass.
+	Indexing and iteration work like they would on a vector.
+ */
+class FeaturePool
+{
+public:
+	FeaturePool() { numFeats = 0; }
+	~FeaturePool();
+
+	// Not copyable, the whole point is the features stay put
+	FeaturePool(const FeaturePool &) = delete;
+	FeaturePool &operator = (const FeaturePool &) = delete;
+
+	// A new, blank feature at the end
+	Feature &add();
+
+	// Forget all the features, but keep the memory
+	void reset();
+
+	// Forget the features and give back the memory
+	void release();
+
+	// Trade contents with another pool
+	void swap(FeaturePool &that) { chunks.swap(that.chunks);  std::swap(numFeats,that.numFeats); }
+
+	inline unsigned int size() const { return numFeats; }
+	inline bool empty() const { return numFeats == 0; }
+	inline Feature &operator [] (unsigned int which) { return chunks[which / FeaturePoolChunkSize][which % FeaturePoolChunkSize]; }
+	inline const Feature &operator [] (unsigned int which) const { return chunks[which / FeaturePoolChunkSize][which % FeaturePoolChunkSize]; }
+
+	class iterator
+	{
+	public:
+		iterator(FeaturePool *inPool,unsigned int inWhich) { pool = inPool;  which = inWhich; }
+		Feature &operator * () const { return (*pool)[which]; }
+		Feature *operator -> () const { return &(*pool)[which]; }
+		iterator &operator ++ () { which++;  return *this; }
+		bool operator == (const iterator &that) const { return which == that.which; }
+		bool operator != (const iterator &that) const { return which != that.which; }
+	protected:
+		FeaturePool *pool;
+		unsigned int which;
+	};
+	iterator begin() { return iterator(this,0); }
+	iterator end() { return iterator(this,numFeats); }
+
+protected:
+	std::vector<Feature *> chunks;
+	unsigned int numFeats;
+};
+
@@ -12,27 +12,65 @@
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <cmath>
 
 #import "FeatureDetector.h"
 #import "QyooModel.h"
+#import "ParallelTrace.h"
 #include "Logger.h"
 
 // Pixels per dot for detection
 const int PixelsPerDot = 11;
 
-// Define constants for closing distance and decimation tolerance
-const float ClosedDist = 2.0f;  // Threshold distance to consider a feature closed
-const float DecimateDist = 0.85f;  // Tolerance for decimating points in a feature
+// Default detection parameters
+DetectionParams::DetectionParams()
+{
+    gradThresh = 60;
+    minThresh = 10;
+    maxThresh = 60;
+    closedDist = 2.0f;     // Threshold distance to consider a feature closed
+    decimateDist = 0.85f;  // Tolerance for decimating points in a feature
+    modelNearDist = 0.04;
+    modelNearFrac = 0.8;
+    adaptive = false;
+    adaptivePercentile = 0.5f;
+    adaptiveScale = 3.5f;
+    maxTracePixels = 0;
+    maxFeatures = 0;
+    maxValidateMs = 0.0;
+    deadlineMs = 0.0;
+    traceThreads = 1;
+}
 
 // FeatureDotsProcessor constructor
 // Initializes the dot processor with an image, a feature processor, and a feature.
 FeatureDotsProcessor::FeatureDotsProcessor(gdImagePtr inImage, FeatureProcessor *inFeatProc, Feature *inFeat)
 {
-    init(inImage, inFeatProc, inFeat);
+    Affine2D mat;
+    if (!init(gdImageSX(inImage), gdImageSY(inImage), inFeatProc, inFeat, mat))
+        return;
+
+    // Convert the image to grayscale and apply contrast
+    grayImg->copyFromGDImage(inImage, mat);
+    grayImg->runContrast();
+}
+
+// FeatureDotsProcessor constructor, working from an 8 bit source image
+FeatureDotsProcessor::FeatureDotsProcessor(RawImageGray8 *inImage, FeatureProcessor *inFeatProc, Feature *inFeat)
+{
+    Affine2D mat;
+    if (!init(inImage->getSizeX(), inImage->getSizeY(), inFeatProc, inFeat, mat))
+        return;
+
+    grayImg->copyFromImage(inImage, mat);
+    grayImg->runContrast();
 }
 
 // Initialize the dot processor
-void FeatureDotsProcessor::init(gdImagePtr inImage, FeatureProcessor *inFeatProc, Feature *inFeat)
+bool FeatureDotsProcessor::init(int srcSizeX, int srcSizeY, FeatureProcessor *inFeatProc, Feature *inFeat, Affine2D &mat)
 {
     grayImg = nullptr;
     gaussImg = nullptr;
@@ -41,8 +79,8 @@ void FeatureDotsProcessor::init(gdImagePtr inImage, FeatureProcessor *inFeatProc
     feat = inFeat;
 
     QyooModel *qyooModel = QyooModel::getQyooModel();
-    float imgWidth = gdImageSX(inImage);
-    float imgHeight = gdImageSY(inImage);
+    float imgWidth = srcSizeX;
+    float imgHeight = srcSizeY;
 
     // Determine the size of the image to render to
     int sizeX = PixelsPerDot * (qyooModel->numRows() + 2);
@@ -51,24 +89,24 @@ void FeatureDotsProcessor::init(gdImagePtr inImage, FeatureProcessor *inFeatProc
     // Apply transformations to convert the image to Qyoo space
     float scaleX = imgWidth / feat->imgSizeX;
     float scaleY = imgHeight / feat->imgSizeY;
-    QyooMatrix scaleMat(scaleX, 0.0, 0.0, 0.0, scaleY, 0.0, 0.0, 0.0, 1.0);
-    QyooMatrix forMat = scaleMat * feat->mat;
+    Affine2D forMat = Affine2D::scale(scaleX, scaleY) * feat->mat;
 
     // Add a margin of space around the dots
     SimplePoint2D ll, ur;
     qyooModel->dotBounds(ll, ur, true);
-    QyooMatrix transMat(1.0, 0.0, ll.x, 0.0, 1.0, ll.y, 0.0, 0.0, 1.0);
-    QyooMatrix scaleMat2(ur.x - ll.x, 0.0, 0.0, 0.0, ur.y - ll.y, 0.0, 0.0, 0.0, 1.0);
-    forMat = forMat * transMat * scaleMat2;
+    forMat = forMat * Affine2D::translate(ll.x, ll.y) * Affine2D::scale(ur.x - ll.x, ur.y - ll.y);
+
+    grayImg = new RawImageGray8(sizeX, sizeY);
 
     // Inverse the transformation matrix to map back to Qyoo space
-    QyooMatrix mat = forMat;
-    mat.inverse();
+    // A singular one leaves the dot image blank, so no dots get read
+    if (!forMat.inverse(mat))
+    {
+        std::cerr << "Error: Feature transform is singular, can't map it to dot space." << std::endl;
+        return false;
+    }
 
-    // Convert the image to grayscale and apply contrast
-    grayImg = new RawImageGray8(sizeX, sizeY);
-    grayImg->copyFromGDImage(inImage, mat);
-    grayImg->runContrast();
+    return true;
 }
 
 // Destructor for the dot processor
@@ -80,54 +118,6 @@ FeatureDotsProcessor::~FeatureDotsProcessor()
     feat = nullptr;
 }
 
-// Calculate the average pixel value in a region
-static int calcAvgPixel(RawImageGray8 *img, int px, int py, ConvolutionFilterInt *radFilter)
-{
-    std::vector<int> results(radFilter->getSize() * radFilter->getSize());
-    radFilter->processPixel(img, px, py, &results[0]);
-
-    float val = 0.0;
-    for (int result : results)
-        val += result;
-
-    return val / radFilter->getFact();
-}
-
-// Constants used for dot detection
-const int RadianceDistMatch = 60;
-const float PassRatio = .40;  // 40% coverage
-
-// Check if an area contains a dot by comparing the radiance of pixels
-static bool isAdot(RawImageGray8 *img,int px,int py,int pixelsInDot,ConvolutionFilterInt *radFilter,int backColor)
-{
-	std::vector<int> results(radFilter->getSize()*radFilter->getSize());
-	radFilter->processPixel(img,px,py,&results[0]);
-
-	// Decide if the background color is "blackish" or "whiteish"
-	bool isWhite = (backColor >= 128);
-
-	// Run through and look for matching pixels
-	int numMatch = 0;
-	for (unsigned int ii=0;ii<radFilter->getSize()*radFilter->getSize();ii++)
-	{
-		int thisColor = results[ii];
-		if (thisColor >= 0)
-		{
-			// Distance from this pixel to the grey value we're after
-			int dist = backColor - thisColor;  if (dist < 0) dist *= -1;
-
-			// The radiance needs to be far enough away and it needs to be
-			//  on the opposite side of 128
-			if (dist > RadianceDistMatch && ((isWhite && thisColor < 128+32) ||(!isWhite && thisColor > 128-32)))
-				numMatch++;
-		}
-	}
-
-	float ratio = (float)numMatch / (float)radFilter->getFact();
-
-	return (ratio >= PassRatio);
-}
-
 // Convert decimal to binary string representation
 static std::string dec2bin(int intDec)
 {
@@ -147,54 +137,35 @@ static std::string dec2bin(int intDec)
     return strBin;
 }
 
-// Detect dots in a grayscale image and mark their locations
+// Detect dots in a grayscale image and read them into the feature
 void FeatureDotsProcessor::findDotsGray() {
     QyooModel *qyooModel = QyooModel::getQyooModel();
-    ConvolutionFilterInt *radFilter = MakeRadiusFilter(PixelsPerDot, PixelsPerDot / 2);
+    DotClassifier *classifier = featProc->getDotClassifier();
+    classifier->setImage(grayImg);
 
-    int avgPixel = calcAvgPixel(grayImg, PixelsPerDot / 2, PixelsPerDot / 2, radFilter);
+    int avgPixel = classifier->avgPixel(PixelsPerDot / 2, PixelsPerDot / 2);
 
     int numRow = qyooModel->numRows();
     int numPos = qyooModel->numPos();
+    if (numRow > QYOOSIZE || numPos > QYOOSIZE) {
+        std::cerr << "Error: Qyoo model is larger than " << QYOOSIZE << "x" << QYOOSIZE << std::endl;
+        return;
+    }
+
+    // Decide on all the dots at once
+    unsigned char isDot[QYOOSIZE * QYOOSIZE];
+    classifier->classifyGrid(avgPixel, numRow, numPos, isDot);
     feat->dotBinStr.clear();
     feat->dotDecStr.clear();
+    feat->dotBits.clear();
     qyooBits = "";  // Start fresh with qyooBits
 
-    // Create an RGB image to draw on
-    gdImagePtr outImg = gdImageCreateTrueColor(grayImg->getSizeX(), grayImg->getSizeY());
-
-    // Copy the grayscale data into the RGB image (mapping grayscale values to RGB)
-    for (int x = 0; x < grayImg->getSizeX(); x++) {
-        for (int y = 0; y < grayImg->getSizeY(); y++) {
-            int grayValue = gdImageGetPixel(grayImg->makeGDImage(), x, y);
-            int rgbColor = gdImageColorAllocate(outImg, grayValue, grayValue, grayValue);
-            gdImageSetPixel(outImg, x, y, rgbColor);
-        }
-    }
-
-    // Allocate colors for drawing
-    int colorRed = gdImageColorAllocate(outImg, 255, 0, 0);
-    int colorGreen = gdImageColorAllocate(outImg, 0, 255, 0);
-
     for (int row = 0; row < numRow; row++) {  // We process from row 0 to numRow
         int resChar = 0;
-        int rowPix = PixelsPerDot * (row + 1) + PixelsPerDot / 2;
-
-        for (unsigned int pos = 0; pos < numPos; pos++) {
-            int posPix = PixelsPerDot * (pos + 1) + PixelsPerDot / 2;
-
-            if (isAdot(grayImg, posPix, rowPix, PixelsPerDot, radFilter, avgPixel)) {
+        for (unsigned int pos = 0; pos < numPos; pos++)
+            if (isDot[row * numPos + pos])
                 resChar |= 1 << pos;
 
-                // Draw a green circle around the detected dot
-                gdImageArc(outImg, posPix, rowPix, PixelsPerDot, PixelsPerDot, 0, 360, colorGreen);
-            } else {
-                // If the dot represents a 0, draw a red X
-                gdImageLine(outImg, posPix - 5, rowPix - 5, posPix + 5, rowPix + 5, colorRed);    // Draw slash left
-                gdImageLine(outImg, posPix - 5, rowPix + 5, posPix + 5, rowPix - 5, colorRed);    // Draw slash right
-            }
-        }
-
         // rows are read in reverse, and need to be reversed again
         unsigned char theChar;
         std::string currentRowBits = dec2bin(resChar);  // Get binary string representation of resChar
@@ -220,109 +191,653 @@ void FeatureDotsProcessor::findDotsGray() {
     if (qyooBits.size() > 64) {
         std::cerr << "Error: qyooBits exceeds 64 bits, cannot convert to unsigned long long." << std::endl;
     } else {
-        std::cout << "Binary = " << qyooBits << std::endl;
-
         feat->dotDecStr = std::to_string(std::stoull(qyooBits, nullptr, 2));  // Convert binary string to decimal
-        std::cout << "Qyoo value = " << feat->dotDecStr << std::endl;
+        if (featProc->writeAnnotations) {
+            std::cout << "Binary = " << qyooBits << std::endl;
+            std::cout << "Qyoo value = " << feat->dotDecStr << std::endl;
+        }
     }
 
     // Save the image with the dots circled and x notated to see where pattern is detected
-    std::string outputFileName = "output/" + feat->dotDecStr + ".png";
-    FILE *outputFile = fopen(outputFileName.c_str(), "wb");
+    if (featProc->writeAnnotations)
+        saveDots(grayImg, feat->dotBits, "output/" + feat->dotDecStr + ".png");
+}
+
+// Mark up a copy of the dot image
+gdImagePtr FeatureDotsProcessor::drawDots(RawImageGray8 *dotImg, const std::vector<unsigned char> &dotBits) {
+    int numPos = QyooModel::getQyooModel()->numPos();
+
+    // Create an RGB image to draw on
+    gdImagePtr outImg = gdImageCreateTrueColor(dotImg->getSizeX(), dotImg->getSizeY());
+    if (!outImg)
+        return NULL;
+
+    // Copy the grayscale data into the RGB image (mapping grayscale values to RGB)
+    for (int x = 0; x < dotImg->getSizeX(); x++) {
+        for (int y = 0; y < dotImg->getSizeY(); y++) {
+            int grayValue = dotImg->getPixel(x, y);
+            int rgbColor = gdImageColorAllocate(outImg, grayValue, grayValue, grayValue);
+            gdImageSetPixel(outImg, x, y, rgbColor);
+        }
+    }
+
+    // Allocate colors for drawing
+    int colorRed = gdImageColorAllocate(outImg, 255, 0, 0);
+    int colorGreen = gdImageColorAllocate(outImg, 0, 255, 0);
+
+    for (unsigned int row = 0; row < dotBits.size(); row++) {
+        int rowPix = PixelsPerDot * (row + 1) + PixelsPerDot / 2;
+
+        for (int pos = 0; pos < numPos; pos++) {
+            int posPix = PixelsPerDot * (pos + 1) + PixelsPerDot / 2;
+
+            if (dotBits[row] & (1 << pos)) {
+                // Draw a green circle around the detected dot
+                gdImageArc(outImg, posPix, rowPix, PixelsPerDot, PixelsPerDot, 0, 360, colorGreen);
+            } else {
+                // If the dot represents a 0, draw a red X
+                gdImageLine(outImg, posPix - 5, rowPix - 5, posPix + 5, rowPix + 5, colorRed);    // Draw slash left
+                gdImageLine(outImg, posPix - 5, rowPix + 5, posPix + 5, rowPix - 5, colorRed);    // Draw slash right
+            }
+        }
+    }
+
+    return outImg;
+}
+
+bool FeatureDotsProcessor::saveDots(RawImageGray8 *dotImg, const std::vector<unsigned char> &dotBits, const std::string &fileName) {
+    gdImagePtr outImg = drawDots(dotImg, dotBits);
+    if (!outImg)
+        return false;
+
+    bool ok = false;
+    FILE *outputFile = fopen(fileName.c_str(), "wb");
     if (outputFile) {
         gdImagePng(outImg, outputFile); // Save PNG image using gdImagePng
-        fclose(outputFile);
+        ok = fclose(outputFile) == 0;
     } else {
-        std::cerr << "Error: Unable to open file for writing PNG image: " << outputFileName << std::endl;
+        std::cerr << "Error: Unable to open file for writing PNG image: " << fileName << std::endl;
     }
 
     gdImageDestroy(outImg);
+    return ok;
+}
 
-    delete radFilter;
 
+// FeatureProcessor constructor: initialize with an image
+FeatureProcessor::FeatureProcessor(gdImagePtr inImage, int sizeX, int sizeY, bool keepGray)
+{
+    init(sizeX, sizeY);
+    ingestImage(inImage, keepGray);
 }
 
+// Same as the constructor, but hang on to the buffers if we can
+void FeatureProcessor::loadImage(gdImagePtr inImage, int inSizeX, int inSizeY, bool keepGray)
+{
+    startImage(inSizeX, inSizeY);
+    ingestImage(inImage, keepGray);
+}
 
-// FeatureProcessor constructor: initialize with an image
-FeatureProcessor::FeatureProcessor(gdImagePtr inImage, int sizeX, int sizeY)
+void FeatureProcessor::loadImage(RawImageGray8 *inImage, bool keepGray)
 {
-    grayImg = new RawImageGray8(sizeX, sizeY);
-    grayImg->copyFromGDImage(inImage);
-    grayImg->runContrast();
+    loadImage(inImage, 0, 0, inImage->getSizeX(), inImage->getSizeY(), keepGray);
+}
+
+void FeatureProcessor::loadImage(RawImageGray8 *inImage, int x0, int y0, int windowSizeX, int windowSizeY, bool keepGray)
+{
+    startImage(windowSizeX, windowSizeY);
+    ingestImage(inImage, x0, y0, keepGray);
+}
+
+void FeatureProcessor::startImage(int inSizeX, int inSizeY)
+{
+    clearFeatures();
+    if (inSizeX != sizeX || inSizeY != sizeY)
+    {
+        freeImages();
+        sizeX = inSizeX;
+        sizeY = inSizeY;
+    }
+    numValidated = 0;
+    numTracedPixels = 0;
+    status = DetectComplete;
+    validateTimeLimit = false;
+}
+
+// FeatureProcessor constructor: no image, the caller fills in the planes
+FeatureProcessor::FeatureProcessor(int sizeX, int sizeY)
+{
+    init(sizeX, sizeY);
+}
+
+// Start out with nothing allocated
+void FeatureProcessor::init(int inSizeX, int inSizeY)
+{
+    sizeX = inSizeX;
+    sizeY = inSizeY;
+    gaussFilter = NULL;
+    grayImg = NULL;
+    gaussImg = NULL;
+    gradImg = NULL;
+    thetaImg = NULL;
+    rawThetaImg = NULL;
+    featImg = NULL;
+    gradHist = NULL;
+    thinSeeds = NULL;
+    numFound = 0;
+    numValidated = 0;
+    numTracedPixels = 0;
+    status = DetectComplete;
+    validateTimeLimit = false;
+    writeAnnotations = true;
+    dotClassifier = NULL;
+}
+
+// Gray conversion, contrast and blur, a row at a time.
+// This comes out exactly the same as copyFromGDImage(), runContrast() and the Gaussian filter.
+void FeatureProcessor::ingestImage(gdImagePtr inImage, bool keepGray)
+{
+    // gd does the resampling, so we still need its palette image
+    unsigned char grayLUT[256];
+    gdImagePtr tmpImg = RawImageGray8::makeGrayPalette(inImage, sizeX, sizeY, grayLUT);
+
+    // Histogram of the palette indices, then of the gray values they stand for
+    int indexHist[256] = {0}, hist[256] = {0};
+    for (int iy = 0; iy < sizeY; iy++)
+    {
+        unsigned char *srcRow = tmpImg->pixels[iy];
+        for (int ix = 0; ix < sizeX; ix++)
+            indexHist[srcRow[ix]]++;
+    }
+    for (int ii = 0; ii < 256; ii++)
+        hist[grayLUT[ii]] += indexHist[ii];
+
+    // Straight from palette index to stretched gray
+    unsigned char contrastLUT[256], lut[256];
+    RawImageGray8::makeContrastLUT(hist, contrastLUT);
+    for (int ii = 0; ii < 256; ii++)
+        lut[ii] = contrastLUT[grayLUT[ii]];
+
+    ingestRows(tmpImg->pixels, lut, keepGray);
+
+    gdImageDestroy(tmpImg);
+}
+
+// Already gray and already the right size, so it's just the contrast and the blur.
+// We're processing the sizeX by sizeY window at (x0,y0).
+void FeatureProcessor::ingestImage(RawImageGray8 *inImage, int x0, int y0, bool keepGray)
+{
+    std::vector<unsigned char *> srcRows(sizeY);
+    for (int iy = 0; iy < sizeY; iy++)
+        srcRows[iy] = inImage->getImgData() + (y0 + iy) * inImage->getSizeX() + x0;
+
+    int hist[256] = {0};
+    for (int iy = 0; iy < sizeY; iy++)
+        for (int ix = 0; ix < sizeX; ix++)
+            hist[srcRows[iy][ix]]++;
+
+    unsigned char lut[256];
+    RawImageGray8::makeContrastLUT(hist, lut);
+
+    ingestRows(&srcRows[0], lut, keepGray);
+}
+
+void FeatureProcessor::ingestRows(unsigned char *const *srcRows, const unsigned char *lut, bool keepGray)
+{
+    if (keepGray && !grayImg)
+        grayImg = new RawImageGray8(sizeX, sizeY);
+    if (!gaussFilter)
+        gaussFilter = MakeGaussianFilter_1_4();
+    if (!gaussImg)
+        gaussImg = new RawImageGray8(sizeX, sizeY);
+
+    // Stretched rows go into a ring buffer.  Once the filter's worth of rows
+    //  below the middle one are in, the middle one gets blurred.
+    int filterSize = gaussFilter->getSize(), halfSize = filterSize / 2;
+    std::vector<unsigned char> ring(filterSize * sizeX);
+    std::vector<unsigned char *> rows(filterSize);
+    for (int iy = 0; iy < sizeY; iy++)
+    {
+        const unsigned char *srcRow = srcRows[iy];
+        unsigned char *row = &ring[(iy % filterSize) * sizeX];
+        for (int ix = 0; ix < sizeX; ix++)
+            row[ix] = lut[srcRow[ix]];
+        if (grayImg)
+            memcpy(grayImg->getImgData() + iy * sizeX, row, sizeX);
+
+        int outY = iy - halfSize;
+        if (outY < halfSize)
+            continue;
+        for (int ir = 0; ir < filterSize; ir++)
+            rows[ir] = &ring[((outY - halfSize + ir) % filterSize) * sizeX];
+        gaussFilter->processRow(&rows[0], sizeX, gaussImg->getImgData() + outY * sizeX);
+    }
 }
 
 // Destructor for FeatureProcessor
 FeatureProcessor::~FeatureProcessor()
 {
+    freeImages();
     delete gaussFilter;
+    delete dotClassifier;
+    clearFeatures();
+}
+
+// Everything that depends on the image size
+void FeatureProcessor::freeImages()
+{
     delete grayImg;
     delete gaussImg;
     delete gradImg;
     delete thetaImg;
+    delete rawThetaImg;
     delete featImg;
-    for (auto *dot : featureDots)
-        delete dot;
+    delete [] gradHist;
+    delete thinSeeds;
+    grayImg = NULL;
+    gaussImg = NULL;
+    gradImg = NULL;
+    thetaImg = NULL;
+    rawThetaImg = NULL;
+    featImg = NULL;
+    gradHist = NULL;
+    thinSeeds = NULL;
+}
+
+// The dot classifier is shared by all the features we decode
+DotClassifier *FeatureProcessor::getDotClassifier()
+{
+    if (!dotClassifier)
+        dotClassifier = new DotClassifier(PixelsPerDot, PixelsPerDot / 2);
+
+    return dotClassifier;
 }
 
 // Process the image to detect edges and gradients
 void FeatureProcessor::processImage()
 {
-    gaussFilter = MakeGaussianFilter_1_4();
-    gaussImg = new RawImageGray8(grayImg->getSizeX(), grayImg->getSizeY());
+    // Apply Gaussian filter to reduce noise.
+    // Usually ingestImage() already did this on the way in.
+    if (!gaussImg)
+    {
+        if (!gaussFilter)
+            gaussFilter = MakeGaussianFilter_1_4();
+        gaussImg = new RawImageGray8(sizeX, sizeY);
+        gaussFilter->processImage(grayImg, gaussImg);
+    }
+
+    // Compute gradient and edge angle.
+    // These are still around if we were handed a new image with loadImage().
+    if (!gradImg)
+        gradImg = new RawImageGray32(sizeX, sizeY);
+    if (!thetaImg)
+        thetaImg = new RawImageGray8(sizeX, sizeY);
+    if (!gradHist)
+        gradHist = new int[CannyGradHistBins];
+    CannyGradientAndTheta(gaussImg, gradImg, thetaImg, gradHist);
+
+    // Non-max suppression works in place, so keep the angles around for a redo
+    if (!rawThetaImg)
+        rawThetaImg = new RawImageGray8(sizeX, sizeY);
+    memcpy(rawThetaImg->getImgData(), thetaImg->getImgData(), thetaImg->totalSize());
+
+    if (params.adaptive)
+        pickAdaptiveThresholds();
+
+    // Suppress non-maximum values to highlight edges.
+    // The thin pixels it finds are where tracing starts.
+    if (!thinSeeds)
+        thinSeeds = new std::vector<int>();
+    CannyNonMaxSupress(gradImg, thetaImg, params.gradThresh, thinSeeds);
+}
 
-    // Apply Gaussian filter to reduce noise
-    gaussFilter->processImage(grayImg, gaussImg);
+// Keep the high threshold in this range.  Clean images don't have a
+//  noise floor, so the estimate is really the edges themselves.
+const int AdaptiveMinThresh = 30;
+const int AdaptiveMaxThresh = 200;
 
-    // Compute gradient and edge angle
-    gradImg = new RawImageGray32(grayImg->getSizeX(), grayImg->getSizeY());
-    thetaImg = new RawImageGray8(grayImg->getSizeX(), grayImg->getSizeY());
-    CannyGradientAndTheta(gaussImg, gradImg, thetaImg);
+// Scale the thresholds to the noise level
+void FeatureProcessor::pickAdaptiveThresholds()
+{
+    if (!gradHist)
+        return;
+
+    int noise = CannyGradPercentile(gradHist, params.adaptivePercentile);
+    int highThresh = (int)(noise * params.adaptiveScale + 0.5f);
+    highThresh = std::min(std::max(highThresh, AdaptiveMinThresh), AdaptiveMaxThresh);
+
+    // Same ratios as the defaults
+    DetectionParams defaults;
+    params.maxThresh = highThresh;
+    params.gradThresh = highThresh * defaults.gradThresh / defaults.maxThresh;
+    params.minThresh = std::max(highThresh * defaults.minThresh / defaults.maxThresh, 1);
+
+    logVerbose("Adaptive thresholds: noise " + std::to_string(noise) + ", using " +
+               std::to_string(params.gradThresh) + ", " + std::to_string(params.minThresh) + ", " +
+               std::to_string(params.maxThresh));
+}
 
-    // Suppress non-maximum values to highlight edges
-    CannyNonMaxSupress(gradImg, thetaImg, 60.0);
+// Throw out the last pass's features.  The dots point into the features,
+//  so they go first.
+void FeatureProcessor::clearFeatures()
+{
+    for (auto *dot : featureDots)
+        delete dot;
+    featureDots.clear();
+    feats.reset();
+    numFound = 0;
+}
+
+// Try again with new thresholds, reusing the gradient
+int FeatureProcessor::redoGradient(int gradThresh, int minThresh, int maxThresh)
+{
+    if (!gradImg || !thetaImg)
+    {
+        std::cerr << "Error: redoGradient called before the image was processed." << std::endl;
+        return 0;
+    }
+
+    logVerbose("Redoing detection with thresholds " + std::to_string(gradThresh) + ", " +
+               std::to_string(minThresh) + ", " + std::to_string(maxThresh));
+
+    // Non-max suppression has to start over from the raw angles
+    if (gradThresh != params.gradThresh)
+    {
+        if (rawThetaImg)
+        {
+            memcpy(thetaImg->getImgData(), rawThetaImg->getImgData(), thetaImg->totalSize());
+            if (!thinSeeds)
+                thinSeeds = new std::vector<int>();
+            CannyNonMaxSupress(gradImg, thetaImg, gradThresh, thinSeeds);
+            params.gradThresh = gradThresh;
+        } else
+            std::cerr << "Warning: No raw angles to redo non-max suppression, keeping threshold " << params.gradThresh << std::endl;
+    }
+
+    params.minThresh = minThresh;
+    params.maxThresh = maxThresh;
+
+    return findQyoo();
 }
 
 // Find valid Qyoo features
 int FeatureProcessor::findQyoo()
 {
     logVerbose("Starting Qyoo detection...");
-
-    featImg = new RawImageGray32(grayImg->getSizeX(), grayImg->getSizeY());
-    CannyFindFeatures(gradImg, thetaImg, 10.0, 60.0, feats, featImg);
-
-    logVerbose("Number of features detected: " + std::to_string(feats.size()) );
+    traceFeatures();
 
     // Iterate over the detected features and validate them
-    numFound = 0;
-    for (unsigned int ii = 0; ii < feats.size(); ii++)
+    unsigned int ii;
+    for (ii = 0; ii < feats.size(); ii++)
     {
-        Feature &feat = feats[ii];
+        if (!validateTimeLeft())
+            break;
+        if (validateFeature(feats[ii], params))
+            numFound++;
+        numValidated++;
+    }
 
-        feat.imgSizeX = grayImg->getSizeX();
-        feat.imgSizeY = grayImg->getSizeY();
+    // Features start out valid, so the ones we didn't get to have to be marked
+    for (unsigned int jj = ii; jj < feats.size(); jj++)
+        feats[jj].valid = false;
 
-        feat.calcClosed(ClosedDist * ClosedDist);
-        feat.decimate(DecimateDist * DecimateDist);
-        feat.checkSizeAndPosition(grayImg->getSizeX(), grayImg->getSizeY());
+    mergeDuplicates();
 
-        if (feat.valid)
+    logDetectionDone();
+    return numFound;
+}
+
+// Features are the same qyoo if they're within these of each other
+const float DuplicateCornerFrac = 0.1f;   // Corner distance, as a fraction of the scale
+const float DuplicateScaleFrac = 0.2f;    // Scale difference, as a fraction of the scale
+const float DuplicateRotation = 15.0f * M_PI / 180.0f;
+
+// Merge features that describe the same qyoo
+int FeatureProcessor::mergeDuplicates()
+{
+    class Placement
+    {
+    public:
+        int which;
+        float px, py, scale, rot;
+    };
+
+    // Best fitting first.  On a tie, the inner edge is the one that hugs the shape.
+    std::vector<Placement> cands;
+    float cellSize = 1.0f;
+    for (unsigned int ii = 0; ii < feats.size(); ii++)
+        if (feats[ii].valid)
         {
-            feat.findCorner();
-            feat.refineCornerAndFindAngles(10 * 10);
-            feat.modelCheck(0.04 * 0.04, 0.8);
+            Placement place;
+            place.which = ii;
+            feats[ii].getPlacement(place.px, place.py, place.scale, place.rot);
+            cellSize = std::max(cellSize, place.scale * DuplicateCornerFrac);
+            cands.push_back(place);
         }
+    if (cands.size() < 2)
+        return 0;
+    std::stable_sort(cands.begin(), cands.end(),
+                     [this](const Placement &a, const Placement &b) {
+                         float ratioA = feats[a.which].modelRatio, ratioB = feats[b.which].modelRatio;
+                         return ratioA > ratioB || (ratioA == ratioB && a.scale < b.scale);
+                     });
+
+    // Grid on the corner position.  The cells are at least as big as the
+    //  biggest corner tolerance, so we only have to look at the neighbors.
+    std::unordered_map<long long, std::vector<int> > grid;
+    auto cellKey = [](int cx, int cy) { return ((long long)cx << 32) ^ (unsigned int)cy; };
+
+    int numMerged = 0;
+    for (unsigned int ii = 0; ii < cands.size(); ii++)
+    {
+        const Placement &place = cands[ii];
+        int cx = (int)floorf(place.px / cellSize), cy = (int)floorf(place.py / cellSize);
+
+        bool dupe = false;
+        for (int iy = cy - 1; iy <= cy + 1 && !dupe; iy++)
+            for (int ix = cx - 1; ix <= cx + 1 && !dupe; ix++)
+            {
+                auto it = grid.find(cellKey(ix, iy));
+                if (it == grid.end())
+                    continue;
+                for (int kept : it->second)
+                {
+                    const Placement &other = cands[kept];
+                    float dx = place.px - other.px, dy = place.py - other.py;
+                    float cornerTol = other.scale * DuplicateCornerFrac;
+                    float rotDiff = fabsf(remainderf(place.rot - other.rot, 2.0f * M_PI));
+                    if (dx * dx + dy * dy <= cornerTol * cornerTol &&
+                        fabsf(place.scale - other.scale) <= other.scale * DuplicateScaleFrac &&
+                        rotDiff <= DuplicateRotation)
+                    {
+                        dupe = true;
+                        break;
+                    }
+                }
+            }
 
-        if (feat.valid)
+        if (dupe)
         {
-            logVerbose("Qyoo shape feature found!");
-            numFound++;
-        }
+            feats[place.which].valid = false;
+            numMerged++;
+        } else
+            grid[cellKey(cx, cy)].push_back(ii);
     }
 
-    logVerbose("Total Qyoo shapes detected: " + std::to_string(numFound) );
+    if (numMerged > 0)
+    {
+        numFound -= numMerged;
+        logVerbose("Merged " + std::to_string(numMerged) + " duplicate features");
+    }
+
+    return numMerged;
+}
+
+int FeatureProcessor::findFirstQyoo(gdImagePtr inImage)
+{
+    return findFirstQyoo(inImage, NULL);
+}
+
+int FeatureProcessor::findFirstQyoo(RawImageGray8 *inImage)
+{
+    return findFirstQyoo(NULL, inImage);
+}
+
+// Validate the likeliest looking features first and stop at the first one we can read
+int FeatureProcessor::findFirstQyoo(gdImagePtr inImage, RawImageGray8 *inGrayImage)
+{
+    logVerbose("Starting Qyoo detection (first match)...");
+    traceFeatures();
+
+    // Sort by score, keeping discovery order for ties
+    int closedDist2 = (int)(params.closedDist * params.closedDist);
+    std::vector<std::pair<float, int> > order(feats.size());
+    for (unsigned int ii = 0; ii < feats.size(); ii++)
+        order[ii] = std::make_pair(-feats[ii].candidateScore(sizeX, sizeY, closedDist2), (int)ii);
+    std::sort(order.begin(), order.end());
+
+    // Nothing's valid until we've checked it
+    for (auto &feat : feats)
+        feat.valid = false;
+
+    for (auto &candidate : order)
+    {
+        if (!validateTimeLeft())
+            break;
+
+        Feature &feat = feats[candidate.second];
+        feat.valid = true;
+        numValidated++;
+        // Only one of these gets decoded, so there's nothing to compare ratios with
+        if (!validateFeature(feat, params, false))
+            continue;
+        numFound++;
+
+        FeatureDotsProcessor *featDots = inImage ? new FeatureDotsProcessor(inImage, this, &feat) :
+                                                   new FeatureDotsProcessor(inGrayImage, this, &feat);
+        featDots->findDotsGray();
+        featureDots.push_back(featDots);
+
+        // Note: verifyCode() doesn't have a code list to check against at the
+        //  moment, so a successful read is as good as it gets.
+        if (!feat.dotDecStr.empty())
+            break;
+    }
+
+    logDetectionDone();
     return numFound;
 }
 
+// Set up the budget and trace the features
+void FeatureProcessor::traceFeatures()
+{
+    // Start from a clean slate if we've been here before
+    clearFeatures();
+    numValidated = 0;
+    if (featImg)
+        featImg->clear();
+    else
+        featImg = new RawImageLabel32(sizeX, sizeY);
+
+    auto startTime = std::chrono::steady_clock::now();
+    auto deadline = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(params.deadlineMs));
+    TraceLimits limits;
+    limits.maxPixels = params.maxTracePixels;
+    limits.maxFeatures = params.maxFeatures;
+    if (params.deadlineMs > 0.0)
+        limits.setDeadline(deadline);
+
+    if (params.traceThreads > 1)
+        CannyFindFeaturesParallel(gradImg, thetaImg, params.minThresh, params.maxThresh, feats, featImg, params.traceThreads, &limits, thinSeeds);
+    else
+        CannyFindFeatures(gradImg, thetaImg, params.minThresh, params.maxThresh, feats, featImg, &limits, thinSeeds);
+    status = limits.budgetExceeded ? DetectBudgetExceeded : DetectComplete;
+    numTracedPixels = limits.numPixels;
+
+    logVerbose("Number of features detected: " + std::to_string(feats.size()) );
+
+    // Validation gets its own time limit, on top of the overall deadline
+    validateEnd = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(params.maxValidateMs));
+    if (params.deadlineMs > 0.0 && (params.maxValidateMs <= 0.0 || deadline < validateEnd))
+        validateEnd = deadline;
+    validateTimeLimit = params.deadlineMs > 0.0 || params.maxValidateMs > 0.0;
+}
+
+// Check the clock before validating another feature
+bool FeatureProcessor::validateTimeLeft()
+{
+    if (validateTimeLimit && std::chrono::steady_clock::now() >= validateEnd)
+    {
+        status = DetectBudgetExceeded;
+        return false;
+    }
+
+    return true;
+}
+
+void FeatureProcessor::logDetectionDone()
+{
+    if (status == DetectBudgetExceeded)
+        logVerbose("Detection budget exceeded: traced " + std::to_string(numTracedPixels) + " pixels, validated " +
+                   std::to_string(numValidated) + " of " + std::to_string(feats.size()) + " features");
+    else
+        logVerbose("Validated " + std::to_string(numValidated) + " of " + std::to_string(feats.size()) + " features");
+
+    logVerbose("Total Qyoo shapes detected: " + std::to_string(numFound) );
+}
+
+// Check one feature against our idea of a Qyoo
+bool FeatureProcessor::validateFeature(Feature &feat, const DetectionParams &checkParams, bool needRatio)
+{
+    feat.imgSizeX = sizeX;
+    feat.imgSizeY = sizeY;
+
+    feat.calcClosed(checkParams.closedDist * checkParams.closedDist);
+    feat.decimate(checkParams.decimateDist * checkParams.decimateDist);
+    feat.checkSizeAndPosition(sizeX, sizeY);
+
+    if (feat.valid)
+    {
+        feat.findCorner();
+        feat.refineCornerAndFindAngles(10 * 10);
+        feat.modelCheck(checkParams.modelNearDist * checkParams.modelNearDist, checkParams.modelNearFrac, needRatio);
+    }
+
+    if (feat.valid)
+        logVerbose("Qyoo shape feature found!");
+
+    return feat.valid;
+}
+
+// Take over features that were traced and validated somewhere else
+void FeatureProcessor::takeFeatures(FeaturePool &newFeats, RawImageGray8 *newThetaImg, RawImageLabel32 *newFeatImg)
+{
+    clearFeatures();
+    feats.swap(newFeats);
+
+    if (newThetaImg)
+    {
+        delete thetaImg;
+        thetaImg = newThetaImg;
+
+        // Our seeds went with the old angles
+        delete thinSeeds;
+        thinSeeds = NULL;
+    }
+    if (newFeatImg)
+    {
+        delete featImg;
+        featImg = newFeatImg;
+    }
+
+    for (auto &feat : feats)
+        if (feat.valid)
+            numFound++;
+    mergeDuplicates();
+}
+
 // Detect dots in the valid Qyoo features
 void FeatureProcessor::findDots(gdImagePtr inImage)
 {
@@ -336,3 +851,17 @@ void FeatureProcessor::findDots(gdImagePtr inImage)
         }
     }
 }
+
+// Detect dots in the valid Qyoo features, from an 8 bit source
+void FeatureProcessor::findDots(RawImageGray8 *inImage)
+{
+    for (auto &feat : feats)
+    {
+        if (feat.valid)
+        {
+            auto *featDots = new FeatureDotsProcessor(inImage, this, &feat);
+            featDots->findDotsGray();
+            featureDots.push_back(featDots);
+        }
+    }
+}
@@ -14,6 +14,7 @@
 #import "Convolution.h"
 #import "CannyDetector.h"
 #import "Feature.h"
+#import "DotClassifier.h"
 
 class FeatureProcessor;
 
@@ -31,6 +32,9 @@ class FeatureDotsProcessor
   // Constructor: Initializes the processor with the given image, feature processor, and feature.
   FeatureDotsProcessor(gdImagePtr inImage, FeatureProcessor *featProc, Feature *feat);
 
+  // Constructor: Same as above, but the source is an 8 bit image rather than a GD image.
+  FeatureDotsProcessor(RawImageGray8 *inImage, FeatureProcessor *featProc, Feature *feat);
+
   // Destructor: Cleans up resources used by the processor.
   ~FeatureDotsProcessor();
 
@@ -38,9 +42,18 @@ class FeatureDotsProcessor
   // This version uses raw grayscale data for processing.
   void findDotsGray();
 
+  // The dot image with the dots that were read circled in green and the rest crossed
+  //  out in red, one entry of dotBits per row.  findDotsGray() saves this to output/
+  //  when the processor's writeAnnotations is set.
+  static gdImagePtr drawDots(RawImageGray8 *dotImg, const std::vector<unsigned char> &dotBits);
+  // Same, written out as a PNG
+  static bool saveDots(RawImageGray8 *dotImg, const std::vector<unsigned char> &dotBits, const std::string &fileName);
+
 protected:
-  // Initialize the processor with the given image, feature processor, and feature.
-  void init(gdImagePtr inImage, FeatureProcessor *featProc, Feature *feat);
+  // Initialize the processor with the feature processor and feature.
+  // Fills in the matrix that maps the source image into dot space.
+  // Returns false if the feature's transform can't be inverted.
+  bool init(int imgWidth, int imgHeight, FeatureProcessor *featProc, Feature *feat, Affine2D &mat);
 
  public:
   RawImageGray8 *grayImg;   // Grayscale version of the image
@@ -56,6 +69,47 @@ protected:
   int qyooRows[QYOOSIZE];
 };
 
+/*
+ * DetectionParams
+ * The tunable values for a detection pass.  The defaults are what
+ * we've found to work, but they can be overridden for experiments.
+ */
+class DetectionParams
+{
+ public:
+  DetectionParams();
+
+  int gradThresh;       // Gradients below this are dropped by non-max suppression
+  int minThresh;        // Tracing will follow gradients above this
+  int maxThresh;        // Tracing will only start on gradients above this
+  float closedDist;     // Distance between the ends to consider a feature closed
+  float decimateDist;   // Tolerance for decimating points in a feature
+  double modelNearDist; // How close a point has to be to the model (in model space)
+  double modelNearFrac; // Fraction of the points that have to be that close
+
+  // Adaptive mode picks the thresholds per image from the gradient histogram.
+  // The given percentile of the edge pixels is taken as the noise level and
+  //  the high thresholds are set to a multiple of it.  The low threshold keeps
+  //  the same ratio to the high one as the defaults.
+  bool adaptive;
+  float adaptivePercentile;
+  float adaptiveScale;
+
+  // Work budget for findQyoo().  Zero means no limit.
+  // Once any of these run out, detection stops and returns what it has.
+  int maxTracePixels;    // Pixels traced across all features
+  int maxFeatures;       // Features traced
+  double maxValidateMs;  // Time spent validating features
+  double deadlineMs;     // Total time for tracing and validation
+
+  // Threads for tracing features (see CannyFindFeaturesParallel).
+  // 1 traces serially.  Only used when there's no work budget.
+  int traceThreads;
+};
+
+// How the last detection pass went
+typedef enum {DetectComplete=0,DetectBudgetExceeded} DetectStatus;
+
 /*
  * FeatureProcessor
  * This class manages the entire image processing pass, from edge detection to feature
@@ -66,36 +120,144 @@ class FeatureProcessor
 {
  public:
   // Constructor: Initializes the processor with the given image and image size.
-  FeatureProcessor(gdImagePtr inImage, int processSizeX, int processSizeY);
+  // The image is converted to gray, contrast stretched and blurred in one go (see ingestImage()).
+  // Pass keepGray if you want the unblurred grayImg as well.
+  FeatureProcessor(gdImagePtr inImage, int processSizeX, int processSizeY, bool keepGray = false);
+
+  // Constructor: Sets up an empty processor of the given size.
+  // The caller fills in the gradient and theta images (e.g. from a checkpoint)
+  //  and can then go straight to findQyoo().
+  FeatureProcessor(int processSizeX, int processSizeY);
 
   // Destructor: Cleans up resources used by the processor.
   ~FeatureProcessor();
 
+  // Start over on a new image, like the image constructor does.
+  // The buffers are kept if the size hasn't changed, so one processor can work
+  //  through a stream of images without reallocating.  params are left alone.
+  void loadImage(gdImagePtr inImage, int processSizeX, int processSizeY, bool keepGray = false);
+
+  // Same, but from an 8 bit gray image, processed at its own size.
+  // The image is only read from, so it can wrap memory somebody else owns.
+  void loadImage(RawImageGray8 *inImage, bool keepGray = false);
+
+  // Just the window of it starting at (x0,y0), processed at the window's size.
+  // The window isn't copied.  The features come out in window coordinates.
+  void loadImage(RawImageGray8 *inImage, int x0, int y0, int windowSizeX, int windowSizeY, bool keepGray = false);
+
   // Processes the image up to the point of finding thin edges and gradients.
+  // In adaptive mode, this is where the thresholds get picked.
   void processImage();
 
-  // Reprocess the image using a larger gradient (for debugging purposes).
-  void redoGradient(gdImagePtr inImage, int processSizeX, int processSizeY);
+  // Set the thresholds from the gradient histogram (see DetectionParams)
+  void pickAdaptiveThresholds();
+
+  // Run detection again with different thresholds.
+  // This reuses the gradient from processImage() and only redoes the non-max
+  //  suppression (if gradThresh changed) and the feature tracing and validation.
+  // Any features and dots from the last pass are thrown out.
+  // Returns the number of valid Qyoo features found, like findQyoo().
+  int redoGradient(int gradThresh, int minThresh, int maxThresh);
 
   // Detect Qyoo features in the processed image.
   // Returns the number of valid Qyoo features found.
+  // If the budget in params runs out, status is set to DetectBudgetExceeded
+  //  and this returns whatever was found up to that point.
   int findQyoo();
 
+  // Like findQyoo(), but validates the most promising looking features first
+  //  and decodes them as it goes, stopping at the first one that reads.
+  // The dots are already found on return, so there's no need for findDots().
+  int findFirstQyoo(gdImagePtr inImage);
+  int findFirstQyoo(RawImageGray8 *inImage);
+
+  // Run a single feature through the size, corner and model checks using the given parameters.
+  // Sets feat.valid and returns it.  This doesn't touch the processor, so it's safe to
+  //  call from several threads at once.
+  // Pass needRatio=false if nobody will look at feat.modelRatio.
+  bool validateFeature(Feature &feat, const DetectionParams &checkParams, bool needRatio = true);
+
+  // Inner and outer edges of the same printed qyoo both come out as valid features.
+  // This keeps the best fitting one (by modelRatio) of each group of features with
+  //  about the same corner, scale and rotation and marks the rest invalid.
+  // Returns the number merged away.
+  int mergeDuplicates();
+
+  // Replace our features with ones found elsewhere (e.g. by a ThresholdSearch).
+  // We take ownership of the images.  If thetaImg is NULL, we keep our own.
+  void takeFeatures(FeaturePool &newFeats, RawImageGray8 *newThetaImg, RawImageLabel32 *newFeatImg);
+
   // Find and process the dots in the valid Qyoo features.
   void findDots(gdImagePtr inImage);
 
+  // Find and process the dots, reading them from an 8 bit version of the input image.
+  void findDots(RawImageGray8 *inImage);
+
+  // Dot classifier shared by all the features (created on first use)
+  DotClassifier *getDotClassifier();
+
+ protected:
+  // Null out everything before we start
+  void init(int processSizeX, int processSizeY);
+
+  // Free the image buffers and null them out
+  void freeImages();
+
+  // Turn the input image into gaussImg (and grayImg, if keepGray) in a single streaming pass.
+  // The contrast stretch comes from a histogram and goes through a lookup table, and the
+  //  stretched rows feed the Gaussian through a ring buffer the height of the filter.
+  void ingestImage(gdImagePtr inImage, bool keepGray);
+  void ingestImage(RawImageGray8 *inImage, int x0, int y0, bool keepGray);
+
+  // The part they share: stretch the source rows through lut and blur them
+  void ingestRows(unsigned char *const *srcRows, const unsigned char *lut, bool keepGray);
+
+  // Forget the last image's results and make sure the buffers are the right size
+  void startImage(int processSizeX, int processSizeY);
+
+  // Throw out the features (and dots) from the last pass
+  void clearFeatures();
+
+  // Trace features with the budget from params and get ready to validate them
+  void traceFeatures();
+
+  // False if we're out of time to validate features
+  bool validateTimeLeft();
+
+  // Verbose summary at the end of detection
+  void logDetectionDone();
+
+  // Takes either one
+  int findFirstQyoo(gdImagePtr inImage, RawImageGray8 *inGrayImage);
+
  public:
+  DetectionParams params;             // Thresholds and tolerances for this pass
+  int sizeX, sizeY;                   // Size we're processing at
   ConvolutionFilterInt *gaussFilter;  // Gaussian filter to reduce noise in the image
-  RawImageGray8 *grayImg;             // Grayscale version of the input image
+  RawImageGray8 *grayImg;             // Grayscale version of the input image (if it was kept)
   RawImageGray8 *gaussImg;            // Gaussian blurred image
   RawImageGray32 *gradImg;            // Gradient image (calculated during edge detection)
   RawImageGray8 *thetaImg;            // Angle of the edges in the image
-  RawImageGray32 *featImg;            // Feature map used to mark off detected features
+  RawImageGray8 *rawThetaImg;         // Angles before non-max suppression (for redoGradient)
+  RawImageLabel32 *featImg;            // Feature map used to mark off detected features
+  int *gradHist;                      // Histogram of gradient magnitudes (CannyGradHistBins)
+  std::vector<int> *thinSeeds;        // Thin pixels from non-max suppression, where tracing starts (NULL to scan)
 
-  std::vector<Feature> feats;         // List of detected features
+  FeaturePool feats;                  // List of detected features
   int numFound;                       // Number of valid Qyoo features found
+  DetectStatus status;                // Whether the last findQyoo() finished
+  int numValidated;                   // Features the last pass validated
+  int numTracedPixels;                // Pixels the last pass traced
+  bool writeAnnotations;              // findDots() prints the codes and saves the marked up dots to output/
 
   // List of processors for the detected dots in valid Qyoo features
   std::vector<FeatureDotsProcessor *> featureDots;
+
+ protected:
+  DotClassifier *dotClassifier;       // Reused for every feature we decode
+
+  // Validation time limit for the current pass
+  std::chrono::steady_clock::time_point validateEnd;
+  bool validateTimeLimit;
 };
 
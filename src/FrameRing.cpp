@@ -0,0 +1,400 @@
+/*
+ *  FrameRing.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FrameRing.h"
+#include "Logger.h"
+
+// Everything starts on this boundary
+const unsigned long long FrameRingAlign = 64;
+
+static unsigned long long alignUp(unsigned long long offset)
+{
+    return (offset + FrameRingAlign - 1) & ~(FrameRingAlign - 1);
+}
+
+FrameRing::FrameRing()
+{
+    header = NULL;
+    dataSize = 0;
+    memFd = -1;
+}
+
+FrameRing::~FrameRing()
+{
+    close();
+}
+
+bool FrameRing::create(const std::string &name, int numSlots, int maxSizeX, int maxSizeY)
+{
+    close();
+    if (numSlots <= 0 || maxSizeX <= 0 || maxSizeY <= 0)
+        return false;
+
+    int fd = -1;
+    if (name == "memfd")
+    {
+#ifdef __linux__
+        fd = memfd_create("qyoo-frames", 0);
+        path = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+#else
+        std::cerr << "Error: memfd rings are only available on Linux." << std::endl;
+        return false;
+#endif
+    } else {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        path = name;
+        if (fd >= 0)
+            shmName = name;
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Error: Unable to create frame ring " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    FrameRingHeader layout;
+    layout.slotSize = alignUp(FrameSlotDataOffset + (unsigned long long)maxSizeX * maxSizeY);
+    layout.framesOffset = alignUp(sizeof(FrameRingHeader));
+    layout.resultsOffset = alignUp(layout.framesOffset + layout.slotSize * numSlots);
+    layout.fileSize = layout.resultsOffset + sizeof(ResultSlot) * numSlots;
+    if (ftruncate(fd, layout.fileSize) < 0 || !map(fd, true))
+    {
+        std::cerr << "Error: Unable to size frame ring " << name << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        close();
+        return false;
+    }
+
+    // The new mapping is all zeros, which is where the counters should start
+    header->version = FrameRingVersion;
+    header->headerSize = sizeof(FrameRingHeader);
+    header->numSlots = numSlots;
+    header->maxSizeX = maxSizeX;
+    header->maxSizeY = maxSizeY;
+    header->slotSize = layout.slotSize;
+    header->framesOffset = layout.framesOffset;
+    header->resultsOffset = layout.resultsOffset;
+    header->fileSize = layout.fileSize;
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, FrameRingMagic, sizeof(header->magic));
+
+    // A memfd has to stay open for the other side to find it through /proc
+    if (shmName.empty())
+        memFd = fd;
+    else
+        ::close(fd);
+
+    return true;
+}
+
+bool FrameRing::attach(const std::string &name)
+{
+    close();
+
+    // Shared memory names have a single slash, at the front
+    bool isShm = name.size() > 1 && name[0] == '/' && name.find('/', 1) == std::string::npos;
+    int fd = isShm ? shm_open(name.c_str(), O_RDWR, 0) : open(name.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        std::cerr << "Error: Unable to open frame ring " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    path = name;
+
+    bool ok = map(fd, false);
+    ::close(fd);
+    if (!ok)
+    {
+        std::cerr << "Error: Not a frame ring: " << name << std::endl;
+        close();
+    }
+
+    return ok;
+}
+
+// Map the whole file and check it hangs together
+bool FrameRing::map(int fd, bool created)
+{
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(FrameRingHeader))
+        return false;
+    dataSize = info.st_size;
+
+    void *data = mmap(NULL, dataSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        dataSize = 0;
+        return false;
+    }
+    header = (FrameRingHeader *)data;
+    if (created)
+        return true;
+
+    if (memcmp(header->magic, FrameRingMagic, sizeof(header->magic)) != 0 ||
+        header->version != FrameRingVersion || header->headerSize != sizeof(FrameRingHeader) ||
+        header->numSlots <= 0 || header->maxSizeX < 0 || header->maxSizeY < 0 || header->fileSize > dataSize)
+        return false;
+
+    // The offsets come from the other side.  Make sure the frames sit between the header
+    //  and the results, and the results fit in the file, dividing so nothing can overflow.
+    unsigned long long numSlots = header->numSlots, fileSize = header->fileSize;
+    unsigned long long framesOffset = header->framesOffset, resultsOffset = header->resultsOffset;
+    return header->slotSize >= FrameSlotDataOffset + (unsigned long long)header->maxSizeX * header->maxSizeY &&
+           header->slotSize % FrameRingAlign == 0 && framesOffset % FrameRingAlign == 0 && resultsOffset % FrameRingAlign == 0 &&
+           framesOffset >= sizeof(FrameRingHeader) && framesOffset <= resultsOffset && resultsOffset <= fileSize &&
+           header->slotSize <= (resultsOffset - framesOffset) / numSlots &&
+           sizeof(ResultSlot) <= (fileSize - resultsOffset) / numSlots;
+}
+
+void FrameRing::close()
+{
+    if (header)
+        munmap(header, dataSize);
+    header = NULL;
+    dataSize = 0;
+    if (!shmName.empty())
+        shm_unlink(shmName.c_str());
+    shmName.clear();
+    if (memFd >= 0)
+        ::close(memFd);
+    memFd = -1;
+}
+
+FrameSlot *FrameRing::nextFreeFrame()
+{
+    unsigned long long head = header->frameHead.load(std::memory_order_relaxed);
+    if (head - header->frameTail.load(std::memory_order_acquire) >= (unsigned long long)header->numSlots)
+        return NULL;
+
+    return (FrameSlot *)((unsigned char *)header + header->framesOffset + (head % header->numSlots) * header->slotSize);
+}
+
+void FrameRing::publishFrame()
+{
+    header->frameHead.store(header->frameHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+FrameSlot *FrameRing::nextFrame()
+{
+    unsigned long long tail = header->frameTail.load(std::memory_order_relaxed);
+    if (tail == header->frameHead.load(std::memory_order_acquire))
+        return NULL;
+
+    return (FrameSlot *)((unsigned char *)header + header->framesOffset + (tail % header->numSlots) * header->slotSize);
+}
+
+void FrameRing::releaseFrame()
+{
+    header->frameTail.store(header->frameTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+ResultSlot *FrameRing::nextFreeResult()
+{
+    unsigned long long head = header->resultHead.load(std::memory_order_relaxed);
+    if (head - header->resultTail.load(std::memory_order_acquire) >= (unsigned long long)header->numSlots)
+        return NULL;
+
+    return (ResultSlot *)((unsigned char *)header + header->resultsOffset) + head % header->numSlots;
+}
+
+void FrameRing::publishResult()
+{
+    header->resultHead.store(header->resultHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+ResultSlot *FrameRing::nextResult()
+{
+    unsigned long long tail = header->resultTail.load(std::memory_order_relaxed);
+    if (tail == header->resultHead.load(std::memory_order_acquire))
+        return NULL;
+
+    return (ResultSlot *)((unsigned char *)header + header->resultsOffset) + tail % header->numSlots;
+}
+
+void FrameRing::releaseResult()
+{
+    header->resultTail.store(header->resultTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// closed is stored after the last frame is published, so once we see it the head is final
+bool FrameRing::finished()
+{
+    return header->closed.load(std::memory_order_acquire) &&
+           header->frameHead.load(std::memory_order_acquire) == header->frameTail.load(std::memory_order_relaxed);
+}
+
+// Spin a bit, then yield, then sleep
+void FrameRingWait(int &numIdle)
+{
+    numIdle++;
+    if (numIdle < 64)
+        return;
+    if (numIdle < 128)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(numIdle < 1024 ? 50 : 1000));
+}
+
+int RunFrameRingDetector(const std::string &name, const DetectionParams &params, bool firstMatch, volatile sig_atomic_t *stop)
+{
+    FrameRing ring;
+    if (!ring.attach(name))
+        return -1;
+    FrameRingHeader *header = ring.getHeader();
+    logVerbose("Attached to frame ring " + name + ": " + std::to_string(header->numSlots) + " slots of " +
+               std::to_string(header->maxSizeX) + "x" + std::to_string(header->maxSizeY));
+
+    FeatureProcessor *proc = NULL;
+    std::string text;
+    int numFrames = 0, numIdle = 0;
+    while (!(stop && *stop))
+    {
+        FrameSlot *frame = ring.nextFrame();
+        if (!frame)
+        {
+            if (ring.finished())
+                break;
+            FrameRingWait(numIdle);
+            continue;
+        }
+        numIdle = 0;
+
+        auto startTime = std::chrono::steady_clock::now();
+        bool budgetExceeded = false;
+        int numFound = 0;
+        bool badFrame = frame->sizeX <= 0 || frame->sizeY <= 0 || frame->sizeX > header->maxSizeX || frame->sizeY > header->maxSizeY;
+        if (!badFrame)
+        {
+            // Straight out of the slot, no copy
+            RawImageGray8 image(ring.frameData(frame), frame->sizeX, frame->sizeY, false);
+            numFound = DetectImage(&image, proc, params, firstMatch, text, budgetExceeded);
+        }
+        float processMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+        // The producer has to keep up with the results, or we wait here
+        ResultSlot *result;
+        while (!(result = ring.nextFreeResult()) && !(stop && *stop))
+            FrameRingWait(numIdle);
+        numIdle = 0;
+        if (!result)
+            break;
+
+        result->frameId = frame->frameId;
+        result->status = badFrame ? DetectBadRequest : (numFound > 0 ? DetectFound : DetectNotFound);
+        result->numFound = numFound;
+        result->budgetExceeded = budgetExceeded;
+        result->processMs = processMs;
+        result->textSize = badFrame ? 0 : std::min(text.size(), (size_t)FrameRingResultText);
+        memcpy(result->text, text.data(), result->textSize);
+        ring.publishResult();
+        ring.releaseFrame();
+        numFrames++;
+    }
+
+    delete proc;
+    return numFrames;
+}
+
+int RunFrameRingProducer(const std::string &name, const std::vector<std::string> &fileNames, int numFrames, int numSlots)
+{
+    // Gray versions of the images, the way a capture process would have them
+    std::vector<RawImageGray8 *> images;
+    int maxSizeX = 0, maxSizeY = 0;
+    for (auto &fileName : fileNames)
+    {
+        FILE *fp = fopen(fileName.c_str(), "rb");
+        gdImagePtr gdImage = fp ? gdImageCreateFromPng(fp) : NULL;
+        if (fp)
+            fclose(fp);
+        if (!gdImage)
+        {
+            std::cerr << "Error: Unable to load image: " << fileName << std::endl;
+            continue;
+        }
+        RawImageGray8 *image = new RawImageGray8(gdImageSX(gdImage), gdImageSY(gdImage));
+        image->copyFromGDImage(gdImage);
+        gdImageDestroy(gdImage);
+        maxSizeX = std::max(maxSizeX, image->getSizeX());
+        maxSizeY = std::max(maxSizeY, image->getSizeY());
+        images.push_back(image);
+    }
+    if (images.empty())
+        return 1;
+    if (numFrames <= 0)
+        numFrames = images.size();
+
+    FrameRing ring;
+    if (!ring.create(name, numSlots, maxSizeX, maxSizeY))
+    {
+        for (auto *image : images)
+            delete image;
+        return 1;
+    }
+    std::cout << "Frame ring ready, attach with --ring=" << ring.attachPath() << std::endl;
+
+    int numSent = 0, numReceived = 0, numIdle = 0;
+    int numReplies[DetectShuttingDown+1] = {0};
+    auto startTime = std::chrono::steady_clock::now();
+    while (numReceived < numFrames)
+    {
+        bool busy = false;
+
+        FrameSlot *frame;
+        if (numSent < numFrames && (frame = ring.nextFreeFrame()))
+        {
+            RawImageGray8 *image = images[numSent % images.size()];
+            frame->frameId = numSent;
+            frame->sizeX = image->getSizeX();
+            frame->sizeY = image->getSizeY();
+            memcpy(ring.frameData(frame), image->getImgData(), image->totalSize());
+            ring.publishFrame();
+            if (++numSent == numFrames)
+                ring.closeFrames();
+            busy = true;
+        }
+
+        ResultSlot *result;
+        while ((result = ring.nextResult()))
+        {
+            if (result->status <= DetectShuttingDown)
+                numReplies[result->status]++;
+            std::string text(result->text, std::min(result->textSize, (unsigned int)FrameRingResultText));
+            std::cout << "frame " << result->frameId << ": " << DetectReplyName(result->status) << ", " << result->processMs << " ms";
+            if (!text.empty())
+                std::cout << ", " << text.substr(0, text.find('\n'));
+            std::cout << std::endl;
+            ring.releaseResult();
+            numReceived++;
+            busy = true;
+        }
+
+        if (busy)
+            numIdle = 0;
+        else
+            FrameRingWait(numIdle);
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+    std::cout << numFrames << " frames in " << totalMs << " ms, " << numFrames * 1000.0 / totalMs << " frames/s" << std::endl;
+    for (int ii = 0; ii <= DetectShuttingDown; ii++)
+        if (numReplies[ii] > 0)
+            std::cout << "  " << DetectReplyName(ii) << ": " << numReplies[ii] << std::endl;
+
+    for (auto *image : images)
+        delete image;
+    return 0;
+}
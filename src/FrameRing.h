@@ -0,0 +1,149 @@
+/*
+ *  FrameRing.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Gray frames handed over in shared memory.  A capture process writes
+ *  decoded frames into a ring of fixed size slots and the detector works
+ *  on them where they are, then writes what it found into a second ring
+ *  going the other way.  There's one producer and one consumer per ring,
+ *  so the only synchronization is a pair of counters for each.
+ */
+
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#import <string>
+#import <vector>
+#import <atomic>
+#import <csignal>
+#import "DetectServer.h"
+
+/* Layout.  Everything is in native byte order and starts on a 64 byte
+	boundary so the counters don't share cache lines.
+	 header
+	 frame slots (numSlots of slotSize each, a FrameSlot then the pixels)
+	 result slots (numSlots ResultSlots)
+	A slot is the producer's from when it's free until it bumps the head
+	 counter, and the consumer's until it bumps the tail counter.
+ */
+#define FrameRingMagic "QYOORING"
+#define FrameRingVersion 1
+// Result text past this is cut off
+#define FrameRingResultText 256
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The ring counters have to work across processes");
+
+class FrameRingHeader
+{
+public:
+    char magic[8];
+    unsigned int version;
+    unsigned int headerSize;
+    int numSlots;
+    int maxSizeX, maxSizeY;         // Biggest frame that fits in a slot
+    int pad;
+    unsigned long long slotSize;    // Bytes per frame slot, including the FrameSlot
+    unsigned long long framesOffset, resultsOffset;
+    unsigned long long fileSize;
+
+    // Frames: the producer bumps frameHead after filling a slot, the consumer bumps frameTail when it's done with one
+    alignas(64) std::atomic<unsigned long long> frameHead;
+    alignas(64) std::atomic<unsigned long long> frameTail;
+    // Results go the other way
+    alignas(64) std::atomic<unsigned long long> resultHead;
+    alignas(64) std::atomic<unsigned long long> resultTail;
+    // Set by the producer when there are no more frames coming
+    alignas(64) std::atomic<unsigned int> closed;
+};
+
+// Start of a frame slot.  The pixels follow at FrameSlotDataOffset.
+class FrameSlot
+{
+public:
+    unsigned long long frameId;     // Whatever the producer wants, copied to the result
+    int sizeX, sizeY;
+};
+#define FrameSlotDataOffset 64
+
+class ResultSlot
+{
+public:
+    unsigned long long frameId;
+    unsigned int status;            // DetectReply
+    int numFound;
+    unsigned int budgetExceeded;
+    float processMs;
+    unsigned int textSize;
+    char text[FrameRingResultText]; // Same lines as the server's replies
+};
+
+/* Frame Ring
+	One side creates the ring and the other attaches to it.  The name is
+	 a POSIX shared memory name ("/name") or, for attaching, the path to any
+	 file that holds a ring, such as /proc/<pid>/fd/<n> for a memfd.
+	The slot calls return NULL when there's nothing to be had right now;
+	 they never block.
+ */
+class FrameRing
+{
+public:
+    FrameRing();
+    ~FrameRing();
+
+    // Make a new ring.  "memfd" makes an anonymous one (Linux only); attachPath() says how to get at it.
+    bool create(const std::string &name, int numSlots, int maxSizeX, int maxSizeY);
+    // Map an existing ring
+    bool attach(const std::string &name);
+    // Unmap, and remove the shared memory name if we made it
+    void close();
+
+    // Where the other side should attach
+    const std::string &attachPath() { return path; }
+    inline FrameRingHeader *getHeader() { return header; }
+    inline unsigned char *frameData(FrameSlot *slot) { return (unsigned char *)slot + FrameSlotDataOffset; }
+
+    // Producer: get the next free slot, fill it in, then publish it
+    FrameSlot *nextFreeFrame();
+    void publishFrame();
+    // Producer: results that have come back
+    ResultSlot *nextResult();
+    void releaseResult();
+    // Producer: no more frames
+    void closeFrames() { header->closed.store(1, std::memory_order_release); }
+
+    // Consumer: the oldest published frame, and give it back when done
+    FrameSlot *nextFrame();
+    void releaseFrame();
+    // Consumer: room for a result, then publish it
+    ResultSlot *nextFreeResult();
+    void publishResult();
+    // Consumer: true once the producer is done and every frame has been taken
+    bool finished();
+
+protected:
+    bool map(int fd, bool created);
+
+    std::string path;
+    std::string shmName;        // Set if we created a named ring
+    int memFd;                  // Kept open if we made a memfd ring, so /proc can find it
+    FrameRingHeader *header;
+    size_t dataSize;
+};
+
+// Back off a little more each time there's nothing to do, up to a millisecond
+void FrameRingWait(int &numIdle);
+
+/* Detect frames from a ring until the producer closes it (or stop is set).
+	Each frame is wrapped where it sits, not copied, and only given back
+	 once its result is written.  Returns the number of frames processed.
+ */
+int RunFrameRingDetector(const std::string &name, const DetectionParams &params, bool firstMatch, volatile sig_atomic_t *stop);
+
+/* Producer for testing: puts the gray versions of the given PNG files into a
+	new ring numFrames times over, round robin, and prints what comes back.
+ */
+int RunFrameRingProducer(const std::string &name, const std::vector<std::string> &fileNames, int numFrames, int numSlots);
+
+#endif // FRAMERING_H
@@ -0,0 +1,585 @@
+/*
+ *  ParallelTrace.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "ParallelTrace.h"
+#include "Logger.h"
+
+// Rows of the images a band keeps above and below itself.  The tracer looks one pixel around
+//  the points it visits and can step one row out of the band, and the stitch looks around that.
+#define BandHaloRows 2
+
+// One band of the image and the pieces of features traced in it
+class TraceBand
+{
+public:
+    TraceBand() { y0 = y1 = originY = 0;  firstId = 1;  labelImg = NULL; }
+    ~TraceBand() { delete labelImg; }
+
+    // Our own map only covers the band and its halo, but the points are in image coordinates
+    inline int label(int ix, int iy) { return labelImg->getLabel(ix, iy - originY); }
+    // On the band's first or last row, so it may have seen less than the serial tracer would
+    inline bool nearEdge(int which) { return minY[which] <= y0 || maxY[which] >= y1 - 1; }
+
+    int y0, y1;                  // Rows [y0,y1)
+    int originY;                 // Image row that's the top of our map
+    RawImageLabel32 *labelImg;   // Our own feature map
+    int firstId;                 // Piece ii goes in the full map as firstId+ii
+    FeaturePool feats;           // Pieces, in the order they were started.  Piece ii is ID ii+1 in our map.
+    std::vector<int> seeds;      // Where each piece started, as y*sizeX+x
+    std::vector<TraceEnd> ends;  // Two per piece, front then back
+    std::vector<int> numPixels;  // Pixels traced for each piece
+    std::vector<int> minX, maxX; // Box around each piece
+    std::vector<int> minY, maxY;
+};
+
+// Trace the features that start in a band, without leaving it
+static void traceBand(RawImageGray32 *gradImg, RawImageGray8 *thetaImg, int minThresh, int maxThresh, const TraceRegion &full,
+                      TraceBand &band, const std::vector<int> *seeds, const std::atomic<bool> *cancel)
+{
+    int sizeX = thetaImg->getSizeX(), sizeY = thetaImg->getSizeY();
+
+    // The tracer works on views of the band's rows, so its coordinates are our map's
+    band.originY = std::max(0, band.y0 - BandHaloRows);
+    int numRows = std::min(sizeY, band.y1 + BandHaloRows) - band.originY;
+    size_t offset = (size_t)band.originY * sizeX;
+    RawImageGray8 bandTheta(thetaImg->getImgData() + offset, sizeX, numRows, false);
+    RawImageGray32 bandGrad(gradImg->getImgData() + offset, sizeX, numRows, false);
+    CannyEdges bandEdges(&bandGrad, &bandTheta, minThresh, maxThresh);
+    band.labelImg = new RawImageLabel32(sizeX, numRows);
+    TraceRegion region(full.minX, std::max(full.minY, band.y0 - 1) - band.originY, full.maxX, std::min(full.maxY, band.y1) - band.originY);
+
+    auto tryPixel = [&](int ix, int iy)
+    {
+        int localY = iy - band.originY;
+        if (!CannyCanStartFeature(bandEdges, band.labelImg, ix, localY))
+            return;
+
+        Feature feat;
+        TraceEnd ends[2];
+        int numPixels = 0;
+        if (!CannyTraceFeature(&bandTheta, bandEdges, band.labelImg, band.feats.size() + 1, region, ix, localY, feat, numPixels, ends))
+            return;
+
+        // Back to image coordinates
+        int minX = ix, maxX = ix, minY = iy, maxY = iy;
+        for (auto &pt : feat.points)
+        {
+            pt.y += band.originY;
+            minX = std::min(minX, pt.x);
+            maxX = std::max(maxX, pt.x);
+            minY = std::min(minY, pt.y);
+            maxY = std::max(maxY, pt.y);
+        }
+        ends[0].y += band.originY;
+        ends[1].y += band.originY;
+
+        band.feats.add() = std::move(feat);
+        band.seeds.push_back(iy * sizeX + ix);
+        band.ends.push_back(ends[0]);
+        band.ends.push_back(ends[1]);
+        band.numPixels.push_back(numPixels);
+        band.minX.push_back(minX);
+        band.maxX.push_back(maxX);
+        band.minY.push_back(minY);
+        band.maxY.push_back(maxY);
+    };
+
+    int startY = std::max(band.y0, FeatureOffset), endY = std::min(band.y1, sizeY - FeatureOffset);
+    if (seeds)
+    {
+        // They're in raster order, so the band's seeds are all together
+        std::vector<int>::const_iterator it = std::lower_bound(seeds->begin(), seeds->end(), startY * sizeX);
+        for (; it != seeds->end() && *it < endY * sizeX; ++it)
+        {
+            if (cancel && cancel->load(std::memory_order_relaxed))
+                return;
+            int ix = *it % sizeX, iy = *it / sizeX;
+            if (ix >= FeatureOffset && ix < sizeX - FeatureOffset)
+                tryPixel(ix, iy);
+        }
+    } else {
+        for (int iy = startY; iy < endY; iy++)
+        {
+            if (cancel && cancel->load(std::memory_order_relaxed))
+                return;
+            for (int ix = FeatureOffset; ix < sizeX - FeatureOffset; ix++)
+                tryPixel(ix, iy);
+        }
+    }
+}
+
+// Run work(ii) for ii in [0,count), spread over the threads
+template<class Work>
+static void parallelFor(int count, int numThreads, Work work)
+{
+    std::atomic<int> next(0);
+    auto worker = [&]()
+    {
+        int which;
+        while ((which = next.fetch_add(1)) < count)
+            work(which);
+    };
+    std::vector<std::thread> threads;
+    for (int ii = 1; ii < numThreads; ii++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+typedef std::list<Feature::Point>::iterator PointIter;
+
+// Pieces off the edges of their bands are in the full map before the stitch starts, but the
+//  serial tracer wouldn't have seen the ones it hasn't reached yet.  A serial trace moves those
+//  out of its way and puts back the ones it didn't take any of.  The rest are traced from scratch.
+enum { PieceWaiting, PieceAside, PieceReached, PieceTakenBack };
+
+static inline bool waiting(const std::vector<char> &state, int label)
+{
+    return label > 0 && label < (int)state.size() && state[label] == PieceWaiting;
+}
+
+// Check that the tracer saw the same thing in the band's map as it would see in the full one now.
+// The tracer only looks one pixel around the points it visits and only cares if a pixel
+//  is free, its own or someone else's.  In the band's map, lower IDs were traced earlier.
+static bool sameSurroundings(TraceBand &band, RawImageLabel32 *featImg, const std::vector<char> &state, int localId, int featId,
+                             PointIter begin, PointIter end)
+{
+    for (PointIter it = begin; it != end; ++it)
+        for (int iy = it->y - 1; iy <= it->y + 1; iy++)
+            for (int ix = it->x - 1; ix <= it->x + 1; ix++)
+            {
+                int local = band.label(ix, iy);
+                bool wasOther = local && local < localId;
+                int label = featImg->getLabel(ix, iy);
+                if (wasOther != (label && label != featId && !waiting(state, label)))
+                    return false;
+            }
+
+    return true;
+}
+
+// Check that tracing on from the far end didn't come near these points
+static bool untouchedBy(TraceBand &band, RawImageLabel32 *featImg, int localId, int featId, PointIter begin, PointIter end)
+{
+    for (PointIter it = begin; it != end; ++it)
+        for (int iy = it->y - 1; iy <= it->y + 1; iy++)
+            for (int ix = it->x - 1; ix <= it->x + 1; ix++)
+                if (featImg->getLabel(ix, iy) == featId && band.label(ix, iy) != localId)
+                    return false;
+
+    return true;
+}
+
+// Check if the tracer looked at a piece that isn't there yet
+static bool waitingNear(RawImageLabel32 *featImg, const std::vector<char> &state, PointIter begin, PointIter end)
+{
+    for (PointIter it = begin; it != end; ++it)
+        for (int iy = it->y - 1; iy <= it->y + 1; iy++)
+            for (int ix = it->x - 1; ix <= it->x + 1; ix++)
+                if (waiting(state, featImg->getLabel(ix, iy)))
+                    return true;
+
+    return false;
+}
+
+// Copy a piece's pixels over to the full feature map.  Bands only write their own rows,
+//  so they can do this at the same time.
+static void markPoints(TraceBand &band, RawImageLabel32 *featImg, int localId, int featId, PointIter begin, PointIter end)
+{
+    for (PointIter it = begin; it != end; ++it)
+        if (band.label(it->x, it->y) == localId)
+            featImg->setLabelShared(it->x, it->y, featId);
+}
+
+// Where the full feature map has something a band's own map doesn't, in blocks of pixels
+#define DirtyBlockSize 16
+
+class DirtyBlocks
+{
+public:
+    DirtyBlocks(int sizeX, int sizeY)
+        : blocksX((sizeX + DirtyBlockSize - 1) / DirtyBlockSize), blocks(blocksX * ((sizeY + DirtyBlockSize - 1) / DirtyBlockSize), 0), rows(sizeY, 0) { }
+
+    inline void mark(int ix, int iy)
+    {
+        blocks[(iy / DirtyBlockSize) * blocksX + ix / DirtyBlockSize] = 1;
+        rows[iy] = 1;
+    }
+    void mark(const Feature &feat)
+    {
+        for (auto &pt : feat.points)
+            mark(pt.x, pt.y);
+    }
+    // Anything in the box, edges included
+    bool any(int minX, int minY, int maxX, int maxY) const
+    {
+        for (int by = minY / DirtyBlockSize; by <= maxY / DirtyBlockSize; by++)
+            for (int bx = minX / DirtyBlockSize; bx <= maxX / DirtyBlockSize; bx++)
+                if (blocks[by * blocksX + bx])
+                    return true;
+        return false;
+    }
+    bool anyRows(int minY, int maxY) const
+    {
+        for (int iy = minY; iy <= maxY; iy++)
+            if (rows[iy])
+                return true;
+        return false;
+    }
+
+    int blocksX;
+    std::vector<char> blocks, rows;
+};
+
+// A pixel to give a new ID
+class Relabel
+{
+public:
+    Relabel(int inX, int inY, int inLabel) { x = inX;  y = inY;  label = inLabel; }
+
+    int x, y, label;
+};
+
+void CannyFindFeaturesParallel(RawImageGray32 *gradImg, RawImageGray8 *thetaImg, int minThresh, int maxThresh, FeaturePool &feats, RawImageLabel32 *featImg,
+                               int numThreads, TraceLimits *limits, const std::vector<int> *seeds)
+{
+    int sizeX = gradImg->getSizeX(), sizeY = gradImg->getSizeY();
+    TraceRegion full = CannyFullTraceRegion(gradImg);
+
+    int numBands = numThreads * ParallelTraceBandsPerThread;
+    int maxBands = (sizeY - 2 * FeatureOffset) / ParallelTraceMinBandRows;
+    if (numBands > maxBands)
+        numBands = maxBands;
+    bool budget = limits && (limits->maxPixels > 0 || limits->maxFeatures > 0 || limits->hasDeadline);
+    if (numThreads <= 1 || numBands < 2 || budget)
+    {
+        CannyFindFeatures(gradImg, thetaImg, minThresh, maxThresh, feats, featImg, limits, seeds);
+        return;
+    }
+    if (numThreads > numBands)
+        numThreads = numBands;
+
+    std::vector<TraceBand> bands(numBands);
+    for (int ii = 0; ii < numBands; ii++)
+    {
+        bands[ii].y0 = (long long)ii * sizeY / numBands;
+        bands[ii].y1 = (long long)(ii + 1) * sizeY / numBands;
+    }
+
+    // Edges are tested as the tracer reaches them, so the bands only read the images
+    CannyEdges edges(gradImg, thetaImg, minThresh, maxThresh);
+
+    // Trace the bands
+    const std::atomic<bool> *cancel = limits ? limits->cancel : NULL;
+    parallelFor(numBands, numThreads, [&](int which) { traceBand(gradImg, thetaImg, minThresh, maxThresh, full, bands[which], seeds, cancel); });
+
+    if (cancel && cancel->load())
+    {
+        limits->stopped = true;
+        return;
+    }
+
+    // Put the pieces off the band edges in the full map under the IDs they'll have if nothing
+    //  crosses between bands.  The ones on the edges get looked at anyway, so they wait.
+    int numPieces = 0;
+    for (auto &band : bands)
+    {
+        band.firstId = numPieces + 1;
+        numPieces += band.feats.size();
+    }
+    parallelFor(numBands, numThreads, [&](int which)
+    {
+        TraceBand &band = bands[which];
+        for (unsigned int ii = 0; ii < band.feats.size(); ii++)
+            if (!band.nearEdge(ii))
+                markPoints(band, featImg, ii + 1, band.firstId + ii, band.feats[ii].points.begin(), band.feats[ii].points.end());
+    });
+    featImg->noteLabel(numPieces);
+
+    // Now go through the pieces in the serial tracer's order.  Most are taken as they are, without
+    //  touching the map.  Only the ones on the edges of their band, or near something written from
+    //  outside it, get looked at: one that walked out of its band is traced on from where it left,
+    //  one that would have run into something its band didn't know about is traced again.
+    DirtyBlocks dirty(sizeX, sizeY);
+    std::vector<char> state(numPieces + 1, PieceWaiting);
+    std::vector<int> order;      // IDs in the order they went into feats
+    std::vector<int> aside;      // Pieces moved out of a serial trace's way
+    unsigned int firstFeat = feats.size();
+    int nextId = numPieces + 1, numPixels = 0;
+    int numTaken = 0, numContinued = 0, numRetraced = 0;
+
+    auto pieceBand = [&](int featId) -> TraceBand &
+    {
+        int which = numBands - 1;
+        while (bands[which].firstId > featId)
+            which--;
+        return bands[which];
+    };
+
+    auto moveAside = [&](int cx, int cy)
+    {
+        bool any = false;
+        for (int iy = cy - 1; iy <= cy + 1; iy++)
+            for (int ix = cx - 1; ix <= cx + 1; ix++)
+            {
+                int label = featImg->getLabel(ix, iy);
+                if (!waiting(state, label))
+                    continue;
+                TraceBand &src = pieceBand(label);
+                ScrubFeature(featImg, src.feats[label - src.firstId], label);
+                state[label] = PieceAside;
+                aside.push_back(label);
+                any = true;
+            }
+        return any;
+    };
+
+    // The ones the trace took a pixel of will be traced from scratch when their turn comes
+    auto putBack = [&]()
+    {
+        for (int featId : aside)
+        {
+            TraceBand &src = pieceBand(featId);
+            int which = featId - src.firstId;
+            Feature &piece = src.feats[which];
+            bool untouched = true;
+            for (auto &pt : piece.points)
+                if (src.label(pt.x, pt.y) == which + 1 && featImg->getLabel(pt.x, pt.y))
+                {
+                    untouched = false;
+                    break;
+                }
+            if (untouched)
+            {
+                markPoints(src, featImg, which + 1, featId, piece.points.begin(), piece.points.end());
+                state[featId] = PieceWaiting;
+            } else {
+                dirty.mark(piece);
+                state[featId] = PieceTakenBack;
+            }
+        }
+        aside.clear();
+    };
+
+    // CannyCanStartFeature, as if the pieces not reached yet weren't there
+    auto canStart = [&](int ix, int iy)
+    {
+        if (!edges.isStrong(ix, iy))
+            return false;
+        int nearCount = 0;
+        for (int ny = iy - 1; ny <= iy + 1; ny++)
+            for (int nx = ix - 1; nx <= ix + 1; nx++)
+            {
+                int label = featImg->getLabel(nx, ny);
+                if (!label || waiting(state, label))
+                    continue;
+                if (nx == ix && ny == iy)
+                    return false;
+                nearCount++;
+            }
+        return nearCount < 2;
+    };
+
+    // Trace a feature the way the serial tracer would
+    auto traceSerial = [&](int featId, int ix, int iy)
+    {
+        Feature &feat = feats.add();
+        int tracedPixels = 0;
+        moveAside(ix, iy);
+        for (;;)
+        {
+            CannyTraceFeature(thetaImg, edges, featImg, featId, full, ix, iy, feat, tracedPixels, NULL);
+            bool moved = false;
+            for (auto &pt : feat.points)
+                moved |= moveAside(pt.x, pt.y);
+            if (!moved)
+                break;
+            ScrubFeature(featImg, feat, featId);
+            feat = Feature();
+        }
+        dirty.mark(feat);
+        putBack();
+        numPixels += tracedPixels;
+        order.push_back(featId);
+        numRetraced++;
+    };
+
+    auto takePiece = [&](TraceBand &src, int which)
+    {
+        Feature &piece = src.feats[which];
+        TraceEnd *ends = &src.ends[2 * which];
+        int localId = which + 1, featId = src.firstId + which;
+        int ix = src.seeds[which] % sizeX, iy = src.seeds[which] / sizeX;
+        state[featId] = PieceReached;
+
+        // A piece that stayed off the edges of its band, away from anything written from outside it,
+        //  saw exactly what the serial tracer would have.  Anything else gets checked.
+        bool nearEdge = src.nearEdge(which);
+        if ((nearEdge || dirty.any(src.minX[which] - 1, src.minY[which] - 1, src.maxX[which] + 1, src.maxY[which] + 1)) &&
+            !sameSurroundings(src, featImg, state, localId, featId, piece.points.begin(), piece.points.end()))
+        {
+            ScrubFeature(featImg, piece, featId);
+            dirty.mark(piece);
+            traceSerial(featId, ix, iy);
+            return;
+        }
+
+        int tracedPixels = src.numPixels[which];
+        bool again = false;
+        if (nearEdge)
+        {
+            // Points before the seed came from the backward trace
+            PointIter seedIt = std::next(piece.points.begin(), ends[0].numPoints);
+            markPoints(src, featImg, localId, featId, seedIt, piece.points.end());
+
+            // Pick up the forward trace where it left the band.  In the serial tracer that happens
+            //  before the backward trace, so if it comes back near that, the backward trace is redone.
+            // Either way, if it looked at a piece that isn't there yet, the whole thing is.
+            if (ends[1].open)
+            {
+                PointIter lastIt = std::prev(piece.points.end());
+                tracedPixels += CannyContinueTrace(thetaImg, edges, featImg, featId, full, piece, false, ends[1]);
+                numContinued++;
+                dirty.mark(piece);
+                again = waitingNear(featImg, state, lastIt, piece.points.end()) ||
+                        !untouchedBy(src, featImg, localId, featId, piece.points.begin(), std::next(seedIt));
+            }
+            if (!again)
+                markPoints(src, featImg, localId, featId, piece.points.begin(), seedIt);
+            if (!again && ends[0].open)
+            {
+                PointIter firstIt = piece.points.begin();
+                tracedPixels += CannyContinueTrace(thetaImg, edges, featImg, featId, full, piece, true, ends[0]);
+                numContinued++;
+                dirty.mark(piece);
+                again = waitingNear(featImg, state, piece.points.begin(), std::next(firstIt));
+            }
+        }
+        if (again)
+        {
+            ScrubFeature(featImg, piece, featId);
+            traceSerial(featId, ix, iy);
+            return;
+        }
+
+        feats.add() = std::move(piece);
+        order.push_back(featId);
+        numPixels += tracedPixels;
+        numTaken++;
+    };
+
+    // A starting pixel in a row where things may have changed
+    auto visitPixel = [&](TraceBand &src, unsigned int &piece, int ix, int iy)
+    {
+        bool started = piece < src.feats.size() && src.seeds[piece] == iy * sizeX + ix;
+        int which = piece, featId = src.firstId + which;
+        if (started)
+            piece++;
+
+        // If nothing around here has changed, the band already decided not to start
+        if (!started && iy > src.y0 && iy < src.y1 - 1 && !dirty.any(ix - 1, iy - 1, ix + 1, iy + 1))
+            return;
+
+        if (canStart(ix, iy))
+        {
+            if (started && state[featId] == PieceWaiting)
+                takePiece(src, which);
+            else
+            {
+                if (started)
+                    state[featId] = PieceReached;
+                else
+                    featId = nextId++;
+                traceSerial(featId, ix, iy);
+            }
+        } else if (started) {
+            // Something from another band got here first
+            if (state[featId] == PieceWaiting)
+                ScrubFeature(featImg, src.feats[which], featId);
+            state[featId] = PieceReached;
+            dirty.mark(src.feats[which]);
+        }
+    };
+
+    for (auto &src : bands)
+    {
+        unsigned int piece = 0;
+        int startY = std::max(src.y0, FeatureOffset), endY = std::min(src.y1, sizeY - FeatureOffset);
+        for (int iy = startY; iy < endY; iy++)
+        {
+            int rowEnd = iy * sizeX + sizeX - FeatureOffset;
+
+            // If nothing around this row has changed, the band already decided where to start
+            int ix = FeatureOffset;
+            bool rowDone = false;
+            while (!rowDone && iy > src.y0 && iy < src.y1 - 1 && !dirty.anyRows(iy - 1, iy + 1))
+            {
+                if (piece < src.feats.size() && src.seeds[piece] < rowEnd)
+                {
+                    ix = src.seeds[piece] % sizeX + 1;
+                    takePiece(src, piece++);
+                } else
+                    rowDone = true;
+            }
+            if (rowDone)
+                continue;
+
+            if (seeds)
+            {
+                std::vector<int>::const_iterator it = std::lower_bound(seeds->begin(), seeds->end(), iy * sizeX + ix);
+                for (; it != seeds->end() && *it < rowEnd; ++it)
+                    visitPixel(src, piece, *it % sizeX, iy);
+            } else {
+                for (; ix < sizeX - FeatureOffset; ix++)
+                    visitPixel(src, piece, ix, iy);
+            }
+        }
+    }
+
+    // A feature crossing into the next band usually takes over the piece traced there, which
+    //  shifts the IDs after it.  Find every pixel to change before changing any, so one
+    //  that's been renumbered can't be mistaken for another feature's.
+    bool renumber = false;
+    for (unsigned int ii = 0; ii < order.size() && !renumber; ii++)
+        renumber = order[ii] != (int)ii + 1;
+    if (renumber)
+    {
+        int numChunks = numBands;
+        std::vector<std::vector<Relabel> > changes(numChunks);
+        parallelFor(numChunks, numThreads, [&](int chunk)
+        {
+            unsigned int end = (unsigned long long)order.size() * (chunk + 1) / numChunks;
+            for (unsigned int ii = (unsigned long long)order.size() * chunk / numChunks; ii < end; ii++)
+                if (order[ii] != (int)ii + 1)
+                    for (auto &pt : feats[firstFeat + ii].points)
+                        if (featImg->getLabel(pt.x, pt.y) == order[ii])
+                            changes[chunk].push_back(Relabel(pt.x, pt.y, ii + 1));
+        });
+        parallelFor(numChunks, numThreads, [&](int chunk)
+        {
+            for (auto &change : changes[chunk])
+                featImg->setLabelShared(change.x, change.y, change.label);
+        });
+    }
+
+    if (limits)
+    {
+        limits->numPixels += numPixels;
+        limits->numFeatures += order.size();
+    }
+
+    logVerbose("Parallel trace: " + std::to_string(numBands) + " bands on " + std::to_string(numThreads) + " threads, " +
+               std::to_string(numTaken) + " pieces taken, " + std::to_string(numContinued) + " ends traced across bands, " +
+               std::to_string(numRetraced) + " features traced again");
+    logVerbose("Total features detected: " + std::to_string(order.size()));
+}
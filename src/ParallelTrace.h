@@ -0,0 +1,44 @@
+/*
+ *  ParallelTrace.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Feature tracing spread over several threads.  The image is cut into
+ *  horizontal bands and each band is traced on its own, then the pieces
+ *  of features that cross from one band to the next are stitched back
+ *  together.
+ */
+
+#ifndef PARALLELTRACE_H
+#define PARALLELTRACE_H
+
+#import <vector>
+#import "CannyDetector.h"
+
+// Bands aren't made smaller than this
+#define ParallelTraceMinBandRows 32
+// More bands than threads keeps the threads busy when the edges are bunched up
+#define ParallelTraceBandsPerThread 2
+
+/* Parallel version of CannyFindFeatures.
+	Each band is traced on its own feature map, just big enough for its rows
+	 and a couple more on each side, starting only from its own pixels and
+	 stopping where a feature walks out of the band.  The tracer records the
+	 pixel it stepped onto there, along with its direction.
+	The pieces off the band edges are copied into featImg in parallel.  Then
+	 they're put together in the serial tracer's order.  A piece that never
+	 came near a band edge or anything written from another band is taken
+	 without being looked at again.  One that walked out is traced on from
+	 the recorded end.  One that would have run into a feature from another
+	 band is traced again.  So the features and featImg come out exactly the
+	 same as the serial tracer's.
+	Experimental.  The stitch is serial and this has only been timed on one core.
+	Falls back to the serial tracer for a single thread, a small image,
+	 or limits with a pixel, feature or time budget (those depend on the
+	 serial order).  The cancel flag in limits is honored.
+ */
+void CannyFindFeaturesParallel(RawImageGray32 *gradImg,RawImageGray8 *thetaImg,int minThresh,int maxThresh,FeaturePool &feats,RawImageLabel32 *featImg,
+							   int numThreads,TraceLimits *limits=NULL,const std::vector<int> *seeds=NULL);
+
+#endif // PARALLELTRACE_H
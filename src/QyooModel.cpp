@@ -10,15 +10,14 @@
 #include <iostream>
 #include <sstream>
 #include <bitset>
+#include <algorithm>
 #include "QyooModel.h"
 
 // Instantiate the singleton
+// Function statics are set up once, even with several threads asking
 QyooModel *QyooModel::getQyooModel()
 {
-	static QyooModel *theModel = NULL;
-
-	if (!theModel)
-		theModel = new QyooModel();
+	static QyooModel *theModel = new QyooModel();
 
 	return theModel;
 }
@@ -43,6 +42,70 @@ QyooModel::QyooModel(int numDotX,int numDotY,float buffer)
 	dotRad = (ur.x-ll.x)/(2.0*numDots);
 
 	addLegacy(00,30,30,30,30,00); // qyoo logo
+
+	buildDistGrid();
+}
+
+// Distance to a segment from the origin along one axis
+static double axisSegDist(double along,double across,double len)
+{
+	double t = along < 0.0 ? 0.0 : (along > len ? len : along);
+	double d = along - t;
+	return sqrt(d*d + across*across);
+}
+
+// Bottom line is (0,0)-(0.5,0), left line is (0,0)-(0,0.5) and
+//  the circle is centered at (0.5,0.5) with radius 0.5, but it
+//  doesn't count in sector III (below and left of the center).
+double QyooModel::outlineDist(double x,double y,bool useCircle)
+{
+	double dist = axisSegDist(x,y,0.5);
+	double leftDist = axisSegDist(y,x,0.5);
+	if (leftDist < dist)  dist = leftDist;
+
+	double cx = x - 0.5, cy = y - 0.5;
+	if (useCircle && (cx > 0 || cy > 0))
+	{
+		double circDist = fabs(sqrt(cx*cx+cy*cy) - 0.5);
+		if (circDist < dist)  dist = circDist;
+	}
+
+	return dist;
+}
+
+// Sample the outline distance over the area features land in
+void QyooModel::buildDistGrid()
+{
+	const double org = -0.5, extent = 2.0;
+	distGridOrg = org;
+	distGridScale = DistGridSize / extent;
+	double cell = extent / DistGridSize;
+	// Distance can only change as fast as we move, so anywhere in a cell
+	//  is within half the diagonal of the center.  Plus a bit for rounding.
+	distGridSlop = cell * sqrt(2.0) / 2.0 + 1e-4;
+
+	distGrid.resize(2*DistGridSize*DistGridSize);
+	for (int iy=0;iy<DistGridSize;iy++)
+	{
+		double y0 = org + iy*cell, y1 = y0 + cell;
+		for (int ix=0;ix<DistGridSize;ix++)
+		{
+			double x0 = org + ix*cell, x1 = x0 + cell;
+			double midX = (x0+x1)/2.0, midY = (y0+y1)/2.0;
+			float *vals = &distGrid[2*(iy*DistGridSize+ix)];
+			// The circle switches on and off at the edges of sector III
+			bool straddle = (x0 <= 0.5 && x1 >= 0.5 && y0 <= 0.5) ||
+							(y0 <= 0.5 && y1 >= 0.5 && x0 <= 0.5);
+			if (straddle)
+			{
+				// The edges always count, the circle might
+				vals[0] = outlineDist(midX,midY,false);
+				double circDist = fabs(sqrt((midX-0.5)*(midX-0.5)+(midY-0.5)*(midY-0.5)) - 0.5);
+				vals[1] = std::min((double)vals[0],circDist);
+			} else
+				vals[0] = vals[1] = outlineDist(midX,midY);
+		}
+	}
 }
 
 // Add a legacy code to our list
@@ -57,6 +57,28 @@ public:
 	int numRows() { return numDotX; }
 	int numPos() { return numDotY; }
 
+	// Distance from a point in model space to the outline: the bottom and
+	//  left edges plus the circle outside of sector III.
+	// This is the same test Feature::pointModelCheck does, the slow way.
+	// Pass useCircle = false to leave out the circle.
+	double outlineDist(double x,double y,bool useCircle=true);
+
+	// Quick version of the outline test using a precomputed distance grid.
+	// Returns 1 if the point is definitely within nearDist of the outline,
+	//  0 if it definitely isn't and -1 if it's too close to call (or off the grid).
+	inline int outlineNear(float x,float y,float nearDist)
+	{
+		float fx = (x - distGridOrg) * distGridScale, fy = (y - distGridOrg) * distGridScale;
+		if (!(fx >= 0.0f && fy >= 0.0f && fx < (float)DistGridSize && fy < (float)DistGridSize))
+			return -1;
+		const float *cell = &distGrid[2 * ((int)fy * DistGridSize + (int)fx)];
+		if (cell[0] + distGridSlop < nearDist)
+			return 1;
+		if (cell[1] - distGridSlop > nearDist)
+			return 0;
+		return -1;
+	}
+
 //public:
 	/* Construct with the number of internal dots and
 	 any buffer we put around them internally.
@@ -71,6 +93,18 @@ public:
 	float buffer;
 	SimplePoint2D ll,ur;  // Lower left and upper right of internal square
 	float dotRad;         // Radius of a single dot
+
+	// Outline distance at the center of each cell, covering model space from
+	//  distGridOrg out to distGridOrg + DistGridSize/distGridScale.
+	// Each cell has two values: one the distance can't be more than and one
+	//  it can't be less than (give or take distGridSlop).  They're the same,
+	//  except in cells on the edge of sector III, where the circle may or may
+	//  not count.  There the first is just the edges, the second includes the circle.
+	static const int DistGridSize = 128;
+	float distGridOrg,distGridScale;
+	float distGridSlop;   // How far the distance can be off anywhere in a cell
+	std::vector<float> distGrid;
+	void buildDistGrid();
 	// These are valid qyoo codes that don't adhere to the newer error checking
 	std::set<unsigned long long> legacyQyoos;
 };
\ No newline at end of file
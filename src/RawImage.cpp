@@ -7,6 +7,7 @@
  *
  */
 
+#include <limits.h>
 #include "RawImage.h"
 
 /**
@@ -48,6 +49,41 @@ gdImagePtr gdFlipImage(gdImagePtr theImage)
     return outImg;
 }
 
+/**
+ * Convert a palette based GD image to true color.
+ * @param theImage The input GD image pointer.  It's destroyed if a copy is made.
+ * @return The true color image, or NULL if it couldn't be created.
+ */
+gdImagePtr gdMakeTrueColor(gdImagePtr theImage)
+{
+    if (gdImageTrueColor(theImage))
+        return theImage;
+
+    gdImagePtr trueColorImg = gdImageCreateTrueColor(gdImageSX(theImage), gdImageSY(theImage));
+    if (trueColorImg)
+        gdImageCopy(trueColorImg, theImage, 0, 0, 0, 0, gdImageSX(theImage), gdImageSY(theImage));
+    gdImageDestroy(theImage);
+
+    return trueColorImg;
+}
+
+/**
+ * Constructor for wrapping existing 8-bit grayscale data.
+ * @param imgData The raw image data.
+ * @param sizeX The width of the image.
+ * @param sizeY The height of the image.
+ * @param isMine If true, we'll free the data when we're done.
+ * @param useFree If true, the data is freed with free() instead of delete[].
+ */
+RawImageGray8::RawImageGray8(void *imgData, int sizeX, int sizeY, bool isMine, bool useFree)
+{
+    this->sizeX = sizeX;
+    this->sizeY = sizeY;
+    this->isMine = isMine;
+    this->useFree = useFree;
+    img = (unsigned char *)imgData;
+}
+
 /**
  * Constructor for creating a grayscale image of 8-bit depth.
  * @param sizeX The width of the image.
@@ -84,44 +120,81 @@ RawImageGray8::~RawImageGray8()
  * @param inImage The input GD image pointer.
  */
 void RawImageGray8::copyFromGDImage(gdImagePtr inImage)
+{
+    unsigned char grayLUT[256];
+    gdImagePtr tmpImg = makeGrayPalette(inImage, sizeX, sizeY, grayLUT);
+
+    for (int iy = 0; iy < sizeY; iy++)
+    {
+        unsigned char *srcRow = tmpImg->pixels[iy], *row = &img[iy * sizeX];
+        for (int ix = 0; ix < sizeX; ix++)
+            row[ix] = grayLUT[srcRow[ix]];
+    }
+
+    gdImageDestroy(tmpImg);
+}
+
+/**
+ * Resample onto a palette of grays and work out the gray value for each index.
+ * Resampling can add colors to the palette, so the index isn't always the gray value.
+ */
+gdImagePtr RawImageGray8::makeGrayPalette(gdImagePtr inImage, int sizeX, int sizeY, unsigned char *grayLUT)
 {
     gdImagePtr tmpImg = gdImageCreate(sizeX, sizeY);
     for (unsigned int ic = 0; ic < 255; ic++)
         gdImageColorAllocate(tmpImg, ic, ic, ic);
     gdImageCopyResampled(tmpImg, inImage, 0, 0, 0, 0, sizeX, sizeY, gdImageSX(inImage), gdImageSY(inImage));
 
-    // Extract grayscale pixel data
-    for (unsigned ix = 0; ix < tmpImg->sx; ix++)
-        for (unsigned int iy = 0; iy < tmpImg->sy; iy++)
-        {
-            int pixVal = gdImageGetPixel(tmpImg, ix, iy);
-            int red = gdImageRed(tmpImg, pixVal);
-            int green = gdImageGreen(tmpImg, pixVal);
-            int blue = gdImageGreen(tmpImg, pixVal);
-            int gray = (red + green + blue) / 3;
-            getPixel(ix, iy) = gdImageRed(tmpImg, gray);
-        }
+    for (unsigned int pixVal = 0; pixVal < 256; pixVal++)
+    {
+        int red = gdImageRed(tmpImg, pixVal);
+        int green = gdImageGreen(tmpImg, pixVal);
+        int blue = gdImageGreen(tmpImg, pixVal);
+        int gray = (red + green + blue) / 3;
+        grayLUT[pixVal] = gdImageRed(tmpImg, gray);
+    }
 
-    gdImageDestroy(tmpImg);
+    return tmpImg;
+}
+
+/**
+ * Work out where each row of this image comes from in the source.
+ * The inverse of mat maps our normalized coordinates back to source pixels.
+ * Returns false if the matrix can't be inverted.
+ */
+bool RawImageGray8::warpRowSetup(const Affine2D &mat, Affine2D &invMat, std::vector<double> &rowX)
+{
+    if (!mat.inverse(invMat))
+        return false;
+
+    rowX.resize(sizeX);
+    for (int ix = 0; ix < sizeX; ix++)
+        rowX[ix] = (float)ix / (float)sizeX;
+
+    return true;
 }
 
 /**
  * Copy pixel data from a GD image using a transformation matrix.
  * @param inImage The input GD image pointer.
- * @param mat The transformation matrix to apply when copying the image.
+ * @param mat The transformation to apply when copying the image.
  */
-void RawImageGray8::copyFromGDImage(gdImagePtr inImage, QyooMatrix &mat)
+void RawImageGray8::copyFromGDImage(gdImagePtr inImage, const Affine2D &mat)
 {
-    QyooMatrix invMat = mat;
-    invMat.inverse();
+    Affine2D invMat;
+    std::vector<double> rowX, rowY(sizeX), srcX(sizeX), srcY(sizeX);
+    if (!warpRowSetup(mat, invMat, rowX))
+        return;
 
-    for (unsigned int ix = 0; ix < sizeX; ix++)
-        for (unsigned int iy = 0; iy < sizeY; iy++)
+    // A row at a time, so the transforms can go in batches
+    for (int iy = 0; iy < sizeY; iy++)
+    {
+        std::fill(rowY.begin(), rowY.end(), (double)((float)iy / (float)sizeY));
+        invMat.transformPoints(&rowX[0], &rowY[0], &srcX[0], &srcY[0], sizeX);
+
+        for (int ix = 0; ix < sizeX; ix++)
         {
-            float ixP = (float)ix / (float)sizeX;
-            float iyP = (float)iy / (float)sizeY;
-            cml::vector3d pt = invMat * cml::vector3d(ixP, iyP, 1.0);
-            int destX = pt[0] + 0.5, destY = pt[1] + 0.5;
+            int destX = srcX[ix] + 0.5, destY = srcY[ix] + 0.5;
 
             if (destX < 0) destX = 0;
             if (destX >= gdImageSX(inImage)) destX = gdImageSX(inImage) - 1;
@@ -131,6 +204,38 @@ void RawImageGray8::copyFromGDImage(gdImagePtr inImage, QyooMatrix &mat)
             int pixVal = gdImageGetPixel(inImage, destX, destY);
             getPixel(ix, iy) = gdImageRed(inImage, pixVal);
         }
+    }
+}
+
+/**
+ * Copy pixel data from another grayscale image using a transformation matrix.
+ * @param inImage The input grayscale image.
+ * @param mat The transformation to apply when copying the image.
+ */
+void RawImageGray8::copyFromImage(RawImageGray8 *inImage, const Affine2D &mat)
+{
+    Affine2D invMat;
+    std::vector<double> rowX, rowY(sizeX), srcX(sizeX), srcY(sizeX);
+    if (!warpRowSetup(mat, invMat, rowX))
+        return;
+
+    for (int iy = 0; iy < sizeY; iy++)
+    {
+        std::fill(rowY.begin(), rowY.end(), (double)((float)iy / (float)sizeY));
+        invMat.transformPoints(&rowX[0], &rowY[0], &srcX[0], &srcY[0], sizeX);
+
+        for (int ix = 0; ix < sizeX; ix++)
+        {
+            int destX = srcX[ix] + 0.5, destY = srcY[ix] + 0.5;
+
+            if (destX < 0) destX = 0;
+            if (destX >= inImage->getSizeX()) destX = inImage->getSizeX() - 1;
+            if (destY < 0) destY = 0;
+            if (destY >= inImage->getSizeY()) destY = inImage->getSizeY() - 1;
+
+            getPixel(ix, iy) = inImage->getPixel(destX, destY);
+        }
+    }
 }
 
 /**
@@ -158,19 +263,40 @@ gdImagePtr RawImageGray8::makeGDImage()
  */
 void RawImageGray8::runContrast()
 {
-    int minPix = 255, maxPix = -1;
+    int hist[256] = {0};
     for (unsigned int ii = 0; ii < totalSize(); ii++)
-    {
-        unsigned char &val = img[ii];
-        if (val < minPix) minPix = val;
-        if (val > maxPix) maxPix = val;
-    }
+        hist[img[ii]]++;
 
-    float scale = 256.0 / (maxPix - minPix);
+    unsigned char lut[256];
+    makeContrastLUT(hist, lut);
     for (unsigned int ii = 0; ii < totalSize(); ii++)
+        img[ii] = lut[img[ii]];
+}
+
+/**
+ * Stretch the values between the lowest and highest ones in the histogram out to 0-255.
+ * A flat image goes to 0.
+ */
+void RawImageGray8::makeContrastLUT(const int *hist, unsigned char *lut)
+{
+    int minPix = 255, maxPix = -1;
+    for (int ii = 0; ii < 256; ii++)
+        if (hist[ii])
+        {
+            if (ii < minPix) minPix = ii;
+            maxPix = ii;
+        }
+
+    float scale = 256.0 / (maxPix - minPix);
+    for (int ii = 0; ii < 256; ii++)
     {
-        int newVal = (img[ii] - minPix) * scale;
-        img[ii] = (newVal > 255) ? 255 : newVal;
+        if (ii < minPix || maxPix <= minPix)
+        {
+            lut[ii] = 0;
+            continue;
+        }
+        int newVal = (ii - minPix) * scale;
+        lut[ii] = (newVal > 255) ? 255 : newVal;
     }
 }
 
@@ -203,20 +329,53 @@ RawImageGray32::RawImageGray32(int sizeX, int sizeY)
 {
     this->sizeX = sizeX;
     this->sizeY = sizeY;
+    isMine = true;
     img = new int[sizeX * sizeY];
     bzero(img, totalSize() * sizeof(int));
 }
 
+/**
+ * Constructor for wrapping existing 32-bit grayscale data.
+ * @param imgData The raw image data.
+ * @param sizeX The width of the image.
+ * @param sizeY The height of the image.
+ * @param isMine If true, we'll delete the data when we're done.
+ */
+RawImageGray32::RawImageGray32(int *imgData, int sizeX, int sizeY, bool isMine)
+{
+    this->sizeX = sizeX;
+    this->sizeY = sizeY;
+    this->isMine = isMine;
+    img = imgData;
+}
+
 /**
  * Destructor for the 32-bit grayscale image.
  * Frees up the allocated memory for the image data.
  */
 RawImageGray32::~RawImageGray32()
 {
-    delete[] img;
+    if (isMine)
+        delete[] img;
     img = NULL;
 }
 
+/**
+ * Start a new label generation.
+ * Labels never go past the number of pixels, so as long as there's room for
+ * that many above what we've used, the next generation just starts there.
+ */
+void RawImageLabel32::clear()
+{
+    if ((long long)base + maxLabel + totalSize() < INT_MAX)
+        base += maxLabel;
+    else {
+        bzero(img, totalSize() * sizeof(int));
+        base = 0;
+    }
+    maxLabel = 0;
+}
+
 /**
  * Create a GD image from the internal 32-bit grayscale image data.
  * @param zeroAlpha Boolean flag to set whether alpha is zero.
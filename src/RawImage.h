@@ -13,11 +13,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
+#include <algorithm>
 #include <gd.h>
-#include <cml/cml.h>
-
-// Typedef for a 3x3 matrix using row_basis layout for transformations.
-typedef cml::matrix<double, cml::fixed<3, 3>, cml::row_basis> QyooMatrix;
+#include "Affine2D.h"
 
 /**
  * Debug routine to save an image as a PNG file.
@@ -33,6 +32,14 @@ void gdSaveAsPng(gdImagePtr theImage, const char *fileName);
  */
 gdImagePtr gdFlipImage(gdImagePtr theImage);
 
+/**
+ * Get a true color version of a GD image.  Palette images are copied into a new
+ * true color image and destroyed.  True color images come back as they are.
+ * @param theImage The input GD image.  Don't use it after this.
+ * @return The true color image, or NULL (with theImage destroyed) if it couldn't be made.
+ */
+gdImagePtr gdMakeTrueColor(gdImagePtr theImage);
+
 /**
  * A class that wraps raw 8-bit grayscale image data.
  */
@@ -102,15 +109,40 @@ public:
     /**
      * Copy data from a GD image using a transformation matrix.
      * @param inImage The source GD image.
-     * @param mat The transformation matrix to apply.
+     * @param mat The transformation to apply.
      */
-    void copyFromGDImage(gdImagePtr inImage, QyooMatrix &mat);
+    void copyFromGDImage(gdImagePtr inImage, const Affine2D &mat);
+
+    /**
+     * Copy data from another grayscale image using a transformation matrix.
+     * Works just like the GD version, for when we don't have the GD image around.
+     * @param inImage The source grayscale image.
+     * @param mat The transformation to apply.
+     */
+    void copyFromImage(RawImageGray8 *inImage, const Affine2D &mat);
 
     /**
      * Apply a simple contrast scaling operation to the image.
      */
     void runContrast();
 
+    /**
+     * Resample a GD image onto a gray palette at the given size, the way copyFromGDImage() does.
+     * The palette image holds palette indices.  grayLUT maps each index to the gray value
+     *  copyFromGDImage() would store for it.
+     * @param inImage The source GD image.
+     * @param grayLUT Filled in with 256 gray values.
+     * @return The palette image.  The caller destroys it.
+     */
+    static gdImagePtr makeGrayPalette(gdImagePtr inImage, int sizeX, int sizeY, unsigned char *grayLUT);
+
+    /**
+     * Build the lookup table runContrast() applies, given a histogram of the pixel values.
+     * @param hist Count of each of the 256 pixel values.
+     * @param lut Filled in with the stretched version of each value.
+     */
+    static void makeContrastLUT(const int *hist, unsigned char *lut);
+
     /**
      * Convert the grayscale image data into a GD image.
      * @return A GD image representing the grayscale data.
@@ -126,6 +158,12 @@ public:
     void printCell(const char *what, int cx, int cy);
 
 protected:
+    /**
+     * Invert a warp matrix and work out the normalized X values for a row.
+     * @return false if the matrix can't be inverted.
+     */
+    bool warpRowSetup(const Affine2D &mat, Affine2D &invMat, std::vector<double> &rowX);
+
     bool isMine;      ///< Indicates if the RawImage class owns the image memory.
     bool useFree;     ///< Indicates whether to use `free` or `delete[]` for memory deallocation.
     int sizeX, sizeY; ///< Dimensions of the image.
@@ -145,6 +183,15 @@ public:
      */
     RawImageGray32(int sizeX, int sizeY);
 
+    /**
+     * Construct a RawImageGray32 around existing image data.
+     * @param imgData The raw image data.
+     * @param sizeX The width of the image.
+     * @param sizeY The height of the image.
+     * @param isMine If true, RawImage is responsible for deleting the memory.
+     */
+    RawImageGray32(int *imgData, int sizeX, int sizeY, bool isMine = true);
+
     /**
      * Destructor to free the allocated memory.
      */
@@ -198,10 +245,77 @@ public:
     void printCell(const char *what, int cx, int cy);
 
 protected:
+    bool isMine;      ///< Indicates if the RawImage class owns the image memory.
     int sizeX, sizeY; ///< Dimensions of the image.
     int *img; ///< Pointer to the raw image data.
 };
 
+/**
+ * RawImageLabel32 class
+ * A 32 bit map of feature labels that can be cleared without touching the pixels.
+ * Each generation stores its labels above every value written in the ones before,
+ * so anything left over from an older generation reads as empty.  When the values
+ * would run out, clear() really does zero the pixels and start again from the bottom.
+ * Go through getLabel() and setLabel(), not getPixel().
+ */
+class RawImageLabel32 : public RawImageGray32
+{
+public:
+    /**
+     * Allocate a blank label map with the given size.
+     * @param sizeX The width of the image.
+     * @param sizeY The height of the image.
+     */
+    RawImageLabel32(int sizeX, int sizeY) : RawImageGray32(sizeX, sizeY) { base = 0;  maxLabel = 0; }
+
+    /**
+     * Construct a label map around existing, zeroed data.
+     * @param imgData The raw image data.
+     * @param sizeX The width of the image.
+     * @param sizeY The height of the image.
+     * @param isMine If true, RawImage is responsible for deleting the memory.
+     */
+    RawImageLabel32(int *imgData, int sizeX, int sizeY, bool isMine = true) : RawImageGray32(imgData, sizeX, sizeY, isMine) { base = 0;  maxLabel = 0; }
+
+    /**
+     * Get the label at a pixel.
+     * @return The label, or 0 if nothing in this generation has marked it.
+     */
+    inline int getLabel(int pixX, int pixY) { return getLabelAt(pixY * sizeX + pixX); }
+
+    /**
+     * Get the label at a pixel index (y * sizeX + x).
+     */
+    inline int getLabelAt(int pixIdx) { int val = img[pixIdx];  return val > base ? val - base : 0; }
+
+    /**
+     * Label a pixel.  A label of 0 clears it.
+     */
+    inline void setLabel(int pixX, int pixY, int label)
+    {
+        img[pixY * sizeX + pixX] = label ? base + label : 0;
+        if (label > maxLabel)
+            maxLabel = label;
+    }
+
+    /**
+     * Label a pixel without keeping track of the biggest label, so threads can
+     * label different pixels at once.  Pass the biggest one to noteLabel() after.
+     */
+    inline void setLabelShared(int pixX, int pixY, int label) { img[pixY * sizeX + pixX] = label ? base + label : 0; }
+    inline void noteLabel(int label) { if (label > maxLabel) maxLabel = label; }
+
+    /**
+     * Start a new generation, leaving every pixel empty.
+     * Usually this doesn't touch the pixels at all.
+     */
+    void clear();
+
+protected:
+    int base;      ///< Stored values at or below this are from older generations.
+    int maxLabel;  ///< Biggest label set in this generation.
+};
+
 /**
  * Helper function to release a buffer.
  * @param info The info parameter for the buffer release.
@@ -0,0 +1,370 @@
+/*
+ *  ResultCache.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ResultCache.h"
+
+static const unsigned long long Prime1 = 11400714785074694791ULL;
+static const unsigned long long Prime2 = 14029467366897019727ULL;
+static const unsigned long long Prime3 = 1609587929392839161ULL;
+static const unsigned long long Prime4 = 9650029242287828579ULL;
+static const unsigned long long Prime5 = 2870177450012600261ULL;
+
+static inline unsigned long long rotl(unsigned long long val, int bits)
+{
+    return (val << bits) | (val >> (64 - bits));
+}
+
+static inline unsigned long long read64(const unsigned char *ptr)
+{
+    unsigned long long val;
+    memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+static inline unsigned int read32(const unsigned char *ptr)
+{
+    unsigned int val;
+    memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+static inline unsigned long long round64(unsigned long long acc, unsigned long long input)
+{
+    acc += input * Prime2;
+    acc = rotl(acc, 31);
+    return acc * Prime1;
+}
+
+static inline unsigned long long mergeRound(unsigned long long acc, unsigned long long val)
+{
+    acc ^= round64(0, val);
+    return acc * Prime1 + Prime4;
+}
+
+unsigned long long ResultCacheHash(const void *data, size_t size, unsigned long long seed)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    const unsigned char *end = ptr + size;
+    unsigned long long hash;
+
+    if (size >= 32)
+    {
+        // Four lanes over 32 byte stripes
+        unsigned long long v1 = seed + Prime1 + Prime2, v2 = seed + Prime2, v3 = seed, v4 = seed - Prime1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = round64(v1, read64(ptr));
+            v2 = round64(v2, read64(ptr + 8));
+            v3 = round64(v3, read64(ptr + 16));
+            v4 = round64(v4, read64(ptr + 24));
+            ptr += 32;
+        } while (ptr <= limit);
+
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = mergeRound(hash, v1);
+        hash = mergeRound(hash, v2);
+        hash = mergeRound(hash, v3);
+        hash = mergeRound(hash, v4);
+    } else
+        hash = seed + Prime5;
+    hash += size;
+
+    // Whatever's left over
+    for (; ptr + 8 <= end; ptr += 8)
+        hash = rotl(hash ^ round64(0, read64(ptr)), 27) * Prime1 + Prime4;
+    if (ptr + 4 <= end)
+    {
+        hash = rotl(hash ^ (read32(ptr) * Prime1), 23) * Prime2 + Prime3;
+        ptr += 4;
+    }
+    for (; ptr < end; ptr++)
+        hash = rotl(hash ^ (*ptr * Prime5), 11) * Prime1;
+
+    // Avalanche
+    hash ^= hash >> 33;
+    hash *= Prime2;
+    hash ^= hash >> 29;
+    hash *= Prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+static long long nowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Build an empty table next to the cache file and rename it over the old one.
+// Anyone who still has the old one mapped keeps it whole until they're done,
+//  where cutting it down in place would pull the pages out from under them.
+// Returns the descriptor for the new file, or -1 with errno set.
+static int makeCacheFile(const std::string &fileName, const ResultCacheHeader &header)
+{
+    std::string tmpName = fileName + ".XXXXXX";
+    int fd = mkstemp(&tmpName[0]);
+    if (fd < 0)
+        return -1;
+
+    // The slots are left as zeros, which is empty
+    if (fchmod(fd, 0644) != 0 ||
+        ftruncate(fd, ResultCacheHeaderSize + header.numSlots * ResultCacheSlotSize) != 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        rename(tmpName.c_str(), fileName.c_str()) != 0)
+    {
+        int err = errno;
+        unlink(tmpName.c_str());
+        ::close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+ResultCache::ResultCache()
+    : numHits(0), numMisses(0), numStored(0), numEvicted(0)
+{
+    seed = 0;
+    numSlots = 0;
+    mapped = NULL;
+    mappedSize = 0;
+    slots = NULL;
+}
+
+ResultCache::~ResultCache()
+{
+    close();
+}
+
+bool ResultCache::open(const std::string &fileName, long long inNumSlots, const DetectionParams &params, bool firstMatch)
+{
+    close();
+
+    // Only what changes the results goes in.  The budget is left out since
+    //  results that ran out of it aren't stored, and so is the thread count.
+    std::ostringstream paramStr;
+    paramStr << ResultCacheVersion << " " << params.gradThresh << " " << params.minThresh << " " << params.maxThresh << " "
+             << params.closedDist << " " << params.decimateDist << " " << params.modelNearDist << " " << params.modelNearFrac << " "
+             << params.adaptive << " " << params.adaptivePercentile << " " << params.adaptiveScale << " " << firstMatch;
+    std::string paramText = paramStr.str();
+    seed = ResultCacheHash(paramText.data(), paramText.size(), 0);
+
+    // Only one process sets the file up
+    int fd;
+    struct stat info, pathInfo;
+    for (;;)
+    {
+        fd = ::open(fileName.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Error: Unable to open cache file: " << fileName << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (flock(fd, LOCK_EX) != 0)
+        {
+            std::cerr << "Error: Unable to lock cache file: " << fileName << ": " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+        // Whoever had the lock before us may have swapped in a new file
+        if (fstat(fd, &info) == 0 && stat(fileName.c_str(), &pathInfo) == 0 &&
+            (info.st_dev != pathInfo.st_dev || info.st_ino != pathInfo.st_ino))
+        {
+            ::close(fd);
+            continue;
+        }
+        break;
+    }
+
+    ResultCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    bool ok = fstat(fd, &info) == 0;
+    bool fresh = ok && info.st_size == 0;
+    if (ok && !fresh)
+    {
+        ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, ResultCacheMagic, sizeof(header.magic)) == 0;
+        if (!ok)
+            std::cerr << "Error: Not a cache file, leaving it alone: " << fileName << std::endl;
+        // One of ours, but laid out differently or cut short.  Start it over.
+        else if (header.version != ResultCacheVersion || header.slotSize != ResultCacheSlotSize || header.numSlots < ResultCacheProbe ||
+                 info.st_size != (off_t)(ResultCacheHeaderSize + header.numSlots * ResultCacheSlotSize))
+            fresh = true;
+    }
+    if (ok && fresh)
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ResultCacheMagic, sizeof(header.magic));
+        header.version = ResultCacheVersion;
+        header.slotSize = ResultCacheSlotSize;
+        header.numSlots = std::max(inNumSlots, (long long)ResultCacheProbe);
+        int newFd = makeCacheFile(fileName, header);
+        if (newFd < 0)
+        {
+            std::cerr << "Error: Unable to set up cache file: " << fileName << ": " << strerror(errno) << std::endl;
+            ok = false;
+        } else {
+            // Anyone waiting on the old one will see it's been replaced
+            flock(fd, LOCK_UN);
+            ::close(fd);
+            fd = newFd;
+        }
+    }
+
+    if (ok)
+    {
+        mappedSize = ResultCacheHeaderSize + header.numSlots * ResultCacheSlotSize;
+        mapped = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            std::cerr << "Error: Unable to map cache file: " << fileName << ": " << strerror(errno) << std::endl;
+            mapped = NULL;
+            ok = false;
+        } else {
+            numSlots = header.numSlots;
+            slots = (ResultCacheSlot *)((char *)mapped + ResultCacheHeaderSize);
+        }
+    }
+
+    // The mapping outlives the descriptor
+    flock(fd, LOCK_UN);
+    ::close(fd);
+
+    return ok;
+}
+
+void ResultCache::close()
+{
+    if (mapped)
+        munmap(mapped, mappedSize);
+    mapped = NULL;
+    mappedSize = 0;
+    slots = NULL;
+    numSlots = 0;
+}
+
+unsigned long long ResultCache::makeKey(const void *data, size_t size, unsigned long long extra) const
+{
+    unsigned long long key = ResultCacheHash(data, size, seed ^ extra);
+    // Zero marks an empty slot
+    return key ? key : 1;
+}
+
+ResultCacheSlot *ResultCache::slotFor(unsigned long long key, int probe)
+{
+    return &slots[(key % numSlots + probe) % numSlots];
+}
+
+// The sequence word
+static inline unsigned int seqCount(unsigned long long seq) { return (unsigned int)seq; }
+static inline unsigned int seqTime(unsigned long long seq) { return (unsigned int)(seq >> 32); }
+static inline unsigned long long makeSeq(unsigned int time, unsigned int count) { return (unsigned long long)time << 32 | count; }
+
+// Catches a copy made while a writer we took the slot over from was still storing into it
+static unsigned long long slotCheck(unsigned long long key, int numFound, const char *text, unsigned int textSize)
+{
+    return ResultCacheHash(text, textSize, key ^ (unsigned int)numFound);
+}
+
+bool ResultCache::lookup(unsigned long long key, ResultCacheEntry &entry)
+{
+    if (!slots)
+        return false;
+
+    for (int probe = 0; probe < ResultCacheProbe; probe++)
+    {
+        ResultCacheSlot *slot = slotFor(key, probe);
+        unsigned long long seq = slot->seq.load(std::memory_order_acquire);
+        if (seqCount(seq) & 1 || slot->key.load(std::memory_order_relaxed) != key)
+            continue;
+
+        int numFound = slot->numFound;
+        unsigned int textSize = std::min(slot->textSize, (unsigned int)sizeof(slot->text));
+        unsigned long long check = slot->check;
+        char text[sizeof(slot->text)];
+        memcpy(text, slot->text, textSize);
+
+        // Only good if nobody wrote to it while we were copying
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != seq || check != slotCheck(key, numFound, text, textSize))
+            continue;
+
+        slot->lastUsed.store(nowMs(), std::memory_order_relaxed);
+        entry.numFound = numFound;
+        entry.text.assign(text, textSize);
+        numHits++;
+        return true;
+    }
+
+    numMisses++;
+    return false;
+}
+
+void ResultCache::store(unsigned long long key, const ResultCacheEntry &entry)
+{
+    if (!slots || entry.text.size() > sizeof(slots->text))
+        return;
+
+    // The same key if it's there, then an empty slot, then the one used longest ago
+    ResultCacheSlot *slot = NULL, *empty = NULL, *oldest = NULL;
+    for (int probe = 0; probe < ResultCacheProbe && !slot; probe++)
+    {
+        ResultCacheSlot *check = slotFor(key, probe);
+        unsigned long long checkKey = check->key.load(std::memory_order_relaxed);
+        if (checkKey == key)
+            slot = check;
+        else if (checkKey == 0 && !empty)
+            empty = check;
+        else if (!oldest || check->lastUsed.load(std::memory_order_relaxed) < oldest->lastUsed.load(std::memory_order_relaxed))
+            oldest = check;
+    }
+    if (!slot)
+        slot = empty ? empty : oldest;
+
+    // Claim it.  If someone else is writing it, let them have it,
+    //  unless they've been at it so long they must have died.
+    long long now = nowMs();
+    unsigned int nowSec = now / 1000;
+    unsigned long long seq = slot->seq.load(std::memory_order_relaxed);
+    unsigned int count = seqCount(seq);
+    if (count & 1 && (int)(nowSec - seqTime(seq)) < ResultCacheStaleSec)
+        return;
+    unsigned int claimedCount = count & 1 ? count + 2 : count + 1;
+    unsigned long long claimed = makeSeq(nowSec, claimedCount);
+    if (!slot->seq.compare_exchange_strong(seq, claimed, std::memory_order_acquire, std::memory_order_relaxed))
+        return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    unsigned long long oldKey = slot->key.load(std::memory_order_relaxed);
+    slot->key.store(key, std::memory_order_relaxed);
+    slot->numFound = entry.numFound;
+    slot->textSize = entry.text.size();
+    memcpy(slot->text, entry.text.data(), entry.text.size());
+    slot->check = slotCheck(key, entry.numFound, entry.text.data(), entry.text.size());
+    slot->lastUsed.store(now, std::memory_order_relaxed);
+
+    // If we were taken over, what we wrote is the new owner's to overwrite
+    if (!slot->seq.compare_exchange_strong(claimed, makeSeq(nowSec, claimedCount + 1), std::memory_order_release, std::memory_order_relaxed))
+        return;
+    if (oldKey != 0 && oldKey != key)
+        numEvicted++;
+    numStored++;
+}
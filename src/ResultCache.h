@@ -0,0 +1,117 @@
+/*
+ *  ResultCache.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Results remembered by the content of the encoded image, so an image
+ *  we've seen before doesn't have to be decoded or detected again.  The
+ *  table is a fixed size file on local disk, mapped into memory, so it
+ *  survives restarts and any number of processes can share it.
+ */
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#import <string>
+#import <atomic>
+#import "FeatureDetector.h"
+
+// XXH64 of the bytes.  Assumes a little endian machine.
+unsigned long long ResultCacheHash(const void *data, size_t size, unsigned long long seed);
+
+/* Layout.  A header page, then numSlots slots of ResultCacheSlotSize bytes.
+	A key hashes to a slot and can live in that one or any of the next
+	 ResultCacheProbe-1.  A new key takes an empty slot in that window, or
+	 failing that the one used longest ago.
+	Each slot has a sequence word: a count in the low 32 bits that's odd
+	 while it's being written, and the time (in seconds) the writer claimed
+	 it in the high 32.  A writer claims a slot by swapping in an odd count
+	 along with the time, and gives it back by swapping in the next even
+	 count, if the word is still the one it put there.  A reader copies the
+	 slot out and only believes the copy if the word was the same, and even,
+	 before and after.
+	A slot left odd for ResultCacheStaleSec is taken over, judging by the
+	 time in the same word it swaps.  The writer it took over from may still
+	 be storing into the slot, so each slot also has a check hash of its
+	 contents, and a reader throws out a copy that doesn't match.
+ */
+#define ResultCacheMagic "QYOOCACH"
+// Bump this when a change to detection changes its results, so old entries don't get used
+#define ResultCacheVersion 2
+#define ResultCacheHeaderSize 4096
+#define ResultCacheSlotSize 512
+#define ResultCacheProbe 8
+#define ResultCacheStaleSec 5
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The cache slots have to work across processes");
+
+class ResultCacheHeader
+{
+public:
+    char magic[8];
+    unsigned int version;
+    unsigned int slotSize;
+    long long numSlots;
+};
+
+class ResultCacheSlot
+{
+public:
+    std::atomic<unsigned long long> seq;    // Claim time << 32 | count
+    std::atomic<unsigned long long> key;    // 0 for empty
+    std::atomic<long long> lastUsed;        // Wall clock ms, for eviction
+    unsigned long long check;               // Hash of the key and the result
+    int numFound;
+    unsigned int textSize;
+    char text[ResultCacheSlotSize - 40];    // Same lines as DetectImage()
+};
+static_assert(sizeof(ResultCacheSlot) == ResultCacheSlotSize, "Cache slots have to pack");
+
+// What's kept for an image
+class ResultCacheEntry
+{
+public:
+    ResultCacheEntry() { numFound = 0; }
+
+    int numFound;
+    std::string text;
+};
+
+/* Result Cache
+	The key covers the image bytes, anything else passed in (like the size of
+	 a raw image) and the detection parameters that change results, so two
+	 servers with different thresholds can share a file without mixing them up.
+	Results that ran out of budget aren't worth keeping, so don't store them.
+	Everything's best effort: a slot someone else is writing is just skipped.
+ */
+class ResultCache
+{
+public:
+    ResultCache();
+    ~ResultCache();
+
+    // Map the cache file, making it if it's not there.  numSlots only matters for a new file.
+    bool open(const std::string &fileName, long long numSlots, const DetectionParams &params, bool firstMatch);
+    void close();
+    bool isOpen() { return slots != NULL; }
+
+    unsigned long long makeKey(const void *data, size_t size, unsigned long long extra = 0) const;
+
+    bool lookup(unsigned long long key, ResultCacheEntry &entry);
+    // Text too long for a slot isn't stored
+    void store(unsigned long long key, const ResultCacheEntry &entry);
+
+    std::atomic<long long> numHits, numMisses, numStored, numEvicted;
+
+protected:
+    ResultCacheSlot *slotFor(unsigned long long key, int probe);
+
+    unsigned long long seed;    // From the parameters
+    long long numSlots;
+    void *mapped;
+    size_t mappedSize;
+    ResultCacheSlot *slots;
+};
+
+#endif // RESULTCACHE_H
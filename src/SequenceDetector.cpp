@@ -0,0 +1,406 @@
+/*
+ *  SequenceDetector.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cmath>
+
+#include "SequenceDetector.h"
+#include "Logger.h"
+
+// Longest header line we'll put up with
+const int Y4MMaxLine = 1024;
+
+FrameReader::FrameReader(FILE *inFp)
+{
+    fp = inFp;
+    isY4M = false;
+    chromaSize = 0;
+    frame = NULL;
+    sizeX = sizeY = 0;
+}
+
+FrameReader::~FrameReader()
+{
+    delete frame;
+}
+
+// Up to (not including) the newline.  False at the end of the file or if it's too long.
+static bool readLine(FILE *fp, std::string &line)
+{
+    line.clear();
+    int ch;
+    while ((ch = fgetc(fp)) != EOF && ch != '\n')
+    {
+        if (line.size() >= (size_t)Y4MMaxLine)
+            return false;
+        line += (char)ch;
+    }
+
+    return ch == '\n';
+}
+
+bool FrameReader::openY4M()
+{
+    std::string line;
+    if (!readLine(fp, line) || line.compare(0, 10, "YUV4MPEG2 ") != 0)
+    {
+        std::cerr << "Error: Not a Y4M stream." << std::endl;
+        return false;
+    }
+
+    std::istringstream tokens(line.substr(10));
+    std::string token, chroma = "420";
+    while (tokens >> token)
+    {
+        if (token[0] == 'W')
+            sizeX = atoi(token.c_str() + 1);
+        else if (token[0] == 'H')
+            sizeY = atoi(token.c_str() + 1);
+        else if (token[0] == 'C')
+            chroma = token.substr(1);
+    }
+    if (sizeX <= 0 || sizeY <= 0)
+    {
+        std::cerr << "Error: Y4M stream has no size." << std::endl;
+        return false;
+    }
+
+    // Planes after the luma.  Only 8 bit, so nothing like 420p10.
+    size_t halfX = (sizeX + 1) / 2, halfY = (sizeY + 1) / 2;
+    bool deep = chroma.find("p1") != std::string::npos;
+    if (!deep && chroma.compare(0, 3, "420") == 0)
+        chromaSize = 2 * halfX * halfY;
+    else if (chroma == "422")
+        chromaSize = 2 * halfX * sizeY;
+    else if (chroma == "411")
+        chromaSize = 2 * ((sizeX + 3) / 4) * (size_t)sizeY;
+    else if (chroma == "444")
+        chromaSize = 2 * (size_t)sizeX * sizeY;
+    else if (chroma == "444alpha")
+        chromaSize = 3 * (size_t)sizeX * sizeY;
+    else if (!deep && chroma == "mono")
+        chromaSize = 0;
+    else
+    {
+        std::cerr << "Error: Unsupported Y4M colorspace: " << chroma << std::endl;
+        return false;
+    }
+
+    isY4M = true;
+    skipBuf.resize(chromaSize);
+    frame = new RawImageGray8(sizeX, sizeY);
+    return true;
+}
+
+bool FrameReader::openRaw(int inSizeX, int inSizeY)
+{
+    if (inSizeX <= 0 || inSizeY <= 0)
+        return false;
+    sizeX = inSizeX;
+    sizeY = inSizeY;
+    isY4M = false;
+    frame = new RawImageGray8(sizeX, sizeY);
+    return true;
+}
+
+RawImageGray8 *FrameReader::nextFrame()
+{
+    if (!frame)
+        return NULL;
+
+    if (isY4M)
+    {
+        std::string line;
+        if (!readLine(fp, line) || line.compare(0, 5, "FRAME") != 0)
+            return NULL;
+    }
+    if (fread(frame->getImgData(), 1, frame->totalSize(), fp) != (size_t)frame->totalSize())
+        return NULL;
+    if (chromaSize > 0 && fread(&skipBuf[0], 1, chromaSize, fp) != chromaSize)
+        return NULL;
+
+    return frame;
+}
+
+SequenceParams::SequenceParams()
+{
+    roiMargin = 0.5f;
+    fullEvery = 30;
+    voteFrames = 5;
+    skipDiff = 4.0f;
+    roiSkipDiff = 1.0f;
+    thumbScale = 8;
+}
+
+SequenceTracker::SequenceTracker(const DetectionParams &inParams, const SequenceParams &inSeqParams)
+{
+    params = inParams;
+    seqParams = inSeqParams;
+    fullProc = NULL;
+    roiProc = NULL;
+    tracking = false;
+    sinceFull = 0;
+    roiSizeX = roiSizeY = 0;
+    numFrames = numSkipped = numROI = numFull = numLost = 0;
+}
+
+SequenceTracker::~SequenceTracker()
+{
+    delete fullProc;
+    delete roiProc;
+}
+
+// Sum each block.  The edge blocks that don't fit are left out.
+// Sums rather than averages, so small changes don't get rounded away.
+void SequenceTracker::makeThumbnail(RawImageGray8 *frame, std::vector<unsigned short> &thumb)
+{
+    int scale = std::min(std::max(seqParams.thumbScale, 1), 16);
+    int thumbX = frame->getSizeX() / scale, thumbY = frame->getSizeY() / scale;
+    thumb.assign(thumbX * thumbY, 0);
+
+    std::vector<int> sums(thumbX);
+    for (int ty = 0; ty < thumbY; ty++)
+    {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int iy = ty * scale; iy < (ty + 1) * scale; iy++)
+        {
+            const unsigned char *row = frame->getImgData() + iy * frame->getSizeX();
+            for (int tx = 0; tx < thumbX; tx++)
+                for (int ix = tx * scale; ix < (tx + 1) * scale; ix++)
+                    sums[tx] += row[ix];
+        }
+        for (int tx = 0; tx < thumbX; tx++)
+            thumb[ty * thumbX + tx] = sums[tx];
+    }
+}
+
+void SequenceTracker::lastBounds(float &minX, float &minY, float &maxX, float &maxY)
+{
+    // The model square is [0,1] both ways
+    minX = minY = 1e9f;
+    maxX = maxY = -1e9f;
+    for (int corner = 0; corner < 4; corner++)
+    {
+        double x, y;
+        lastMat.transform((double)(corner & 1), (double)(corner >> 1), x, y);
+        minX = std::min(minX, (float)x);  maxX = std::max(maxX, (float)x);
+        minY = std::min(minY, (float)y);  maxY = std::max(maxY, (float)y);
+    }
+}
+
+bool SequenceTracker::unchanged(int frameSizeX)
+{
+    if (seqParams.skipDiff <= 0.0f || lastThumb.empty() || thumb.size() != lastThumb.size())
+        return false;
+
+    // The biggest change anywhere, since a small qyoo moving is only a few blocks.
+    // Summing over blocks takes care of most of the sensor noise.
+    int scale = std::min(std::max(seqParams.thumbScale, 1), 16);
+    float blockSize = scale * scale;
+    int diff = 0;
+    for (unsigned int ii = 0; ii < thumb.size(); ii++)
+        diff = std::max(diff, abs((int)thumb[ii] - (int)lastThumb[ii]));
+    if (diff >= seqParams.skipDiff * blockSize)
+        return false;
+
+    // A qyoo we're following can move a little without changing much anywhere,
+    //  so the blocks it covers (and one more all round) get a closer look
+    if (tracking)
+    {
+        int thumbX = frameSizeX / scale, thumbY = thumb.size() / std::max(thumbX, 1);
+        float minX, minY, maxX, maxY;
+        lastBounds(minX, minY, maxX, maxY);
+        int tx0 = std::max((int)floorf(minX / scale) - 1, 0), ty0 = std::max((int)floorf(minY / scale) - 1, 0);
+        int tx1 = std::min((int)ceilf(maxX / scale) + 1, thumbX), ty1 = std::min((int)ceilf(maxY / scale) + 1, thumbY);
+        int roiDiff = 0;
+        for (int ty = ty0; ty < ty1; ty++)
+            for (int tx = tx0; tx < tx1; tx++)
+                roiDiff = std::max(roiDiff, abs((int)thumb[ty * thumbX + tx] - (int)lastThumb[ty * thumbX + tx]));
+        if (roiDiff >= seqParams.roiSkipDiff * blockSize)
+            return false;
+    }
+
+    return true;
+}
+
+bool SequenceTracker::detect(RawImageGray8 *frame, int x0, int y0, int windowSizeX, int windowSizeY, FeatureProcessor *&proc,
+                             Affine2D &mat, std::string &bits)
+{
+    if (!proc)
+    {
+        proc = new FeatureProcessor(windowSizeX, windowSizeY);
+        proc->writeAnnotations = false;
+    }
+    proc->params = params;
+    proc->loadImage(frame, x0, y0, windowSizeX, windowSizeY);
+    proc->processImage();
+    if (proc->findQyoo() == 0)
+        return false;
+
+    // Just the best fitting one
+    Feature *best = NULL;
+    for (auto &feat : proc->feats)
+        if (feat.valid && (!best || feat.modelRatio > best->modelRatio))
+            best = &feat;
+    if (!best)
+        return false;
+
+    // Out of the window and into the frame, so the dots come from the frame
+    best->mat = Affine2D::translate(x0, y0) * best->mat;
+    best->imgSizeX = frame->getSizeX();
+    best->imgSizeY = frame->getSizeY();
+    FeatureDotsProcessor dots(frame, proc, best);
+    dots.findDotsGray();
+    if (best->dotBinStr.empty() || best->dotDecStr.empty())
+        return false;
+
+    mat = best->mat;
+    bits = best->dotBinStr;
+    return true;
+}
+
+// Ties go to the newest read
+std::string SequenceTracker::vote()
+{
+    std::string bits = history.back();
+    for (unsigned int ib = 0; ib < bits.size(); ib++)
+    {
+        int numOnes = 0, numVotes = 0;
+        for (auto &read : history)
+            if (read.size() == bits.size())
+            {
+                numOnes += read[ib] == '1';
+                numVotes++;
+            }
+        if (2 * numOnes != numVotes)
+            bits[ib] = 2 * numOnes > numVotes ? '1' : '0';
+    }
+
+    return bits;
+}
+
+void SequenceTracker::processFrame(RawImageGray8 *frame, SequenceResult &result)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    numFrames++;
+
+    // Nothing's changed, so nothing new to find
+    makeThumbnail(frame, thumb);
+    if (unchanged(frame->getSizeX()))
+    {
+        numSkipped++;
+        result = lastResult;
+        result.search = SequenceSkipped;
+        result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        return;
+    }
+    lastThumb.swap(thumb);
+
+    int sizeX = frame->getSizeX(), sizeY = frame->getSizeY();
+    Affine2D mat;
+    std::string bits;
+    bool found = false;
+    result.search = SequenceFull;
+
+    // Try a window around the last placement
+    if (tracking && ++sinceFull < seqParams.fullEvery)
+    {
+        float minX, minY, maxX, maxY;
+        lastBounds(minX, minY, maxX, maxY);
+        float margin = seqParams.roiMargin * std::max(maxX - minX, maxY - minY);
+
+        // Keep the size we have unless it's too small or a couple of steps too big.
+        // Only the origin follows the qyoo.
+        int needX = (int)ceilf(maxX - minX + 2 * margin), needY = (int)ceilf(maxY - minY + 2 * margin);
+        if (roiSizeX < needX || roiSizeX > needX + 2 * SequenceROIStep)
+            roiSizeX = (needX + SequenceROIStep - 1) / SequenceROIStep * SequenceROIStep;
+        if (roiSizeY < needY || roiSizeY > needY + 2 * SequenceROIStep)
+            roiSizeY = (needY + SequenceROIStep - 1) / SequenceROIStep * SequenceROIStep;
+        int windowX = std::min(roiSizeX, sizeX), windowY = std::min(roiSizeY, sizeY);
+        int x0 = (int)floorf((minX + maxX - windowX) / 2), y0 = (int)floorf((minY + maxY - windowY) / 2);
+        x0 = std::min(std::max(x0, 0), sizeX - windowX);
+        y0 = std::min(std::max(y0, 0), sizeY - windowY);
+
+        // Not worth it if the window is most of the frame anyway
+        if (windowX >= 16 && windowY >= 16 && windowX * windowY < sizeX * sizeY / 2)
+        {
+            result.search = SequenceROI;
+            numROI++;
+            found = detect(frame, x0, y0, windowX, windowY, roiProc, mat, bits);
+            if (!found)
+                numLost++;
+        }
+    }
+
+    // Everywhere, if that didn't work out
+    if (!found)
+    {
+        if (result.search == SequenceROI)
+            logVerbose("Lost the qyoo in its window, searching the whole frame");
+        result.search = SequenceFull;
+        numFull++;
+        sinceFull = 0;
+        found = detect(frame, 0, 0, sizeX, sizeY, fullProc, mat, bits);
+    }
+
+    tracking = found;
+    result.found = found;
+    if (found)
+    {
+        lastMat = mat;
+        history.push_back(bits);
+        while ((int)history.size() > std::max(seqParams.voteFrames, 1))
+            history.pop_front();
+        result.bits = vote();
+        result.value = std::to_string(std::stoull(result.bits, nullptr, 2));
+        Feature placement;
+        placement.mat = mat;
+        placement.getPlacement(result.px, result.py, result.scale, result.rot);
+    } else {
+        // It's gone, so the old reads don't count for whatever shows up next
+        history.clear();
+        result.bits.clear();
+        result.value.clear();
+    }
+
+    result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    lastResult = result;
+}
+
+int RunSequence(FILE *fp, int rawSizeX, int rawSizeY, const DetectionParams &params, const SequenceParams &seqParams)
+{
+    FrameReader reader(fp);
+    if (rawSizeX > 0 ? !reader.openRaw(rawSizeX, rawSizeY) : !reader.openY4M())
+        return 1;
+    logVerbose("Reading " + std::to_string(reader.sizeX) + "x" + std::to_string(reader.sizeY) + " frames");
+
+    static const char *searchNames[] = {"full", "roi", "skipped"};
+    SequenceTracker tracker(params, seqParams);
+    RawImageGray8 *frame;
+    double totalMs = 0.0;
+    while ((frame = reader.nextFrame()))
+    {
+        SequenceResult result;
+        tracker.processFrame(frame, result);
+        totalMs += result.ms;
+
+        std::cout << "frame " << tracker.numFrames - 1 << " (" << searchNames[result.search] << ", " << result.ms << " ms): ";
+        if (result.found)
+            std::cout << result.value << " " << result.bits << " " << result.px << " " << result.py << " "
+                      << result.scale << " " << result.rot << std::endl;
+        else
+            std::cout << "not found" << std::endl;
+    }
+
+    std::cout << tracker.numFrames << " frames, " << tracker.numSkipped << " skipped, " << tracker.numROI << " window searches ("
+              << tracker.numLost << " lost), " << tracker.numFull << " full searches, "
+              << (tracker.numFrames > 0 ? totalMs / tracker.numFrames : 0.0) << " ms per frame" << std::endl;
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ *  SequenceDetector.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Detection on a stream of frames, Y4M or raw 8 bit gray.  The qyoo
+ *  doesn't usually move far from one frame to the next, so once it's
+ *  been found we only look in a window around where it was, with a full
+ *  frame search every so often and whenever it's lost.  Frames that
+ *  haven't changed aren't looked at again, and the bits read from the
+ *  last few frames vote on the code.
+ */
+
+#ifndef SEQUENCEDETECTOR_H
+#define SEQUENCEDETECTOR_H
+
+#import <string>
+#import <vector>
+#import <deque>
+#import "FeatureDetector.h"
+
+/* Frame Reader
+	Pulls the luma plane of each frame out of a Y4M stream (chroma is
+	 skipped), or reads raw frames of a known size back to back.
+ */
+class FrameReader
+{
+public:
+    FrameReader(FILE *fp);
+    ~FrameReader();
+
+    // Read the Y4M stream header.  Returns false if it's not one we can handle.
+    bool openY4M();
+    // Raw 8 bit frames of the given size, no headers
+    bool openRaw(int sizeX, int sizeY);
+
+    // The next frame, good until the next call.  NULL at the end of the stream.
+    RawImageGray8 *nextFrame();
+
+    int sizeX, sizeY;
+
+protected:
+    FILE *fp;
+    bool isY4M;
+    size_t chromaSize;          // Bytes to skip after the luma in each Y4M frame
+    RawImageGray8 *frame;
+    std::vector<unsigned char> skipBuf;
+};
+
+// Knobs for tracking
+class SequenceParams
+{
+public:
+    SequenceParams();
+
+    float roiMargin;    // Window around the last placement on each side, as a fraction of its size
+    int fullEvery;      // Search the whole frame at least this often, in frames processed
+    int voteFrames;     // Reads that vote on each bit
+    float skipDiff;     // Skip a frame if no thumbnail pixel moved this much since the last one (0 never skips)
+    float roiSkipDiff;  // Same, for the thumbnail pixels under the qyoo being tracked
+    int thumbScale;     // Pixels per thumbnail pixel, each way
+};
+
+// Window sizes are rounded up to this, so the window processor keeps its buffers as the qyoo moves
+#define SequenceROIStep 32
+
+// How a frame was handled
+typedef enum {SequenceFull=0,SequenceROI,SequenceSkipped} SequenceSearch;
+
+class SequenceResult
+{
+public:
+    SequenceResult() { search = SequenceFull;  found = false;  px = py = scale = rot = 0.0f;  ms = 0.0; }
+
+    SequenceSearch search;
+    bool found;             // There's a qyoo, read this frame (or the last one, if skipped)
+    std::string bits;       // After voting
+    std::string value;      // Decimal version of bits
+    float px, py, scale, rot;   // Placement in the frame
+    double ms;              // Time spent on the frame
+};
+
+/* Sequence Tracker
+	Feed it frames in order.  It keeps one processor for full frames and
+	 one for windows, so neither has to reallocate for most frames.  The
+	 window keeps its size while it follows the qyoo around, unless the qyoo
+	 gets too big for it or a lot smaller.
+	Only the best fitting qyoo in a frame is tracked.
+ */
+class SequenceTracker
+{
+public:
+    SequenceTracker(const DetectionParams &params, const SequenceParams &seqParams);
+    ~SequenceTracker();
+
+    void processFrame(RawImageGray8 *frame, SequenceResult &result);
+
+    // Counts for the summary
+    int numFrames, numSkipped, numROI, numFull, numLost;
+
+protected:
+    // Look in the given window.  On success the placement and bits are filled in.
+    bool detect(RawImageGray8 *frame, int x0, int y0, int windowSizeX, int windowSizeY, FeatureProcessor *&proc,
+                Affine2D &mat, std::string &bits);
+    // Block sums of the frame
+    void makeThumbnail(RawImageGray8 *frame, std::vector<unsigned short> &thumb);
+    // Little enough changed since the last frame processed to skip this one
+    bool unchanged(int frameSizeX);
+    // Box around the last placement
+    void lastBounds(float &minX, float &minY, float &maxX, float &maxY);
+    // Majority of the recent reads for each bit
+    std::string vote();
+
+    DetectionParams params;
+    SequenceParams seqParams;
+    FeatureProcessor *fullProc, *roiProc;
+
+    bool tracking;                      // Found it last time
+    Affine2D lastMat;                   // Where it was
+    int sinceFull;                      // Frames processed since the last full search
+    int roiSizeX, roiSizeY;             // Current window size
+    std::vector<unsigned short> thumb, lastThumb;
+    std::deque<std::string> history;    // Recent reads, newest last
+    SequenceResult lastResult;
+};
+
+// Run the tracker over a stream, printing a line per frame.
+// rawSizeX/Y are for raw gray input, or 0 for Y4M.
+int RunSequence(FILE *fp, int rawSizeX, int rawSizeY, const DetectionParams &params, const SequenceParams &seqParams);
+
+#endif // SEQUENCEDETECTOR_H
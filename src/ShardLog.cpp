@@ -0,0 +1,462 @@
+/*
+ *  ShardLog.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <algorithm>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "ShardLog.h"
+#include "Logger.h"
+
+static const char *statusNames[] = {"found", "notfound", "failed"};
+
+std::string ShardRecord::toLine() const
+{
+    std::string line = "R\t" + path + "\t" + statusNames[status];
+    for (auto &code : codes)
+        line += "\t" + code;
+    return line;
+}
+
+bool ShardRecord::fromLine(const std::string &line)
+{
+    std::vector<std::string> fields;
+    std::istringstream strm(line);
+    std::string field;
+    while (std::getline(strm, field, '\t'))
+        fields.push_back(field);
+    if (fields.size() < 3 || fields[0] != "R" || fields[1].empty())
+        return false;
+
+    path = fields[1];
+    int ii;
+    for (ii = 0; ii <= ShardFailed; ii++)
+        if (fields[2] == statusNames[ii])
+            break;
+    if (ii > ShardFailed)
+        return false;
+    status = (ShardStatus)ii;
+    codes.assign(fields.begin() + 3, fields.end());
+
+    return true;
+}
+
+// Everything up to the last newline.  Anything after it is a record that didn't get finished.
+static bool readLog(int fd, std::string &text, size_t &fileSize)
+{
+    text.clear();
+    char buf[65536];
+    ssize_t num;
+    while ((num = read(fd, buf, sizeof(buf))) > 0)
+        text.append(buf, num);
+    if (num < 0)
+        return false;
+
+    fileSize = text.size();
+    size_t lastLine = text.rfind('\n');
+    text.resize(lastLine == std::string::npos ? 0 : lastLine + 1);
+    return true;
+}
+
+ShardLog::ShardLog()
+{
+    fp = NULL;
+    checkpointEvery = 100;
+    checkpointSec = 10.0;
+    numLoaded = 0;
+    numAppended = 0;
+    failed = false;
+    sinceCheckpoint = 0;
+}
+
+ShardLog::~ShardLog()
+{
+    close();
+}
+
+bool ShardLog::open(const std::string &inFileName, int shardIndex, int numShards)
+{
+    fileName = inFileName;
+    int fd = ::open(fileName.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "Error: Unable to open shard log " << fileName << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        std::cerr << "Error: Shard log " << fileName << " is in use by another run" << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    std::string text;
+    size_t fileSize;
+    if (!readLog(fd, text, fileSize))
+    {
+        std::cerr << "Error: Unable to read shard log " << fileName << ": " << strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+    if (text.size() < fileSize)
+    {
+        std::cerr << "Warning: Dropping an unfinished record at the end of " << fileName << std::endl;
+        if (ftruncate(fd, text.size()) < 0)
+        {
+            std::cerr << "Error: Unable to truncate shard log " << fileName << ": " << strerror(errno) << std::endl;
+            ::close(fd);
+            return false;
+        }
+    }
+
+    std::string header = std::string(ShardLogHeader) + " " + std::to_string(shardIndex) + "/" + std::to_string(numShards);
+    std::istringstream lines(text);
+    std::string line;
+    if (std::getline(lines, line) && line != header)
+    {
+        std::cerr << "Error: Shard log " << fileName << " starts with \"" << line << "\", not \"" << header << "\"" << std::endl;
+        ::close(fd);
+        return false;
+    }
+
+    done.clear();
+    numLoaded = 0;
+    ShardRecord rec;
+    while (std::getline(lines, line))
+        if (rec.fromLine(line))
+        {
+            numLoaded++;
+            if (rec.status != ShardFailed)
+                done.insert(rec.path);
+        }
+
+    fp = fdopen(fd, "a");
+    if (!fp)
+    {
+        ::close(fd);
+        return false;
+    }
+    failed = false;
+    if (text.empty() && fprintf(fp, "%s\n", header.c_str()) < 0)
+    {
+        std::cerr << "Error: Unable to write shard log " << fileName << ": " << strerror(errno) << std::endl;
+        failed = true;
+        close();
+        return false;
+    }
+
+    numAppended = 0;
+    sinceCheckpoint = 0;
+    lastCheckpoint = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool ShardLog::close()
+{
+    if (!fp)
+        return !failed;
+    if (sinceCheckpoint > 0 && !failed)
+        checkpoint();
+    // Closing drops the lock
+    if (fclose(fp) != 0 && !failed)
+    {
+        std::cerr << "Error: Unable to close shard log " << fileName << ": " << strerror(errno) << std::endl;
+        failed = true;
+    }
+    fp = NULL;
+    return !failed;
+}
+
+bool ShardLog::append(const ShardRecord &rec)
+{
+    if (failed)
+        return false;
+    if (fprintf(fp, "%s\n", rec.toLine().c_str()) < 0)
+    {
+        std::cerr << "Error: Unable to write shard log " << fileName << ": " << strerror(errno) << std::endl;
+        failed = true;
+        return false;
+    }
+    numAppended++;
+    sinceCheckpoint++;
+    if (rec.status != ShardFailed)
+        done.insert(rec.path);
+
+    double sinceMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lastCheckpoint).count();
+    if (sinceCheckpoint >= checkpointEvery || sinceMs >= 1000.0 * checkpointSec)
+        return checkpoint();
+    return true;
+}
+
+bool ShardLog::checkpoint()
+{
+    if (failed)
+        return false;
+
+    // The records have to be on disk before the mark that says they are
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = ok && fprintf(fp, "C\t%d\t%lld\n", numLoaded + numAppended, (long long)time(NULL)) > 0;
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (!ok)
+    {
+        std::cerr << "Error: Unable to write shard log " << fileName << ": " << strerror(errno) << std::endl;
+        failed = true;
+        return false;
+    }
+
+    sinceCheckpoint = 0;
+    lastCheckpoint = std::chrono::steady_clock::now();
+    logVerbose("Checkpoint: " + std::to_string(numLoaded + numAppended) + " records in " + fileName);
+    return ok;
+}
+
+void ShardPipeline::reportItem(BatchItem *item)
+{
+    if (!log)
+    {
+        BatchPipeline::reportItem(item);
+        return;
+    }
+
+    ShardRecord rec;
+    rec.path = item->fileName;
+    if (!item->error.empty())
+    {
+        std::cerr << "Error: " << item->error << ": " << item->fileName << std::endl;
+        rec.status = ShardFailed;
+    } else if (item->numFound == 0)
+        rec.status = ShardNotFound;
+    else
+    {
+        rec.status = ShardFound;
+        std::istringstream lines(item->resultText);
+        std::string line;
+        while (std::getline(lines, line))
+            rec.codes.push_back(line);
+    }
+    if (item->budgetExceeded)
+        std::cerr << "Warning: Detection budget exceeded, results may be incomplete: " << item->fileName << std::endl;
+
+    // Whatever's under way still gets reported, but there's no point starting more
+    if (!log->append(rec))
+        abandon();
+}
+
+bool ReadManifest(const std::string &fileName, std::vector<std::string> &paths)
+{
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        std::cerr << "Error: Unable to open manifest: " << fileName << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(file, line))
+    {
+        lineNum++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        // Tabs would break the log
+        if (line.find('\t') != std::string::npos)
+        {
+            std::cerr << "Warning: Skipping manifest line " << lineNum << ", paths can't have tabs" << std::endl;
+            continue;
+        }
+        paths.push_back(line);
+    }
+
+    return true;
+}
+
+bool ParseShard(const std::string &spec, int &shardIndex, int &numShards)
+{
+    char extra;
+    return sscanf(spec.c_str(), "%d/%d%c", &shardIndex, &numShards, &extra) == 2 && numShards > 0 &&
+           shardIndex >= 0 && shardIndex < numShards;
+}
+
+// FNV-1a, so every machine agrees
+int ShardOf(const std::string &path, int numShards)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned char ch : path)
+    {
+        hash ^= ch;
+        hash *= 1099511628211ULL;
+    }
+    return (int)(hash % (unsigned long long)numShards);
+}
+
+std::string ShardLogName(const std::string &manifest, int shardIndex, int numShards)
+{
+    return manifest + ".shard" + std::to_string(shardIndex) + "-of-" + std::to_string(numShards) + ".log";
+}
+
+int RunShard(ShardPipeline &pipeline, const std::string &manifest, int shardIndex, int numShards, const std::string &logName)
+{
+    std::vector<std::string> paths;
+    if (!ReadManifest(manifest, paths))
+        return 1;
+
+    ShardLog log;
+    if (pipeline.syncEvery > 0)
+        log.checkpointEvery = pipeline.syncEvery;
+    if (!log.open(logName, shardIndex, numShards))
+        return 1;
+
+    // Ours, not done yet, and only once each
+    std::vector<std::string> todo;
+    std::unordered_set<std::string> seen;
+    int numInShard = 0;
+    for (auto &path : paths)
+        if (ShardOf(path, numShards) == shardIndex && seen.insert(path).second)
+        {
+            numInShard++;
+            if (!log.isDone(path))
+                todo.push_back(path);
+        }
+    std::cerr << "Shard " << shardIndex << "/" << numShards << ": " << numInShard << " of " << paths.size()
+              << " manifest entries, " << numInShard - todo.size() << " already done" << std::endl;
+
+    pipeline.log = &log;
+    bool ok = pipeline.run(todo);
+    pipeline.log = NULL;
+    bool logOk = log.close();
+    pipeline.printStats();
+
+    if (!logOk)
+    {
+        std::cerr << "Stopped because the shard log couldn't be written, run again once it can be to pick up what's missing" << std::endl;
+        return 1;
+    }
+
+    if (pipeline.numImages < (int)todo.size())
+    {
+        std::cerr << "Stopped with " << todo.size() - pipeline.numImages << " left, run again to pick up from there" << std::endl;
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
+
+int MergeShardLogs(const std::vector<std::string> &logNames, const std::string &manifest, const std::string &outName)
+{
+    std::unordered_map<std::string, ShardRecord> records;
+    int numRecords = 0, numConflicts = 0;
+    for (auto &logName : logNames)
+    {
+        int fd = ::open(logName.c_str(), O_RDONLY);
+        std::string text;
+        size_t fileSize;
+        if (fd < 0 || !readLog(fd, text, fileSize))
+        {
+            std::cerr << "Error: Unable to read shard log: " << logName << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            return 1;
+        }
+        ::close(fd);
+        if (text.compare(0, strlen(ShardLogHeader), ShardLogHeader) != 0 &&
+            text.compare(0, strlen(ShardLogMergedHeader), ShardLogMergedHeader) != 0)
+        {
+            std::cerr << "Error: Not a shard log: " << logName << std::endl;
+            return 1;
+        }
+
+        std::istringstream lines(text);
+        std::string line;
+        ShardRecord rec;
+        while (std::getline(lines, line))
+        {
+            if (!rec.fromLine(line))
+                continue;
+            numRecords++;
+            auto it = records.find(rec.path);
+            if (it == records.end())
+                records[rec.path] = rec;
+            else if (rec.status != ShardFailed)
+            {
+                if (it->second.status != ShardFailed && (it->second.status != rec.status || it->second.codes != rec.codes))
+                    numConflicts++;
+                it->second = rec;
+            }
+        }
+    }
+
+    // Manifest order, or by path
+    std::vector<std::string> order;
+    int numMissing = 0, numExtra = 0;
+    if (!manifest.empty())
+    {
+        std::vector<std::string> paths;
+        if (!ReadManifest(manifest, paths))
+            return 1;
+        std::unordered_set<std::string> seen;
+        for (auto &path : paths)
+            if (seen.insert(path).second)
+            {
+                if (records.count(path))
+                    order.push_back(path);
+                else
+                    numMissing++;
+            }
+        for (auto &it : records)
+            if (!seen.count(it.first))
+                numExtra++;
+    } else {
+        for (auto &it : records)
+            order.push_back(it.first);
+        std::sort(order.begin(), order.end());
+    }
+
+    FILE *out = outName == "-" ? stdout : fopen(outName.c_str(), "w");
+    if (!out)
+    {
+        std::cerr << "Error: Unable to open merge output " << outName << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    int numStatus[ShardFailed+1] = {0};
+    fprintf(out, "%s\n", ShardLogMergedHeader);
+    for (auto &path : order)
+    {
+        const ShardRecord &rec = records[path];
+        numStatus[rec.status]++;
+        fprintf(out, "%s\n", rec.toLine().c_str());
+    }
+    bool ok = fflush(out) == 0;
+    if (out != stdout)
+        ok = fclose(out) == 0 && ok;
+    if (!ok)
+    {
+        std::cerr << "Error: Unable to write merge output " << outName << std::endl;
+        return 1;
+    }
+
+    std::cerr << "Merged " << logNames.size() << " logs, " << numRecords << " records: " << order.size() << " images, "
+              << numStatus[ShardFound] << " found, " << numStatus[ShardNotFound] << " not found, " << numStatus[ShardFailed]
+              << " failed" << std::endl;
+    if (numConflicts > 0)
+        std::cerr << "Warning: " << numConflicts << " images had different results in different records, kept the last" << std::endl;
+    if (numExtra > 0)
+        std::cerr << "Warning: Left out " << numExtra << " images that aren't in the manifest" << std::endl;
+    if (numMissing > 0)
+        std::cerr << "Missing " << numMissing << " manifest entries" << std::endl;
+
+    return numMissing > 0 ? 1 : 0;
+}
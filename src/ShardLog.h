@@ -0,0 +1,126 @@
+/*
+ *  ShardLog.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Big batch runs split over several processes or machines.  Each one
+ *  takes a shard of a manifest (a list of image paths) and appends what
+ *  it finds to its own log.  A run that gets killed picks up where its
+ *  log leaves off, and the logs are merged once every shard is done.
+ */
+
+#ifndef SHARDLOG_H
+#define SHARDLOG_H
+
+#import <string>
+#import <vector>
+#import <unordered_set>
+#import <chrono>
+#import "BatchPipeline.h"
+
+/* Log format.  Text, one record per line, tab separated:
+	 #qyoo-shard <k>/<N>                    first line, so a log can't be resumed as the wrong shard
+	 R <path> <status> [<code>...]          status is found, notfound or failed, a code is
+	                                         "<value> <bits> <x> <y> <scale> <rotation>"
+	 C <records> <unix time>                checkpoint: everything before it has been synced to disk
+	Lines are only ever appended.  A line without its newline is from a
+	 run that died while writing it and is dropped on resume.
+ */
+#define ShardLogHeader "#qyoo-shard"
+#define ShardLogMergedHeader "#qyoo-merged"
+
+typedef enum {ShardFound=0,ShardNotFound,ShardFailed} ShardStatus;
+
+class ShardRecord
+{
+public:
+    ShardRecord() { status = ShardFailed; }
+
+    std::string toLine() const;
+    // False if it's not a record line
+    bool fromLine(const std::string &line);
+
+    std::string path;
+    ShardStatus status;
+    std::vector<std::string> codes;
+};
+
+/* Shard Log
+	Opening a log locks it, so two runs can't write the same shard.  The
+	 lock is flock(), which NFS may or may not honor.
+	Failed records don't count as done, so a resumed run tries them again.
+	Once a write fails, nothing more is written (not even a checkpoint,
+	 which could land after half a record) and everything returns false.
+ */
+class ShardLog
+{
+public:
+    ShardLog();
+    ~ShardLog();
+
+    // Open for appending, creating it if need be, and load the records already there
+    bool open(const std::string &fileName, int shardIndex, int numShards);
+    // False if anything failed to make it to disk
+    bool close();
+
+    bool isDone(const std::string &path) const { return done.count(path) > 0; }
+    // Checkpoints on its own every so often
+    bool append(const ShardRecord &rec);
+    // Flush, sync and mark it
+    bool checkpoint();
+
+    int checkpointEvery;        // Records between checkpoints
+    double checkpointSec;       // Or this long, whichever comes first
+    int numLoaded;              // Records that were there when we opened it
+    int numAppended;
+    bool failed;                // A write failed
+
+protected:
+    std::string fileName;
+    FILE *fp;
+    std::unordered_set<std::string> done;
+    int sinceCheckpoint;
+    std::chrono::steady_clock::time_point lastCheckpoint;
+};
+
+// Batch pipeline that writes its results to a shard log instead of stdout
+class ShardPipeline : public BatchPipeline
+{
+public:
+    ShardPipeline() { log = NULL;  syncEvery = 0; }
+
+    ShardLog *log;
+    int syncEvery;              // Records between log checkpoints, 0 for the log's own default
+
+protected:
+    virtual void reportItem(BatchItem *item);
+};
+
+// One path per line.  Blank lines and lines starting with # are skipped.
+bool ReadManifest(const std::string &fileName, std::vector<std::string> &paths);
+
+// "k/N", with 0 <= k < N
+bool ParseShard(const std::string &spec, int &shardIndex, int &numShards);
+
+// Which shard a path goes to.  It only depends on the path, so the shards don't
+//  change if the manifest is reordered or added to.
+int ShardOf(const std::string &path, int numShards);
+
+// Default log name for a shard of a manifest
+std::string ShardLogName(const std::string &manifest, int shardIndex, int numShards);
+
+/* Run this process's shard of the manifest through the pipeline, skipping
+	whatever the log says is done.  Returns 0 if the whole shard is done
+	 without failures.
+ */
+int RunShard(ShardPipeline &pipeline, const std::string &manifest, int shardIndex, int numShards, const std::string &logName);
+
+/* Combine shard logs into one, in manifest order if there is a manifest
+	(and sorted by path if not).  Later records win, except that a failure
+	 never replaces a success.  Returns 0 if nothing in the manifest is missing.
+	outName can be "-" for stdout.
+ */
+int MergeShardLogs(const std::vector<std::string> &logNames, const std::string &manifest, const std::string &outName);
+
+#endif // SHARDLOG_H
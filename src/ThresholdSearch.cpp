@@ -0,0 +1,238 @@
+/*
+ *  ThresholdSearch.cpp
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "ThresholdSearch.h"
+#include "Logger.h"
+
+// Parse grad,min,max:grad,min,max
+bool ParseThresholdConfigs(const std::string &str, std::vector<ThresholdConfig> &configs)
+{
+    configs.clear();
+
+    std::stringstream strStrm(str);
+    std::string item;
+    while (std::getline(strStrm, item, ':'))
+    {
+        ThresholdConfig config;
+        char extra;
+        if (sscanf(item.c_str(), "%d,%d,%d%c", &config.gradThresh, &config.minThresh, &config.maxThresh, &extra) != 3)
+            return false;
+        configs.push_back(config);
+    }
+
+    return !configs.empty();
+}
+
+// The normal thresholds come first
+void DefaultThresholdConfigs(std::vector<ThresholdConfig> &configs)
+{
+    DetectionParams params;
+
+    configs.clear();
+    configs.push_back(ThresholdConfig(params.gradThresh, params.minThresh, params.maxThresh));
+    configs.push_back(ThresholdConfig(120, 20, 120));
+    configs.push_back(ThresholdConfig(30, 5, 30));
+    configs.push_back(ThresholdConfig(200, 40, 200));
+}
+
+// Everything one configuration produces
+class SearchTask
+{
+public:
+    SearchTask() : cancel(false) { thetaImg = NULL;  featImg = NULL;  numFound = 0;  cancelled = false;  budgetExceeded = false; }
+    ~SearchTask() { delete thetaImg;  delete featImg; }
+
+    RawImageGray8 *thetaImg;    // Our own angles, if we needed a different suppression threshold
+    RawImageLabel32 *featImg;
+    std::vector<int> seeds;     // Thin pixels in our own angles
+    FeaturePool feats;
+    int numFound;
+    bool cancelled;
+    bool budgetExceeded;        // Ran out of the work budget, so there may be more
+    std::atomic<bool> cancel;   // Set once something earlier in the list has won
+};
+
+ThresholdSearch::ThresholdSearch(FeatureProcessor *inProc)
+{
+    proc = inProc;
+    maxThreads = 0;
+    winner = -1;
+    numRun = 0;
+    numCancelled = 0;
+    DefaultThresholdConfigs(configs);
+}
+
+// Run a single configuration.  Stops early if one earlier in the list already won.
+// The deadline is for the whole search, the same as it would be for findQyoo().
+static void runConfig(FeatureProcessor *proc, const ThresholdConfig &config, SearchTask &task,
+                      std::chrono::steady_clock::time_point deadline)
+{
+    const DetectionParams &params = proc->params;
+
+    // Use the processor's angles if they were suppressed with the same threshold.
+    // Tracing only reads them, so everyone can share.
+    RawImageGray8 *thetaImg = proc->thetaImg;
+    const std::vector<int> *seeds = proc->thinSeeds;
+    if (config.gradThresh != proc->params.gradThresh)
+    {
+        if (proc->rawThetaImg)
+        {
+            task.thetaImg = new RawImageGray8(proc->sizeX, proc->sizeY);
+            memcpy(task.thetaImg->getImgData(), proc->rawThetaImg->getImgData(), task.thetaImg->totalSize());
+            CannyNonMaxSupress(proc->gradImg, task.thetaImg, config.gradThresh, &task.seeds);
+            thetaImg = task.thetaImg;
+            seeds = &task.seeds;
+        } else
+            logVerbose("No raw angles, using suppression threshold " + std::to_string(proc->params.gradThresh));
+    }
+
+    // Each configuration gets the full pixel and feature budget
+    TraceLimits limits;
+    limits.cancel = &task.cancel;
+    limits.maxPixels = params.maxTracePixels;
+    limits.maxFeatures = params.maxFeatures;
+    if (params.deadlineMs > 0.0)
+        limits.setDeadline(deadline);
+    task.featImg = new RawImageLabel32(proc->sizeX, proc->sizeY);
+    CannyFindFeatures(proc->gradImg, thetaImg, config.minThresh, config.maxThresh, task.feats, task.featImg, &limits, seeds);
+    if (limits.stopped && !limits.budgetExceeded)
+    {
+        task.cancelled = true;
+        return;
+    }
+    task.budgetExceeded = limits.budgetExceeded;
+
+    // Validation gets its own time limit, on top of the overall deadline
+    auto validateEnd = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(params.maxValidateMs));
+    if (params.deadlineMs > 0.0 && (params.maxValidateMs <= 0.0 || deadline < validateEnd))
+        validateEnd = deadline;
+    bool validateTimeLimit = params.deadlineMs > 0.0 || params.maxValidateMs > 0.0;
+
+    DetectionParams checkParams = params;
+    checkParams.gradThresh = config.gradThresh;
+    checkParams.minThresh = config.minThresh;
+    checkParams.maxThresh = config.maxThresh;
+    for (unsigned int ii = 0; ii < task.feats.size(); ii++)
+    {
+        bool outOfTime = validateTimeLimit && std::chrono::steady_clock::now() >= validateEnd;
+        if (task.cancel.load(std::memory_order_relaxed) || outOfTime)
+        {
+            // Nobody may look at these, but they shouldn't claim to be valid
+            for (unsigned int jj = ii; jj < task.feats.size(); jj++)
+                task.feats[jj].valid = false;
+            if (outOfTime)
+                task.budgetExceeded = true;
+            else
+                task.cancelled = true;
+            return;
+        }
+        if (proc->validateFeature(task.feats[ii], checkParams))
+            task.numFound++;
+    }
+}
+
+// Work through the configurations on a few threads
+int ThresholdSearch::run()
+{
+    winner = -1;
+    numRun = 0;
+    numCancelled = 0;
+    proc->status = DetectComplete;
+    if (configs.empty() || !proc->gradImg || !proc->thetaImg)
+        return 0;
+
+    int numThreads = maxThreads;
+    if (numThreads <= 0)
+        numThreads = std::thread::hardware_concurrency();
+    if (numThreads <= 0)
+        numThreads = 1;
+    if (numThreads > (int)configs.size())
+        numThreads = configs.size();
+
+    int numConfigs = configs.size();
+    std::vector<SearchTask> tasks(numConfigs);
+    std::atomic<int> nextConfig(0);
+    std::atomic<int> winningConfig(numConfigs);   // numConfigs until someone wins
+    std::atomic<int> started(0);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(proc->params.deadlineMs));
+
+    auto worker = [&]()
+    {
+        int which;
+        while ((which = nextConfig.fetch_add(1)) < numConfigs && which < winningConfig.load())
+        {
+            started++;
+            runConfig(proc, configs[which], tasks[which], deadline);
+            if (tasks[which].numFound == 0)
+                continue;
+
+            // The earliest in the list with a valid qyoo wins, whichever finishes first.
+            // The ones after it can't win any more, so they stop.  The ones before it carry on.
+            int best = winningConfig.load();
+            while (which < best && !winningConfig.compare_exchange_weak(best, which))
+                ;
+            for (int later = which + 1; later < numConfigs; later++)
+                tasks[later].cancel.store(true);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int ii = 1; ii < numThreads; ii++)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+
+    numRun = started;
+    bool anyBudgetExceeded = false;
+    for (auto &task : tasks)
+    {
+        if (task.cancelled)
+            numCancelled++;
+        if (task.budgetExceeded)
+            anyBudgetExceeded = true;
+    }
+    winner = winningConfig < numConfigs ? winningConfig.load() : -1;
+
+    // Without a winner, a configuration that was cut short might have been one
+    if (winner >= 0 ? tasks[winner].budgetExceeded : anyBudgetExceeded)
+        proc->status = DetectBudgetExceeded;
+
+    if (winner < 0)
+    {
+        logVerbose("Threshold search: none of " + std::to_string(configs.size()) + " configurations found a qyoo");
+        return 0;
+    }
+
+    const ThresholdConfig &config = configs[winner];
+    logVerbose("Threshold search: configuration " + std::to_string(winner) + " (" +
+               std::to_string(config.gradThresh) + "," + std::to_string(config.minThresh) + "," +
+               std::to_string(config.maxThresh) + ") won, " + std::to_string(numRun) + " started, " +
+               std::to_string(numCancelled) + " cancelled");
+
+    // Hand the winner's results over to the processor
+    SearchTask &task = tasks[winner];
+    proc->takeFeatures(task.feats, task.thetaImg, task.featImg);
+    task.thetaImg = NULL;
+    task.featImg = NULL;
+    proc->params.gradThresh = config.gradThresh;
+    proc->params.minThresh = config.minThresh;
+    proc->params.maxThresh = config.maxThresh;
+
+    return proc->numFound;
+}
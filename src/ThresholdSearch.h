@@ -0,0 +1,76 @@
+/*
+ *  ThresholdSearch.h
+ *  ShapeFinder
+ *
+ *  Copyright 2009 Qyoo. All rights reserved.
+ *
+ *  Runs detection with several sets of thresholds at once, sharing the
+ *  gradient from a single front end pass.  The first set in order of
+ *  preference to come up with a valid qyoo wins.
+ */
+
+#ifndef THRESHOLDSEARCH_H
+#define THRESHOLDSEARCH_H
+
+#import <string>
+#import <vector>
+#import "FeatureDetector.h"
+
+// One set of thresholds to try
+class ThresholdConfig
+{
+public:
+    ThresholdConfig() { gradThresh = 60;  minThresh = 10;  maxThresh = 60; }
+    ThresholdConfig(int grad, int min, int max) { gradThresh = grad;  minThresh = min;  maxThresh = max; }
+
+    int gradThresh;   // Non-max suppression threshold
+    int minThresh;    // Tracing low threshold
+    int maxThresh;    // Tracing high threshold
+};
+
+// Parse a list of configurations in the form "grad,min,max:grad,min,max:..."
+// Returns false if it doesn't make sense
+bool ParseThresholdConfigs(const std::string &str, std::vector<ThresholdConfig> &configs);
+
+// The set we try if we're not told otherwise.
+// The normal thresholds, then higher ones for noisy images and lower ones for flat images.
+void DefaultThresholdConfigs(std::vector<ThresholdConfig> &configs);
+
+/* Threshold Search
+	Runs a portfolio of threshold configurations on a processor that's
+	already been through processImage().  Each configuration does its own
+	non-max suppression, tracing and validation on a private copy of the
+	angles, with at most maxThreads running at once.
+
+	The first configuration in the list that finds a valid qyoo wins, no
+	matter which one finishes first, so the result is the same from run to
+	run.  As soon as one finds a qyoo, the ones after it are told to stop,
+	 and the ones before it run to the end in case one of them finds one too.
+	The winner's features (and angle and feature images) are handed over to
+	the processor, so findDots() works just like it would after findQyoo().
+	Each configuration gets the pixel, feature and validation budget in the
+	 processor's params, and they all share the deadline.  The processor's
+	 status says if the winner was cut short, or if there was no winner and
+	 any of them were.
+ */
+class ThresholdSearch
+{
+public:
+    ThresholdSearch(FeatureProcessor *proc);
+
+    // Run the configurations.  Returns the number of valid features
+    //  from the winning configuration, or 0 if none of them found anything.
+    int run();
+
+    std::vector<ThresholdConfig> configs;  // What to try, in order of preference
+    int maxThreads;                         // At most this many at once (0 for one per core)
+
+    int winner;            // Index of the configuration that won, or -1
+    int numRun;            // Configurations that started
+    int numCancelled;      // Configurations that were stopped early
+
+protected:
+    FeatureProcessor *proc;
+};
+
+#endif // THRESHOLDSEARCH_H
@@ -1,7 +1,20 @@
 #include <iostream>
 #include <string>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <csignal>
 #include <gd.h>
 #include "FeatureDetector.h"
+#include "Checkpoint.h"
+#include "ThresholdSearch.h"
+#include "ParallelTrace.h"
+#include "DetectServer.h"
+#include "DetectClient.h"
+#include "FrameRing.h"
+#include "SequenceDetector.h"
+#include "ShardLog.h"
 
 // Global verbose flag for controlling debug output
 bool verbose = false;
@@ -31,21 +44,515 @@ void logVerbose(const std::string& message) {
     }
 }
 
+// Split an argument of the form --name=value
+// Returns true if the argument is the named option
+static bool optionValue(const std::string& arg, const std::string& name, std::string& value) {
+    std::string prefix = name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+static void printUsage(const char *prog) {
+    std::cerr << "Usage: " << prog << " <image_file> [options]" << std::endl;
+    std::cerr << "       " << prog << " --replay <checkpoint_file> [options]" << std::endl;
+    std::cerr << "       " << prog << " --serve=<socket> [options]" << std::endl;
+    std::cerr << "       " << prog << " --client=<socket> <image_file>" << std::endl;
+    std::cerr << "       " << prog << " --load-test=<socket> <image_file> [--clients=<n>] [--requests=<n>]" << std::endl;
+    std::cerr << "       " << prog << " --ring=<shm_name_or_path> [options]" << std::endl;
+    std::cerr << "       " << prog << " --ring-produce=<shm_name|memfd> <image_file>... [--frames=<n>] [--ring-slots=<n>]" << std::endl;
+    std::cerr << "       " << prog << " --batch <image_file_or_dir>... [--jobs=<n>] [options]" << std::endl;
+    std::cerr << "       " << prog << " --manifest=<file> [--shard=<k>/<n>] [--shard-log=<file>] [options]" << std::endl;
+    std::cerr << "       " << prog << " --merge=<out_file> <shard_log>... [--manifest=<file>]" << std::endl;
+    std::cerr << "       " << prog << " --sequence[=<file>] [--y8=<w>x<h>] [options]" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "  --v, --verbose          Debugging output" << std::endl;
+    std::cerr << "  --checkpoint=<file>     Save the processed image for later replay" << std::endl;
+    std::cerr << "  --grad-thresh=<n>       Non-max suppression threshold (not used on replay)" << std::endl;
+    std::cerr << "  --min-thresh=<n>        Tracing low threshold" << std::endl;
+    std::cerr << "  --max-thresh=<n>        Tracing high threshold" << std::endl;
+    std::cerr << "  --closed-dist=<f>       Distance to consider a feature closed" << std::endl;
+    std::cerr << "  --decimate-dist=<f>     Decimation tolerance" << std::endl;
+    std::cerr << "  --model-dist=<f>        Model check distance (model space)" << std::endl;
+    std::cerr << "  --model-frac=<f>        Model check fraction of points" << std::endl;
+    std::cerr << "  --adaptive[=<pct>,<scale>]  Pick thresholds from the image's gradient histogram" << std::endl;
+    std::cerr << "  --max-trace-pixels=<n>  Stop tracing after this many edge pixels" << std::endl;
+    std::cerr << "  --max-features=<n>      Stop tracing after this many features" << std::endl;
+    std::cerr << "  --max-validate-ms=<f>   Time limit for validating features" << std::endl;
+    std::cerr << "  --deadline-ms=<f>       Time limit for tracing and validation together" << std::endl;
+    std::cerr << "  --first-match           Check the likeliest features first, stop at the first qyoo read" << std::endl;
+    std::cerr << "  --find-all              Check every feature and read every qyoo (default)" << std::endl;
+    std::cerr << "  --retry[=<g>,<min>,<max>]  If nothing is found, try again with looser thresholds" << std::endl;
+    std::cerr << "  --portfolio[=<g>,<min>,<max>:...]  Try several thresholds at once, first success in the list wins" << std::endl;
+    std::cerr << "  --jobs=<n>              Threads for --portfolio or --batch (default: one per core)" << std::endl;
+    std::cerr << "  --trace-jobs=<n>        Threads for tracing features, experimental (default: 1)" << std::endl;
+    std::cerr << "  --bench-trace[=<n>]     Time tracing on 1 to n threads against the serial tracer and exit" << std::endl;
+    std::cerr << "  --bench-step            Time the table driven tracer against the reference one and exit" << std::endl;
+    std::cerr << "  --workers=<n>           Detection threads for --serve (default: one per core)" << std::endl;
+    std::cerr << "  --queue=<n>             Connections --serve lets wait before replying busy (default: 16)" << std::endl;
+    std::cerr << "  --clients=<n>           Threads for --load-test (default: 4)" << std::endl;
+    std::cerr << "  --requests=<n>          Requests per thread for --load-test (default: 50)" << std::endl;
+    std::cerr << "  --frames=<n>            Frames for --ring-produce to send (default: one per image)" << std::endl;
+    std::cerr << "  --ring-slots=<n>        Frame slots in the ring --ring-produce makes (default: 4)" << std::endl;
+    std::cerr << "  --read-jobs=<n>         --batch threads reading files (default: 1)" << std::endl;
+    std::cerr << "  --decode-jobs=<n>       --batch threads decoding PNGs (default: a quarter of --jobs)" << std::endl;
+    std::cerr << "  --detect-jobs=<n>       --batch threads detecting (default: the rest of --jobs)" << std::endl;
+    std::cerr << "  --write-jobs=<n>        --batch threads writing results (default: 1)" << std::endl;
+    std::cerr << "  --batch-queue=<n>       Room in each queue between --batch stages (default: two per detect thread)" << std::endl;
+    std::cerr << "  --no-annotations        Don't save the marked up dots to output/" << std::endl;
+    std::cerr << "  --shard=<k>/<n>         Take shard k (from 0) of n of the manifest (default: 0/1)" << std::endl;
+    std::cerr << "  --shard-log=<file>      Where the shard's results go (default: <manifest>.shard<k>-of-<n>.log)" << std::endl;
+    std::cerr << "  --sync-every=<n>        Records between shard log checkpoints (default: 100)" << std::endl;
+    std::cerr << "  --cache=<file>          Keep --serve, --batch and --manifest results by image content in this file" << std::endl;
+    std::cerr << "  --cache-slots=<n>       Results a new --cache file has room for (default: 65536)" << std::endl;
+    std::cerr << "  --y8=<w>x<h>            --sequence input is raw 8 bit gray frames, not Y4M" << std::endl;
+    std::cerr << "  --roi-margin=<f>        Window around the last placement, as a fraction of its size (default: 0.5)" << std::endl;
+    std::cerr << "  --full-every=<n>        Search the whole frame at least every n frames (default: 30)" << std::endl;
+    std::cerr << "  --vote=<n>              Recent reads that vote on each bit (default: 5)" << std::endl;
+    std::cerr << "  --skip-diff=<f>         Skip frames whose 8x8 block means all changed less than this, 0 for none (default: 4)" << std::endl;
+    std::cerr << "  --roi-skip-diff=<f>     Same, for the blocks under the qyoo being followed (default: 1)" << std::endl;
+}
+
+// How many features match point for point, in order
+static int countSameFeatures(FeaturePool &feats, FeaturePool &refFeats) {
+    int numSame = 0;
+    for (unsigned int ii = 0; ii < feats.size() && ii < refFeats.size(); ii++) {
+        const std::list<Feature::Point> &a = feats[ii].points, &b = refFeats[ii].points;
+        if (a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+                                               [](const Feature::Point &p0, const Feature::Point &p1) { return p0.x == p1.x && p0.y == p1.y; }))
+            numSame++;
+    }
+    return numSame;
+}
+
+static bool sameFeatureMap(RawImageLabel32 &featImg, RawImageLabel32 &refFeatImg, int sizeX, int sizeY) {
+    for (int iy = 0; iy < sizeY; iy++)
+        for (int ix = 0; ix < sizeX; ix++)
+            if (featImg.getLabel(ix, iy) != refFeatImg.getLabel(ix, iy))
+                return false;
+    return true;
+}
+
+// Time the parallel tracer against the serial one on the processed image.
+// Also checks how many features come out exactly the same.
+static void benchTrace(FeatureProcessor* proc, int maxThreads) {
+    const int numReps = 10;
+    FeaturePool serialFeats, feats;
+    RawImageLabel32 serialFeatImg(proc->sizeX, proc->sizeY), featImg(proc->sizeX, proc->sizeY);
+
+    for (int threads = 0; threads <= maxThreads; threads++) {
+        if (threads == 1)
+            continue;
+
+        double totalMs = 0.0;
+        for (int rep = 0; rep < numReps; rep++) {
+            FeaturePool &out = (threads == 0) ? serialFeats : feats;
+            RawImageLabel32 &outImg = (threads == 0) ? serialFeatImg : featImg;
+            out.reset();
+            outImg.clear();
+            auto startTime = std::chrono::steady_clock::now();
+            if (threads == 0)
+                CannyFindFeatures(proc->gradImg, proc->thetaImg, proc->params.minThresh, proc->params.maxThresh, out, &outImg, NULL, proc->thinSeeds);
+            else
+                CannyFindFeaturesParallel(proc->gradImg, proc->thetaImg, proc->params.minThresh, proc->params.maxThresh, out, &outImg, threads, NULL, proc->thinSeeds);
+            totalMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        }
+
+        if (threads == 0) {
+            std::cout << "serial: " << totalMs / numReps << " ms, " << serialFeats.size() << " features" << std::endl;
+            continue;
+        }
+
+        // Features are in the same order, so compare them one by one
+        int numSame = countSameFeatures(feats, serialFeats);
+        bool sameMap = sameFeatureMap(featImg, serialFeatImg, proc->sizeX, proc->sizeY);
+        std::cout << threads << " threads: " << totalMs / numReps << " ms, " << feats.size() << " features, "
+                  << numSame << " identical to serial, feature map " << (sameMap ? "identical" : "differs") << std::endl;
+    }
+    std::cout << "(" << std::thread::hardware_concurrency() << " cores available)" << std::endl;
+}
+
+// Time the table driven stepper against the probe by probe reference stepper
+//  on the processed image, and check they trace exactly the same features.
+static void benchStep(FeatureProcessor* proc) {
+    const int numReps = 20;
+    FeaturePool refFeats, feats;
+    RawImageLabel32 refFeatImg(proc->sizeX, proc->sizeY), featImg(proc->sizeX, proc->sizeY);
+
+    double totalMs[2] = {0.0, 0.0};
+    for (int rep = 0; rep < numReps; rep++) {
+        // Alternate so neither one always gets the warm cache
+        for (int which = 0; which < 2; which++) {
+            bool reference = ((rep + which) % 2 == 0);
+            FeaturePool &out = reference ? refFeats : feats;
+            RawImageLabel32 &outImg = reference ? refFeatImg : featImg;
+            out.reset();
+            outImg.clear();
+            auto startTime = std::chrono::steady_clock::now();
+            CannyFindFeatures(proc->gradImg, proc->thetaImg, proc->params.minThresh, proc->params.maxThresh, out, &outImg, NULL, proc->thinSeeds, reference);
+            totalMs[reference ? 0 : 1] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        }
+    }
+
+    int numSame = countSameFeatures(feats, refFeats);
+    bool sameMap = sameFeatureMap(featImg, refFeatImg, proc->sizeX, proc->sizeY);
+    std::cout << "reference: " << totalMs[0] / numReps << " ms, " << refFeats.size() << " features" << std::endl;
+    std::cout << "table: " << totalMs[1] / numReps << " ms, " << feats.size() << " features, "
+              << numSame << " identical to reference, feature map " << (sameMap ? "identical" : "differs") << std::endl;
+    if (totalMs[1] > 0.0)
+        std::cout << "speedup: " << totalMs[0] / totalMs[1] << "x" << std::endl;
+}
+
+// SIGINT and SIGTERM tell the server to stop taking requests and drain
+static DetectServer *runningServer = NULL;
+
+static void stopServer(int) {
+    if (runningServer)
+        runningServer->stop();
+}
+
+// SIGINT and SIGTERM stop the frame ring detector after the frame it's on
+static volatile sig_atomic_t stopRing = 0;
+
+static void stopRingDetector(int) {
+    stopRing = 1;
+}
+
+// SIGINT and SIGTERM stop a manifest run once the images it's started are done
+static volatile sig_atomic_t stopBatch = 0;
+
+static void stopBatchRun(int) {
+    stopBatch = 1;
+}
+
+// Serve detection requests on a Unix socket until we're told to stop
+static int serveRequests(const std::string& socketPath, const DetectionParams& params, bool firstMatch, int numWorkers, int maxQueue,
+                         ResultCache* cache) {
+    DetectServer server;
+    server.params = params;
+    server.firstMatch = firstMatch;
+    server.numWorkers = numWorkers;
+    server.cache = cache;
+    if (maxQueue > 0)
+        server.maxQueue = maxQueue;
+    if (!server.start(socketPath))
+        return 1;
+
+    runningServer = &server;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    signal(SIGPIPE, SIG_IGN);
+    server.run();
+    runningServer = NULL;
+
+    std::cerr << "Served " << server.numServed << " requests, " << server.numBusy << " turned away busy, "
+              << server.numBad << " bad" << std::endl;
+    if (cache)
+        std::cerr << "Cache: " << cache->numHits << " hits, " << cache->numMisses << " misses, " << cache->numStored
+                  << " stored, " << cache->numEvicted << " evicted" << std::endl;
+    return 0;
+}
+
+// Run the back end on a checkpoint written by an earlier run
+static int replayCheckpoint(const std::string& fileName, const DetectionParams& params, bool firstMatch) {
+    FeatureCheckpoint checkpoint;
+    if (!checkpoint.open(fileName.c_str()))
+        return 1;
+
+    FeatureProcessor* proc = checkpoint.makeProcessor();
+    RawImageGray8* srcImg = checkpoint.makeSourceImage();
+    int gradThresh = proc->params.gradThresh;
+    proc->params = params;
+    proc->params.gradThresh = gradThresh;
+
+    logVerbose("Replaying checkpoint with size: " + std::to_string(proc->sizeX) + "x" + std::to_string(proc->sizeY));
+
+    int numFound = firstMatch ? proc->findFirstQyoo(srcImg) : proc->findQyoo();
+    if (proc->status == DetectBudgetExceeded)
+        std::cerr << "Warning: Detection budget exceeded, results may be incomplete." << std::endl;
+
+    if (numFound > 0) {
+        if (proc->featureDots.empty())
+            proc->findDots(srcImg);
+        logVerbose("Feature processing completed successfully.");
+    } else {
+        std::cerr << "No Qyoo found in the image." << std::endl;
+    }
+
+    delete proc;
+    delete srcImg;
+
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <image_file> [--v|--verbose]" << std::endl;
+        printUsage(argv[0]);
         return 1;
     }
 
-    // Check if verbose flag is set
+    std::string image_file;
+    std::string checkpointFile;
+    bool retry = false;
+    bool portfolio = false;
+    std::vector<ThresholdConfig> portfolioConfigs;
+    DefaultThresholdConfigs(portfolioConfigs);
+    int jobs = 0;
+    int benchThreads = 0;
+    bool benchSteps = false;
+    int retryThresh[3] = {-1, -1, -1};
+    bool replay = false;
+    bool firstMatch = false;
+    std::string serveSocket, clientSocket, loadTestSocket;
+    int numWorkers = 0, maxQueue = 0, numClients = 4, numRequests = 50;
+    std::string ringName, ringProduceName;
+    int numFrames = 0, numRingSlots = 4;
+    bool batch = false;
+    ShardPipeline pipeline;
+    std::string manifestFile, shardLogFile, mergeFile;
+    int shardIndex = 0, numShards = 1, syncEvery = 0;
+    std::string cacheFile;
+    long long numCacheSlots = 65536;
+    ResultCache cache;
+    bool sequence = false;
+    std::string sequenceFile;
+    int y8SizeX = 0, y8SizeY = 0;
+    SequenceParams seqParams;
+    std::vector<std::string> inputFiles;
+    DetectionParams params;
+
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
+        std::string value;
         if (arg == "--v" || arg == "--verbose") {
             verbose = true;  // Enable verbose logging
+        } else if (arg == "--replay") {
+            replay = true;
+        } else if (arg == "--first-match") {
+            firstMatch = true;
+        } else if (arg == "--find-all") {
+            firstMatch = false;
+        } else if (arg == "--retry") {
+            retry = true;
+        } else if (optionValue(arg, "--retry", value)) {
+            retry = true;
+            if (sscanf(value.c_str(), "%d,%d,%d", &retryThresh[0], &retryThresh[1], &retryThresh[2]) != 3) {
+                std::cerr << "Expected --retry=<grad>,<min>,<max>" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--portfolio") {
+            portfolio = true;
+        } else if (optionValue(arg, "--portfolio", value)) {
+            portfolio = true;
+            if (!ParseThresholdConfigs(value, portfolioConfigs)) {
+                std::cerr << "Expected --portfolio=<grad>,<min>,<max>:<grad>,<min>,<max>..." << std::endl;
+                return 1;
+            }
+        } else if (optionValue(arg, "--jobs", value)) {
+            jobs = atoi(value.c_str());
+        } else if (optionValue(arg, "--trace-jobs", value)) {
+            params.traceThreads = atoi(value.c_str());
+        } else if (arg == "--bench-trace") {
+            benchThreads = 4;
+        } else if (optionValue(arg, "--bench-trace", value)) {
+            benchThreads = atoi(value.c_str());
+        } else if (arg == "--bench-step") {
+            benchSteps = true;
+        } else if (optionValue(arg, "--serve", value)) {
+            serveSocket = value;
+        } else if (optionValue(arg, "--workers", value)) {
+            numWorkers = atoi(value.c_str());
+        } else if (optionValue(arg, "--queue", value)) {
+            maxQueue = atoi(value.c_str());
+        } else if (optionValue(arg, "--client", value)) {
+            clientSocket = value;
+        } else if (optionValue(arg, "--load-test", value)) {
+            loadTestSocket = value;
+        } else if (optionValue(arg, "--clients", value)) {
+            numClients = atoi(value.c_str());
+        } else if (optionValue(arg, "--requests", value)) {
+            numRequests = atoi(value.c_str());
+        } else if (optionValue(arg, "--ring", value)) {
+            ringName = value;
+        } else if (optionValue(arg, "--ring-produce", value)) {
+            ringProduceName = value;
+        } else if (optionValue(arg, "--frames", value)) {
+            numFrames = atoi(value.c_str());
+        } else if (optionValue(arg, "--ring-slots", value)) {
+            numRingSlots = atoi(value.c_str());
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (optionValue(arg, "--read-jobs", value)) {
+            pipeline.numReadThreads = atoi(value.c_str());
+        } else if (optionValue(arg, "--decode-jobs", value)) {
+            pipeline.numDecodeThreads = atoi(value.c_str());
+        } else if (optionValue(arg, "--detect-jobs", value)) {
+            pipeline.numDetectThreads = atoi(value.c_str());
+        } else if (optionValue(arg, "--write-jobs", value)) {
+            pipeline.numWriteThreads = atoi(value.c_str());
+        } else if (optionValue(arg, "--batch-queue", value)) {
+            pipeline.queueSize = atoi(value.c_str());
+        } else if (optionValue(arg, "--manifest", value)) {
+            manifestFile = value;
+        } else if (optionValue(arg, "--shard", value)) {
+            if (!ParseShard(value, shardIndex, numShards)) {
+                std::cerr << "Expected --shard=<k>/<n> with 0 <= k < n" << std::endl;
+                return 1;
+            }
+        } else if (optionValue(arg, "--shard-log", value)) {
+            shardLogFile = value;
+        } else if (optionValue(arg, "--sync-every", value)) {
+            syncEvery = atoi(value.c_str());
+        } else if (optionValue(arg, "--merge", value)) {
+            mergeFile = value;
+        } else if (optionValue(arg, "--cache-slots", value)) {
+            numCacheSlots = atoll(value.c_str());
+        } else if (optionValue(arg, "--cache", value)) {
+            cacheFile = value;
+        } else if (arg == "--no-annotations") {
+            pipeline.annotate = false;
+        } else if (arg == "--sequence") {
+            sequence = true;
+        } else if (optionValue(arg, "--sequence", value)) {
+            sequence = true;
+            sequenceFile = value;
+        } else if (optionValue(arg, "--y8", value)) {
+            if (sscanf(value.c_str(), "%dx%d", &y8SizeX, &y8SizeY) != 2 || y8SizeX <= 0 || y8SizeY <= 0) {
+                std::cerr << "Expected --y8=<width>x<height>" << std::endl;
+                return 1;
+            }
+        } else if (optionValue(arg, "--roi-margin", value)) {
+            seqParams.roiMargin = atof(value.c_str());
+        } else if (optionValue(arg, "--full-every", value)) {
+            seqParams.fullEvery = atoi(value.c_str());
+        } else if (optionValue(arg, "--vote", value)) {
+            seqParams.voteFrames = atoi(value.c_str());
+        } else if (optionValue(arg, "--skip-diff", value)) {
+            seqParams.skipDiff = atof(value.c_str());
+        } else if (optionValue(arg, "--roi-skip-diff", value)) {
+            seqParams.roiSkipDiff = atof(value.c_str());
+        } else if (arg == "--adaptive") {
+            params.adaptive = true;
+        } else if (optionValue(arg, "--adaptive", value)) {
+            params.adaptive = true;
+            if (sscanf(value.c_str(), "%f,%f", &params.adaptivePercentile, &params.adaptiveScale) != 2) {
+                std::cerr << "Expected --adaptive=<percentile>,<scale>" << std::endl;
+                return 1;
+            }
+        } else if (optionValue(arg, "--checkpoint", value)) {
+            checkpointFile = value;
+        } else if (optionValue(arg, "--grad-thresh", value)) {
+            params.gradThresh = atoi(value.c_str());
+        } else if (optionValue(arg, "--min-thresh", value)) {
+            params.minThresh = atoi(value.c_str());
+        } else if (optionValue(arg, "--max-thresh", value)) {
+            params.maxThresh = atoi(value.c_str());
+        } else if (optionValue(arg, "--closed-dist", value)) {
+            params.closedDist = atof(value.c_str());
+        } else if (optionValue(arg, "--decimate-dist", value)) {
+            params.decimateDist = atof(value.c_str());
+        } else if (optionValue(arg, "--model-dist", value)) {
+            params.modelNearDist = atof(value.c_str());
+        } else if (optionValue(arg, "--model-frac", value)) {
+            params.modelNearFrac = atof(value.c_str());
+        } else if (optionValue(arg, "--max-trace-pixels", value)) {
+            params.maxTracePixels = atoi(value.c_str());
+        } else if (optionValue(arg, "--max-features", value)) {
+            params.maxFeatures = atoi(value.c_str());
+        } else if (optionValue(arg, "--max-validate-ms", value)) {
+            params.maxValidateMs = atof(value.c_str());
+        } else if (optionValue(arg, "--deadline-ms", value)) {
+            params.deadlineMs = atof(value.c_str());
+        } else if (arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            if (image_file.empty())
+                image_file = arg;
+            inputFiles.push_back(arg);
         }
     }
 
-    std::string image_file = argv[1]; // The first argument should be the image file
+    // Only now are the parameters that go into the cache keys settled
+    if (!cacheFile.empty()) {
+        if (!cache.open(cacheFile, numCacheSlots, params, firstMatch))
+            return 1;
+        pipeline.cache = &cache;
+    }
+
+    // The server doesn't need an image
+    if (!serveSocket.empty())
+        return serveRequests(serveSocket, params, firstMatch, numWorkers, maxQueue, cache.isOpen() ? &cache : NULL);
+
+    if (!ringName.empty()) {
+        signal(SIGINT, stopRingDetector);
+        signal(SIGTERM, stopRingDetector);
+        int numDone = RunFrameRingDetector(ringName, params, firstMatch, &stopRing);
+        if (numDone < 0)
+            return 1;
+        std::cerr << "Processed " << numDone << " frames" << std::endl;
+        return 0;
+    }
+
+    if (!mergeFile.empty())
+        return MergeShardLogs(inputFiles, manifestFile, mergeFile);
+
+    // A shard of a manifest.  Stopping early finishes the images under way, so the log is clean.
+    if (!manifestFile.empty()) {
+        signal(SIGINT, stopBatchRun);
+        signal(SIGTERM, stopBatchRun);
+        pipeline.stop = &stopBatch;
+        pipeline.params = params;
+        pipeline.firstMatch = firstMatch;
+        pipeline.setThreads(jobs);
+        pipeline.syncEvery = syncEvery;
+        return RunShard(pipeline, manifestFile, shardIndex, numShards,
+                        shardLogFile.empty() ? ShardLogName(manifestFile, shardIndex, numShards) : shardLogFile);
+    }
+
+    // Frames come from stdin or a file
+    if (sequence) {
+        FILE *fp = sequenceFile.empty() ? stdin : fopen(sequenceFile.c_str(), "rb");
+        if (!fp) {
+            std::cerr << "Error: Unable to open sequence file: " << sequenceFile << std::endl;
+            return 1;
+        }
+        int ret = RunSequence(fp, y8SizeX, y8SizeY, params, seqParams);
+        if (fp != stdin)
+            fclose(fp);
+        return ret;
+    }
+
+    if (image_file.empty()) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (batch) {
+        std::vector<std::string> fileNames;
+        BatchListFiles(inputFiles, fileNames);
+        pipeline.params = params;
+        pipeline.firstMatch = firstMatch;
+        pipeline.setThreads(jobs);
+        bool ok = pipeline.run(fileNames);
+        pipeline.printStats();
+        return ok ? 0 : 1;
+    }
+
+    if (!ringProduceName.empty())
+        return RunFrameRingProducer(ringProduceName, inputFiles, numFrames, numRingSlots);
+
+    if (!clientSocket.empty() || !loadTestSocket.empty())
+        signal(SIGPIPE, SIG_IGN);
+    if (!clientSocket.empty())
+        return RunDetectClient(clientSocket, image_file);
+    if (!loadTestSocket.empty())
+        return RunDetectLoadTest(loadTestSocket, image_file, numClients, numRequests);
+
+    if (replay)
+        return replayCheckpoint(image_file, params, firstMatch);
 
     // Load the image (using gdImagePtr)
     gdImagePtr theImage = loadImage(image_file);
@@ -54,18 +561,10 @@ int main(int argc, char* argv[]) {
     }
 
     // Convert palette-based image to true color if necessary
-    if (!gdImageTrueColor(theImage)) {
-        gdImagePtr trueColorImg = gdImageCreateTrueColor(gdImageSX(theImage), gdImageSY(theImage));
-        if (!trueColorImg) {
-            std::cerr << "Error: Unable to create true color image." << std::endl;
-            gdImageDestroy(theImage);
-            return 1;
-        }
-
-        // Copy the palette-based image into the true color image
-        gdImageCopy(trueColorImg, theImage, 0, 0, 0, 0, gdImageSX(theImage), gdImageSY(theImage));
-        gdImageDestroy(theImage);  // Clean up the original palette-based image
-        theImage = trueColorImg;   // Replace with the true-color image
+    theImage = gdMakeTrueColor(theImage);
+    if (!theImage) {
+        std::cerr << "Error: Unable to create true color image." << std::endl;
+        return 1;
     }
 
     // Get image size from the loaded image
@@ -76,12 +575,54 @@ int main(int argc, char* argv[]) {
 
     // Instantiate the FeatureProcessor with the image and its size
     FeatureProcessor* proc = new FeatureProcessor(theImage, processSizeX, processSizeY);
+    proc->params = params;
     proc->processImage();
 
+    if (benchThreads > 0 || benchSteps) {
+        if (benchThreads > 0)
+            benchTrace(proc, benchThreads);
+        if (benchSteps)
+            benchStep(proc);
+        gdImageDestroy(theImage);
+        delete proc;
+        return 0;
+    }
+
+    // Save the front end results if asked
+    if (!checkpointFile.empty())
+        SaveCheckpoint(checkpointFile.c_str(), proc, theImage);
+
     // Try to find the qyoo in the image
-    if (proc->findQyoo() > 0) {
-        // Process the dots for the qyoo found
-        proc->findDots(theImage);
+    int numFound = 0;
+    if (portfolio) {
+        ThresholdSearch search(proc);
+        search.configs = portfolioConfigs;
+        search.maxThreads = jobs;
+        numFound = search.run();
+    } else if (firstMatch)
+        numFound = proc->findFirstQyoo(theImage);
+    else
+        numFound = proc->findQyoo();
+
+    if (proc->status == DetectBudgetExceeded)
+        std::cerr << "Warning: Detection budget exceeded, results may be incomplete." << std::endl;
+
+    // Second attempt with looser thresholds.  This reuses the gradient.
+    // Not worth it if we already ran out of budget.
+    if (numFound == 0 && retry && proc->status == DetectComplete) {
+        // Half the thresholds, unless we were told otherwise
+        if (retryThresh[0] < 0) {
+            retryThresh[0] = proc->params.gradThresh / 2;
+            retryThresh[1] = proc->params.minThresh / 2;
+            retryThresh[2] = proc->params.maxThresh / 2;
+        }
+        numFound = proc->redoGradient(retryThresh[0], retryThresh[1], retryThresh[2]);
+    }
+
+    if (numFound > 0) {
+        // Process the dots for the qyoo found, unless first match already did
+        if (proc->featureDots.empty())
+            proc->findDots(theImage);
 
         logVerbose("Feature processing completed successfully.");
 